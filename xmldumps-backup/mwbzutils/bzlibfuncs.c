@@ -8,14 +8,76 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <regex.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bzlib_private.h"
 #include "bzlib.h"
+#include "mwbzutils.h"
+
+/*
+   tables for computing the block crc 8 bytes at a time (slice by 8):
+   crc_slice[k][b] is the crc of byte b followed by k zero bytes, and
+   crc_slice[0] is BZ2_crc32Table
+*/
+static UInt32 crc_slice[8][256];
+static pthread_once_t crc_slice_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_slice ( void )
+{
+  Int32 i, k;
+
+  for (i = 0; i < 256; i++) {
+    crc_slice[0][i] = BZ2_crc32Table[i];
+  }
+  for (k = 1; k < 8; k++) {
+    for (i = 0; i < 256; i++) {
+      crc_slice[k][i] = (crc_slice[k-1][i] << 8) ^ BZ2_crc32Table[crc_slice[k-1][i] >> 24];
+    }
+  }
+}
+
+/*
+   run the block crc (big-endian, as bzip2 has it) over len
+   bytes of buf, as BZ_UPDATE_CRC would one byte at a time
+
+   returns:
+     the updated crc
+*/
+UInt32 BZ2_updateBlockCRC ( UInt32 crc, const UChar *buf, size_t len )
+{
+  UInt32 word;
+
+  pthread_once(&crc_slice_once, init_crc_slice);
+  while (len >= 8) {
+    word = crc ^ (((UInt32)buf[0] << 24) | ((UInt32)buf[1] << 16) |
+		  ((UInt32)buf[2] << 8) | (UInt32)buf[3]);
+    crc = crc_slice[7][word >> 24] ^ crc_slice[6][(word >> 16) & 0xff] ^
+      crc_slice[5][(word >> 8) & 0xff] ^ crc_slice[4][word & 0xff] ^
+      crc_slice[3][buf[4]] ^ crc_slice[2][buf[5]] ^
+      crc_slice[1][buf[6]] ^ crc_slice[0][buf[7]];
+    buf += 8;
+    len -= 8;
+  }
+  while (len--) {
+    BZ_UPDATE_CRC ( crc, *buf );
+    buf++;
+  }
+  return crc;
+}
+
+/* runs shorter than this are written a byte at a time rather than by memset */
+#define UNRLE_MEMSET_MIN 16
 
 /*---------------------------------------------------*/
 /* Return  True iff data corruption is discovered.
    Returns False if there is no problem.
+   Unless check_crc is set, the block crc is not computed;
+   for blocks that are not randomised, it is run over each
+   span of output at the end rather than a byte at a time.
 */
-Bool unRLE_obuf_to_output_FAST ( DState* s )
+Bool unRLE_obuf_to_output_FAST ( DState* s, int check_crc )
 {
   UChar k1;
 
@@ -27,7 +89,7 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
 	if (s->strm->avail_out == 0) return False;
 	if (s->state_out_len == 0) break;
 	*( (UChar*)(s->strm->next_out) ) = s->state_out_ch;
-	BZ_UPDATE_CRC ( s->calculatedBlockCRC, s->state_out_ch );
+	if (check_crc) BZ_UPDATE_CRC ( s->calculatedBlockCRC, s->state_out_ch );
 	s->state_out_len--;
 	s->strm->next_out++;
 	s->strm->avail_out--;
@@ -84,21 +146,26 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
     /* end restore */
 
     UInt32       avail_out_INIT = cs_avail_out;
+    Int32        c_run, c_i;
     Int32        s_save_nblockPP = s->save_nblock+1;
     unsigned int total_out_lo32_old;
 
     while (True) {
 
-      /* try to finish existing run */
+      /* try to finish existing run, all but its last byte at once */
       if (c_state_out_len > 0) {
-	while (True) {
-	  if (cs_avail_out == 0) goto return_notr;
-	  if (c_state_out_len == 1) break;
-	  *( (UChar*)(cs_next_out) ) = c_state_out_ch;
-	  BZ_UPDATE_CRC ( c_calculatedBlockCRC, c_state_out_ch );
-	  c_state_out_len--;
-	  cs_next_out++;
-	  cs_avail_out--;
+	if (c_state_out_len > 1) {
+	  c_run = c_state_out_len - 1;
+	  if ((unsigned int)c_run > cs_avail_out) c_run = cs_avail_out;
+	  if (c_run >= UNRLE_MEMSET_MIN)
+	    memset(cs_next_out, c_state_out_ch, c_run);
+	  else {
+	    for (c_i = 0; c_i < c_run; c_i++) cs_next_out[c_i] = c_state_out_ch;
+	  }
+	  c_state_out_len -= c_run;
+	  cs_next_out += c_run;
+	  cs_avail_out -= c_run;
+	  if (c_state_out_len > 1) goto return_notr;
 	}
       s_state_out_len_eq_one:
 	{
@@ -106,7 +173,6 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
 	    c_state_out_len = 1; goto return_notr;
 	  };
 	  *( (UChar*)(cs_next_out) ) = c_state_out_ch;
-	  BZ_UPDATE_CRC ( c_calculatedBlockCRC, c_state_out_ch );
 	  cs_next_out++;
 	  cs_avail_out--;
 	}
@@ -143,6 +209,10 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
     }
 
   return_notr:
+    if (check_crc)
+      c_calculatedBlockCRC = BZ2_updateBlockCRC ( c_calculatedBlockCRC,
+						  (UChar*)(s->strm->next_out),
+						  cs_next_out - s->strm->next_out );
     total_out_lo32_old = s->strm->total_out_lo32;
     s->strm->total_out_lo32 += (avail_out_INIT - cs_avail_out);
     if (s->strm->total_out_lo32 < total_out_lo32_old)
@@ -163,7 +233,15 @@ Bool unRLE_obuf_to_output_FAST ( DState* s )
   return False;
 }
 
-int BZ_API(BZ2_bzDecompress_mine) ( bz_stream *strm )
+/*
+   decompress as much as possible from strm, as BZ2_bzDecompress
+   does but without checking the combined crc at the end of the
+   stream (we may have started in the middle of it); if block_end
+   is set, return BZ_BLOCK_END as soon as all output of a block
+   has been written, so that the caller can keep track of where
+   blocks start in the uncompressed data
+*/
+static int decompress_blocks ( bz_stream *strm, int block_end )
 {
   Bool    corrupt;
   DState* s;
@@ -179,7 +257,7 @@ int BZ_API(BZ2_bzDecompress_mine) ( bz_stream *strm )
 	corrupt = unRLE_obuf_to_output_SMALL ( s ); else
 	corrupt = unRLE_obuf_to_output_FAST  ( s ); */
 
-      corrupt = unRLE_obuf_to_output_FAST  ( s ); 
+      corrupt = unRLE_obuf_to_output_FAST  ( s, 1 ); 
       if (corrupt) return BZ_DATA_ERROR;
       if (s->nblock_used == s->save_nblock+1 && s->state_out_len == 0) {
 	BZ_FINALISE_CRC ( s->calculatedBlockCRC );
@@ -194,6 +272,7 @@ int BZ_API(BZ2_bzDecompress_mine) ( bz_stream *strm )
 	      (s->calculatedCombinedCRC >> 31);
             s->calculatedCombinedCRC ^= s->calculatedBlockCRC;
             s->state = BZ_X_BLKHDR_1;
+            if (block_end) return BZ_BLOCK_END;
       } else {
 	return BZ_OK;
       }
@@ -216,3 +295,821 @@ int BZ_API(BZ2_bzDecompress_mine) ( bz_stream *strm )
 
   return 0;  /*NOTREACHED*/
 }
+
+int BZ_API(BZ2_bzDecompress_mine) ( bz_stream *strm )
+{
+  return decompress_blocks ( strm, 0 );
+}
+
+/*
+   like BZ2_bzDecompress_mine, but returns BZ_BLOCK_END after
+   the output of each block is complete; the next call goes
+   on with the following block
+*/
+int BZ_API(BZ2_bzDecompress_block) ( bz_stream *strm )
+{
+  return decompress_blocks ( strm, 1 );
+}
+
+/*---------------------------------------------------*/
+/* Block decoder that reads its input through a bit reader
+   positioned at any bit of a file or buffer, so that blocks
+   which are not byte aligned need no shifting of the data
+   and no bz2 header fed in first.  It fills in the same
+   DState as the libbz2 decompressor (set up by
+   BZ2_bzDecompressInit), so the output is produced by
+   unRLE_obuf_to_output_FAST as before.
+*/
+
+/* get more input from the file; returns number of bytes got, 0 at eof or error */
+static int refill_input ( bz_bit_reader_t *br )
+{
+  ssize_t n;
+  off_t offset;
+
+  if (br->readahead) {
+    n = readahead_next(br->readahead, &(br->buffer), &offset);
+    if (n <= 0) return 0;
+    br->offset = offset + n;
+    br->next = br->buffer;
+    br->end = br->buffer + n;
+    br->last_read = (int) n;
+    return (int) n;
+  }
+  if (br->fd < 0) return 0;
+  do {
+    n = pread(br->fd, br->buffer, br->buffer_size, br->offset);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) return 0;
+  br->offset += n;
+  br->next = br->buffer;
+  br->end = br->buffer + n;
+  br->last_read = (int) n;
+  return (int) n;
+}
+
+static inline void fill_bits ( bz_bit_reader_t *br )
+{
+  while (br->live <= 56) {
+    if (br->next == br->end && !refill_input(br)) return;
+    br->bits |= ((uint64_t) *(br->next++)) << (56 - br->live);
+    br->live += 8;
+  }
+}
+
+/* numbits from 1 to 32; past the end of the input, zeros are
+   returned and br->overrun is set */
+static inline UInt32 get_bits ( bz_bit_reader_t *br, int numbits )
+{
+  UInt32 value;
+
+  if (br->live < numbits) {
+    fill_bits(br);
+    if (br->live < numbits) {
+      br->overrun = 1;
+      br->live = numbits;
+    }
+  }
+  value = (UInt32) (br->bits >> (64 - numbits));
+  br->bits <<= numbits;
+  br->live -= numbits;
+  return value;
+}
+
+static void skip_bits ( bz_bit_reader_t *br, int numbits )
+{
+  while (numbits > 0) {
+    get_bits(br, numbits > 32 ? 32 : numbits);
+    numbits -= 32;
+  }
+}
+
+/*
+   set up br to read from the file fd, starting at the given
+   bit (0 for the top bit) of the byte at offset; buffer is
+   used for the reads
+*/
+void BZ2_bitReaderInit ( bz_bit_reader_t *br, int fd, off_t offset, int bit,
+			 unsigned char *buffer, int buffer_size )
+{
+  br->bits = 0;
+  br->live = 0;
+  br->buffer = buffer;
+  br->buffer_size = buffer_size;
+  br->next = br->end = buffer;
+  br->fd = fd;
+  br->offset = offset;
+  br->last_read = 0;
+  br->overrun = 0;
+  br->readahead = NULL;
+  skip_bits(br, bit);
+}
+
+/* set up br to read the len bytes of buffer, starting at the given bit */
+void BZ2_bitReaderInitMem ( bz_bit_reader_t *br, unsigned char *buffer, int len, int bit )
+{
+  br->bits = 0;
+  br->live = 0;
+  br->buffer = buffer;
+  br->buffer_size = len;
+  br->next = buffer;
+  br->end = buffer + len;
+  br->fd = -1;
+  br->offset = (off_t) len;
+  br->last_read = len;
+  br->overrun = 0;
+  br->readahead = NULL;
+  skip_bits(br, bit);
+}
+
+/*
+   set up br to read what ra reads from the file, starting at
+   the given bit of the byte at offset, which must be where ra
+   was started; the buffers are ra's
+*/
+void BZ2_bitReaderInitReadahead ( bz_bit_reader_t *br, readahead_t *ra, off_t offset, int bit )
+{
+  br->bits = 0;
+  br->live = 0;
+  br->buffer = NULL;
+  br->buffer_size = 0;
+  br->next = br->end = NULL;
+  br->fd = -1;
+  br->offset = offset;
+  br->last_read = 0;
+  br->overrun = 0;
+  br->readahead = ra;
+  skip_bits(br, bit);
+}
+
+/* returns the position of the next bit to be read, in bits
+   from the start of the file (or buffer) */
+int64_t BZ2_bitReaderTell ( bz_bit_reader_t *br )
+{
+  return ((int64_t) (br->offset - (br->end - br->next)) * 8 - br->live);
+}
+
+/*
+   Huffman codes are decoded by table lookup rather than a bit at
+   a time: the next HUFF_BITS bits of input index a table giving
+   the symbol and its code length.  codes longer than that get
+   a subtable, indexed by the bits after the first HUFF_BITS,
+   from a pool of HUFF_SUB_SIZE entries.  an empty entry (a code
+   too long for the room left in the pool, or input that is no
+   code at all) sends the decoder back to the bit at a time
+   method, which then decodes or rejects it exactly as libbz2
+   would.
+
+   leaf entries are (symbol << 5) | code length, with length 0
+   for empty entries; subtable entries are
+   HUFF_SUBTABLE | (offset in pool << 4) | bits indexing it
+*/
+#define HUFF_BITS 10
+#define HUFF_SUB_SIZE 2048
+#define HUFF_SUBTABLE 0x8000
+
+typedef struct {
+  UInt16 primary[1 << HUFF_BITS];
+  UInt16 sub[HUFF_SUB_SIZE];
+} huff_table_t;
+
+/* fill in the lookup table for one coding table, from its code lengths */
+static void make_huff_table ( huff_table_t *h, UChar *len, Int32 alphaSize,
+			      Int32 minLen, Int32 maxLen )
+{
+  Int32 code[BZ_MAX_ALPHA_SIZE];
+  UChar sub_len[1 << HUFF_BITS];
+  Int32 i, j, n, vec, prefix, extra, used, first, span;
+  UInt16 entry;
+
+  memset(h->primary, 0, sizeof(h->primary));
+
+  /* the codes are assigned as BZ2_hbAssignCodes does it; if there
+     are too many of some length, they can't all be codes, and
+     everything is left to the slow method */
+  vec = 0;
+  for (n = minLen; n <= maxLen; n++) {
+    for (i = 0; i < alphaSize; i++) {
+      if (len[i] == n) {
+	if (vec >= (1 << n)) {
+	  memset(h->primary, 0, sizeof(h->primary));
+	  return;
+	}
+	code[i] = vec++;
+      }
+    }
+    vec <<= 1;
+  }
+
+  memset(sub_len, 0, sizeof(sub_len));
+  for (i = 0; i < alphaSize; i++) {
+    n = len[i];
+    entry = (UInt16)((i << 5) | n);
+    if (n <= HUFF_BITS) {
+      first = code[i] << (HUFF_BITS - n);
+      span = 1 << (HUFF_BITS - n);
+      for (j = 0; j < span; j++) h->primary[first + j] = entry;
+    }
+    else {
+      prefix = code[i] >> (n - HUFF_BITS);
+      if (n > sub_len[prefix]) sub_len[prefix] = n;
+    }
+  }
+
+  used = 0;
+  for (prefix = 0; prefix < (1 << HUFF_BITS); prefix++) {
+    if (! sub_len[prefix]) continue;
+    extra = sub_len[prefix] - HUFF_BITS;
+    if (used + (1 << extra) > HUFF_SUB_SIZE) continue;
+    memset(h->sub + used, 0, (1 << extra) * sizeof(UInt16));
+    h->primary[prefix] = (UInt16)(HUFF_SUBTABLE | (used << 4) | extra);
+    used += 1 << extra;
+  }
+
+  for (i = 0; i < alphaSize; i++) {
+    n = len[i];
+    if (n <= HUFF_BITS) continue;
+    prefix = code[i] >> (n - HUFF_BITS);
+    if (! (h->primary[prefix] & HUFF_SUBTABLE)) continue;
+    extra = h->primary[prefix] & 0xf;
+    first = ((h->primary[prefix] >> 4) & 0x7ff) +
+      ((code[i] & ((1 << (n - HUFF_BITS)) - 1)) << (extra - (n - HUFF_BITS)));
+    span = 1 << (extra - (n - HUFF_BITS));
+    for (j = 0; j < span; j++) h->sub[first + j] = (UInt16)((i << 5) | n);
+  }
+}
+
+static int mtf_method;
+static pthread_once_t mtf_method_once = PTHREAD_ONCE_INIT;
+
+/*
+   the method named by the environment variable MWBZUTILS_MTF
+   ("memmove" or "simd"), MTF_SIMD by default where the compiler
+   has SSE2.  decoder threads may all ask for it at once.
+*/
+static void init_mtf_method ( void )
+{
+  char *name;
+
+  name = getenv("MWBZUTILS_MTF");
+#ifdef __SSE2__
+  if (name != NULL && !strcmp(name, "memmove"))
+    mtf_method = MTF_MEMMOVE;
+  else
+    mtf_method = MTF_SIMD;
+#else
+  (void)name;
+  mtf_method = MTF_MEMMOVE;
+#endif
+}
+
+/* choose how the MTF list is kept up, MTF_MEMMOVE or MTF_SIMD;
+   to be called before any decoder threads are started */
+void BZ2_setMtfMethod ( int method )
+{
+  pthread_once(&mtf_method_once, init_mtf_method);
+  mtf_method = method;
+}
+
+/* returns the method set, or else the one from the environment */
+int BZ2_getMtfMethod ( void )
+{
+  pthread_once(&mtf_method_once, init_mtf_method);
+  return mtf_method;
+}
+
+#ifdef __SSE2__
+/* lanes 0 through n of moved, and the rest of piece */
+static inline __m128i select_lanes_up_to ( Int32 n, __m128i lanes, __m128i moved, __m128i piece )
+{
+  __m128i mask;
+
+  mask = _mm_cmpgt_epi8(_mm_set1_epi8((char)(n + 1)), lanes);
+  return _mm_or_si128(_mm_and_si128(mask, moved), _mm_andnot_si128(mask, piece));
+}
+#endif
+
+/*
+   move the symbol at index v of the MTF list to the front and return it.
+   most indexes are small: in xml text about six in seven are below 16,
+   and in text that compresses poorly most of the rest are below 64.
+   with simd set, those are done in SSE2 registers instead of with a
+   call to memmove: each 16 byte piece of the front of the list is
+   replaced by the 16 bytes starting one before it, in the lanes up
+   to v.  below 16 that is one piece; below 64 all four pieces are
+   done every time, since a loop that stops after the piece holding
+   v would mispredict its exit about as often as not.
+*/
+static inline UChar mtf_to_front ( UChar *mtf, Int32 v, int simd )
+{
+  UChar tmp = mtf[v];
+
+#ifdef __SSE2__
+  if (simd && v < MTF_SIMD_MAX) {
+    __m128i lanes, piece[4], moved[4];
+    int k;
+
+    lanes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    piece[0] = _mm_loadu_si128((__m128i *)mtf);
+    moved[0] = _mm_or_si128(_mm_slli_si128(piece[0], 1), _mm_cvtsi32_si128(tmp));
+    if (v < 16) {
+      moved[0] = select_lanes_up_to(v, lanes, moved[0], piece[0]);
+      _mm_storeu_si128((__m128i *)mtf, moved[0]);
+      return tmp;
+    }
+    /* all the loads before any of the stores, since they overlap */
+    for (k = 1; k < 4; k++) {
+      piece[k] = _mm_loadu_si128((__m128i *)(mtf + 16 * k));
+      moved[k] = _mm_loadu_si128((__m128i *)(mtf + 16 * k - 1));
+    }
+    for (k = 0; k < 4; k++) {
+      _mm_storeu_si128((__m128i *)(mtf + 16 * k),
+		       select_lanes_up_to(v - 16 * k, lanes, moved[k], piece[k]));
+    }
+    return tmp;
+  }
+#endif
+  memmove(mtf + 1, mtf, v);
+  mtf[0] = tmp;
+  return tmp;
+}
+
+static int bwt_method;
+static pthread_once_t bwt_method_once = PTHREAD_ONCE_INIT;
+
+/*
+   the method named by the environment variable MWBZUTILS_BWT
+   ("chain" or "twoway"), BWT_CHAIN by default: on xml text, the
+   single chain finds most of what it needs in cache, and two walks
+   at once push each other out of it.  decoder threads may all ask
+   for it at once.
+*/
+static void init_bwt_method ( void )
+{
+  char *name;
+
+  name = getenv("MWBZUTILS_BWT");
+  if (name != NULL && !strcmp(name, "twoway"))
+    bwt_method = BWT_TWO_WAY;
+  else
+    bwt_method = BWT_CHAIN;
+}
+
+/* choose how blocks are to be put back in order, BWT_CHAIN or BWT_TWO_WAY;
+   to be called before any decoder threads are started */
+void BZ2_setBwtMethod ( int method )
+{
+  pthread_once(&bwt_method_once, init_bwt_method);
+  bwt_method = method;
+}
+
+/* returns the method set, or else the one from the environment */
+int BZ2_getBwtMethod ( void )
+{
+  pthread_once(&bwt_method_once, init_bwt_method);
+  return bwt_method;
+}
+
+/*
+   undo the BWT by walking the chain through tt from both ends at
+   once, forward from the start of the block as unRLE_obuf_to_output_FAST
+   would, and backward from the end.  each step of a walk is a cache
+   miss, but the two walks don't depend on each other, so their
+   misses overlap.  the backward walk needs its own links, which are
+   kept with the bytes, in the same form as tt, in ll16; the block's
+   bytes are put in ll4 in order.  these two are used only by the
+   small decompressor otherwise, and are freed along with tt by
+   BZ2_bzDecompressEnd.
+
+   tt is then rewritten so that its chain runs straight through the
+   bytes in order, starting at 0, and unRLE_obuf_to_output_FAST reads
+   it sequentially.
+
+   returns BZ_OK, or BZ_MEM_ERROR if the buffers can't be had
+*/
+static int undo_bwt_two_way ( bz_stream *strm, DState *s, Int32 nblock )
+{
+  UInt32 *tt = s->tt;
+  UInt32 *lf;
+  UChar *text;
+  UChar uc;
+  Int32 i, j, fwd, back, half;
+  UInt32 v, w;
+
+  if (s->ll16 == NULL) {
+    s->ll16 = strm->bzalloc(strm->opaque, s->blockSize100k * 100000 * sizeof(UInt32), 1);
+    if (s->ll16 == NULL) return BZ_MEM_ERROR;
+  }
+  if (s->ll4 == NULL) {
+    s->ll4 = strm->bzalloc(strm->opaque, s->blockSize100k * 100000, 1);
+    if (s->ll4 == NULL) return BZ_MEM_ERROR;
+  }
+  lf = (UInt32 *)s->ll16;
+  text = s->ll4;
+
+  for (i = 0; i < nblock; i++) {
+    uc = (UChar)(tt[i] & 0xff);
+    j = s->cftab[uc]++;
+    tt[j] |= (i << 8);
+    lf[i] = (j << 8) | uc;
+  }
+
+  /* the row of the block itself ends with its last byte */
+  fwd = tt[s->origPtr] >> 8;
+  back = s->origPtr;
+  half = nblock / 2;
+  for (i = 0; i < half; i++) {
+    v = tt[fwd];
+    w = lf[back];
+    text[i] = (UChar)(v & 0xff);
+    fwd = v >> 8;
+    text[nblock - 1 - i] = (UChar)(w & 0xff);
+    back = w >> 8;
+  }
+  if (nblock & 1)
+    text[half] = (UChar)(tt[fwd] & 0xff);
+
+  /* like the original, the chain goes back to the start at the end,
+     since unRLE_obuf_to_output_FAST can read one past a final run */
+  for (i = 0; i < nblock - 1; i++)
+    tt[i] = text[i] | ((i + 1) << 8);
+  tt[nblock - 1] = text[nblock - 1];
+  return BZ_OK;
+}
+
+/*
+   decode the next block, whose block marker the bit reader is
+   at, up to the point where its output can be produced by
+   BZ2_bzDecodeOutput; block_size is from the bz2 header of the
+   stream, in units of 100k.  this follows BZ2_decompress in
+   libbz2 step by step, with the same checks.
+
+   returns:
+     BZ_OK if the block is ready for output
+     BZ_STREAM_END if an end of stream marker was found instead
+     BZ_UNEXPECTED_EOF if the input ends inside the block
+     BZ_DATA_ERROR or other BZ_ errors on failure
+*/
+static int decode_block ( bz_stream *strm, bz_bit_reader_t *br, int block_size, int method );
+static int decode_output ( bz_stream *strm, int check_crc );
+
+static int decode_block_checked ( bz_stream *strm, bz_bit_reader_t *br, int block_size, int method )
+{
+  int ret;
+
+  ret = decode_block(strm, br, block_size, method);
+  /* zeros read past the end of the input can look like bad data */
+  if (ret != BZ_OK && ret != BZ_MEM_ERROR && ret != BZ_PARAM_ERROR && br->overrun)
+    return BZ_UNEXPECTED_EOF;
+  return ret;
+}
+
+int BZ_API(BZ2_bzDecodeBlock) ( bz_stream *strm, bz_bit_reader_t *br, int block_size )
+{
+  return decode_block_checked(strm, br, block_size, BZ2_getBwtMethod());
+}
+
+/*
+   decode the next block, as BZ2_bzDecodeBlock does, and write at most
+   budget bytes of its output to out, for callers that only want to
+   look at the start of a block.  the whole block must still be read
+   and its Huffman codes decoded, but the BWT is undone along the
+   single chain and only as far as that output needs.  the rest of
+   the block's output is dropped and the bit reader is left at the
+   next block either way.
+
+   returns:
+     BZ_OK if the output was cut short at budget bytes
+     BZ_BLOCK_END if all of the block's output fit; the block crc is not
+       computed, a look at the data needs no more than the data
+     other values as for BZ2_bzDecodeBlock and BZ2_bzDecodeOutput
+   the number of bytes written is left in out_len
+*/
+int BZ_API(BZ2_bzDecodeBlockPrefix) ( bz_stream *strm, bz_bit_reader_t *br, int block_size,
+				      char *out, int budget, int *out_len )
+{
+  DState* s;
+  char *next_out;
+  unsigned int avail_out;
+  int ret;
+
+  *out_len = 0;
+  ret = decode_block_checked(strm, br, block_size, BWT_CHAIN);
+  if (ret != BZ_OK) return ret;
+
+  s = strm->state;
+  next_out = strm->next_out;
+  avail_out = strm->avail_out;
+  strm->next_out = out;
+  strm->avail_out = budget;
+  ret = decode_output(strm, 0);
+  *out_len = strm->next_out - out;
+  strm->next_out = next_out;
+  strm->avail_out = avail_out;
+  if (ret == BZ_OK) s->state = BZ_X_BLKHDR_1;
+  return ret;
+}
+
+static int decode_block ( bz_stream *strm, bz_bit_reader_t *br, int block_size, int method )
+{
+  DState* s;
+  uint64_t magic;
+  UInt32 inuse16, inuse;
+  Int32 i, j, t, v, curr, tmp, minLen, maxLen;
+  Int32 alphaSize, nGroups, nSelectors, nSelectorsRead, EOB, nblockMAX, nblock;
+  Int32 groupNo, groupPos, nextSym, es, N, zn, zvec, gSel, gMinlen;
+  Int32 *gLimit = NULL, *gBase = NULL, *gPerm = NULL;
+  UChar pos[BZ_N_GROUPS], mtf[256], uc;
+  int mtf_simd;
+  huff_table_t huff[BZ_N_GROUPS];
+  huff_table_t *gHuff = NULL;
+  UInt32 entry;
+  UInt32 *tt;
+
+  if (strm == NULL) return BZ_PARAM_ERROR;
+  s = strm->state;
+  if (s == NULL || s->strm != strm) return BZ_PARAM_ERROR;
+  if (block_size < 1 || block_size > 9) return BZ_PARAM_ERROR;
+
+  magic = ((uint64_t) get_bits(br, 24) << 24) | get_bits(br, 24);
+  if (br->overrun) return BZ_UNEXPECTED_EOF;
+  if (magic == BZ2_STREAM_MAGIC) {
+    s->storedCombinedCRC = get_bits(br, 32);
+    s->state = BZ_X_BLKHDR_1;
+    return (br->overrun ? BZ_UNEXPECTED_EOF : BZ_STREAM_END);
+  }
+  if (magic != BZ2_BLOCK_MAGIC) return BZ_DATA_ERROR;
+
+  if (s->tt != NULL && s->blockSize100k != block_size) {
+    strm->bzfree(strm->opaque, s->tt);
+    s->tt = NULL;
+    if (s->ll16 != NULL) strm->bzfree(strm->opaque, s->ll16);
+    if (s->ll4 != NULL) strm->bzfree(strm->opaque, s->ll4);
+    s->ll16 = NULL;
+    s->ll4 = NULL;
+  }
+  if (s->tt == NULL) {
+    s->tt = strm->bzalloc(strm->opaque, block_size * 100000 * sizeof(Int32), 1);
+    if (s->tt == NULL) return BZ_MEM_ERROR;
+  }
+  s->blockSize100k = block_size;
+  tt = s->tt;
+
+  s->storedBlockCRC = get_bits(br, 32);
+  s->blockRandomised = get_bits(br, 1);
+  s->origPtr = get_bits(br, 24);
+  if (s->origPtr < 0 || s->origPtr > 10 + 100000 * block_size)
+    return BZ_DATA_ERROR;
+
+  /* the map of bytes used in the block */
+  inuse16 = get_bits(br, 16);
+  for (i = 0; i < 256; i++) s->inUse[i] = False;
+  for (i = 0; i < 16; i++) {
+    s->inUse16[i] = (inuse16 >> (15 - i)) & 1;
+    if (s->inUse16[i]) {
+      inuse = get_bits(br, 16);
+      for (j = 0; j < 16; j++)
+	if ((inuse >> (15 - j)) & 1) s->inUse[i * 16 + j] = True;
+    }
+  }
+  s->nInUse = 0;
+  for (i = 0; i < 256; i++)
+    if (s->inUse[i]) s->seqToUnseq[s->nInUse++] = i;
+  if (s->nInUse == 0) return BZ_DATA_ERROR;
+  alphaSize = s->nInUse + 2;
+
+  /* the selectors */
+  nGroups = get_bits(br, 3);
+  if (nGroups < 2 || nGroups > BZ_N_GROUPS) return BZ_DATA_ERROR;
+  nSelectorsRead = get_bits(br, 15);
+  if (nSelectorsRead < 1) return BZ_DATA_ERROR;
+  for (i = 0; i < nSelectorsRead; i++) {
+    j = 0;
+    while (get_bits(br, 1)) {
+      j++;
+      if (j >= nGroups) return BZ_DATA_ERROR;
+    }
+    if (br->overrun) return BZ_UNEXPECTED_EOF;
+    /* selectors past the max can't be used and are thrown away */
+    if (i < BZ_MAX_SELECTORS) s->selectorMtf[i] = j;
+  }
+  nSelectors = nSelectorsRead > BZ_MAX_SELECTORS ? BZ_MAX_SELECTORS : nSelectorsRead;
+  for (v = 0; v < nGroups; v++) pos[v] = v;
+  for (i = 0; i < nSelectors; i++) {
+    v = s->selectorMtf[i];
+    tmp = pos[v];
+    while (v > 0) { pos[v] = pos[v-1]; v--; }
+    pos[0] = tmp;
+    s->selector[i] = tmp;
+  }
+
+  /* the coding tables */
+  for (t = 0; t < nGroups; t++) {
+    curr = get_bits(br, 5);
+    for (i = 0; i < alphaSize; i++) {
+      while (True) {
+	if (curr < 1 || curr > 20) return BZ_DATA_ERROR;
+	if (!get_bits(br, 1)) break;
+	if (get_bits(br, 1)) curr--; else curr++;
+      }
+      s->len[t][i] = curr;
+    }
+  }
+  if (br->overrun) return BZ_UNEXPECTED_EOF;
+  for (t = 0; t < nGroups; t++) {
+    minLen = 32;
+    maxLen = 0;
+    for (i = 0; i < alphaSize; i++) {
+      if (s->len[t][i] > maxLen) maxLen = s->len[t][i];
+      if (s->len[t][i] < minLen) minLen = s->len[t][i];
+    }
+    BZ2_hbCreateDecodeTables(&(s->limit[t][0]), &(s->base[t][0]), &(s->perm[t][0]),
+			     &(s->len[t][0]), minLen, maxLen, alphaSize);
+    s->minLens[t] = minLen;
+    make_huff_table(&huff[t], &(s->len[t][0]), alphaSize, minLen, maxLen);
+  }
+
+  /* the MTF values */
+  EOB = s->nInUse + 1;
+  nblockMAX = 100000 * block_size;
+  groupNo = -1;
+  groupPos = 0;
+  gMinlen = 0;
+  for (i = 0; i < 256; i++) s->unzftab[i] = 0;
+  for (i = 0; i < 256; i++) mtf[i] = i;
+  mtf_simd = (BZ2_getMtfMethod() == MTF_SIMD);
+  nblock = 0;
+
+#define GET_MTF_VAL(sym)					\
+  {								\
+    if (groupPos == 0) {					\
+      groupNo++;						\
+      if (groupNo >= nSelectors) return BZ_DATA_ERROR;		\
+      if (br->overrun) return BZ_UNEXPECTED_EOF;		\
+      groupPos = BZ_G_SIZE;					\
+      gSel = s->selector[groupNo];				\
+      gMinlen = s->minLens[gSel];				\
+      gLimit = &(s->limit[gSel][0]);				\
+      gPerm = &(s->perm[gSel][0]);				\
+      gBase = &(s->base[gSel][0]);				\
+      gHuff = &huff[gSel];					\
+    }								\
+    groupPos--;							\
+    if (br->live < 20) fill_bits(br);				\
+    entry = gHuff->primary[br->bits >> (64 - HUFF_BITS)];	\
+    if (entry & HUFF_SUBTABLE)					\
+      entry = gHuff->sub[((entry >> 4) & 0x7ff) +		\
+			 ((br->bits >> (64 - HUFF_BITS - (entry & 0xf))) & \
+			  ((1 << (entry & 0xf)) - 1))];		\
+    if (entry & 0x1f) {						\
+      if (br->live < (int)(entry & 0x1f)) {			\
+	br->overrun = 1;					\
+	br->live = entry & 0x1f;				\
+      }								\
+      br->bits <<= entry & 0x1f;				\
+      br->live -= entry & 0x1f;					\
+      sym = entry >> 5;						\
+    }								\
+    else {							\
+      zn = gMinlen;						\
+      zvec = get_bits(br, zn);					\
+      while (True) {						\
+	if (zn > 20) return BZ_DATA_ERROR;			\
+	if (zvec <= gLimit[zn]) break;				\
+	zn++;							\
+	zvec = (zvec << 1) | get_bits(br, 1);			\
+      }								\
+      if (zvec - gBase[zn] < 0 || zvec - gBase[zn] >= BZ_MAX_ALPHA_SIZE) \
+	return BZ_DATA_ERROR;					\
+      sym = gPerm[zvec - gBase[zn]];				\
+    }								\
+  }
+
+  GET_MTF_VAL(nextSym);
+  while (True) {
+    if (nextSym == EOB) break;
+    if (nextSym == BZ_RUNA || nextSym == BZ_RUNB) {
+      es = -1;
+      N = 1;
+      do {
+	/* a run this long can't be valid, and would overflow es */
+	if (N >= 2*1024*1024) return BZ_DATA_ERROR;
+	if (nextSym == BZ_RUNA) es = es + (0+1) * N; else
+	if (nextSym == BZ_RUNB) es = es + (1+1) * N;
+	N = N * 2;
+	GET_MTF_VAL(nextSym);
+      } while (nextSym == BZ_RUNA || nextSym == BZ_RUNB);
+      es++;
+      uc = s->seqToUnseq[mtf[0]];
+      s->unzftab[uc] += es;
+      if (es > nblockMAX - nblock) return BZ_DATA_ERROR;
+      while (es > 0) {
+	tt[nblock++] = (UInt32) uc;
+	es--;
+      }
+    }
+    else {
+      if (nblock >= nblockMAX) return BZ_DATA_ERROR;
+      /* move to front */
+      v = nextSym - 1;
+      tmp = mtf_to_front(mtf, v, mtf_simd);
+      uc = s->seqToUnseq[tmp];
+      s->unzftab[uc]++;
+      tt[nblock++] = (UInt32) uc;
+      GET_MTF_VAL(nextSym);
+    }
+  }
+#undef GET_MTF_VAL
+  if (br->overrun) return BZ_UNEXPECTED_EOF;
+
+  /* now set up for undoing the BWT, as BZ2_decompress does */
+  if (s->origPtr < 0 || s->origPtr >= nblock) return BZ_DATA_ERROR;
+  for (i = 0; i <= 255; i++) {
+    if (s->unzftab[i] < 0 || s->unzftab[i] > nblock) return BZ_DATA_ERROR;
+  }
+  s->cftab[0] = 0;
+  for (i = 1; i <= 256; i++) s->cftab[i] = s->unzftab[i-1];
+  for (i = 1; i <= 256; i++) s->cftab[i] += s->cftab[i-1];
+  for (i = 0; i <= 256; i++) {
+    if (s->cftab[i] < 0 || s->cftab[i] > nblock) return BZ_DATA_ERROR;
+  }
+  for (i = 1; i <= 256; i++) {
+    if (s->cftab[i-1] > s->cftab[i]) return BZ_DATA_ERROR;
+  }
+
+  s->state_out_len = 0;
+  s->state_out_ch = 0;
+  BZ_INITIALISE_CRC ( s->calculatedBlockCRC );
+  s->state = BZ_X_OUTPUT;
+
+  if (method == BWT_TWO_WAY) {
+    if (undo_bwt_two_way(strm, s, nblock) != BZ_OK) return BZ_MEM_ERROR;
+    s->tPos = 0;
+  }
+  else {
+    for (i = 0; i < nblock; i++) {
+      uc = (UChar)(tt[i] & 0xff);
+      tt[s->cftab[uc]] |= (i << 8);
+      s->cftab[uc]++;
+    }
+    s->tPos = tt[s->origPtr] >> 8;
+  }
+  s->nblock_used = 0;
+  s->save_nblock = nblock;
+  if (s->blockRandomised) {
+    BZ_RAND_INIT_MASK;
+  }
+  if (s->tPos >= (UInt32)nblockMAX) return BZ_DATA_ERROR;
+  s->tPos = tt[s->tPos];
+  s->k0 = (UChar)(s->tPos & 0xff);
+  s->tPos >>= 8;
+  s->nblock_used++;
+  if (s->blockRandomised) {
+    BZ_RAND_UPD_MASK;
+    s->k0 ^= BZ_RAND_MASK;
+  }
+  return BZ_OK;
+}
+
+/*
+   write as much output of the block set up by BZ2_bzDecodeBlock
+   as there is room for in strm->next_out
+
+   returns:
+     BZ_OK if there is more output to come
+     BZ_BLOCK_END if the block's output is complete and its crc checks out
+     BZ_DATA_ERROR or other BZ_ errors on failure
+*/
+static int decode_output ( bz_stream *strm, int check_crc )
+{
+  DState* s;
+
+  if (strm == NULL) return BZ_PARAM_ERROR;
+  s = strm->state;
+  if (s == NULL || s->strm != strm) return BZ_PARAM_ERROR;
+  if (s->state != BZ_X_OUTPUT) return BZ_SEQUENCE_ERROR;
+
+  if (unRLE_obuf_to_output_FAST ( s, check_crc )) return BZ_DATA_ERROR;
+  if (s->nblock_used == s->save_nblock+1 && s->state_out_len == 0) {
+    BZ_FINALISE_CRC ( s->calculatedBlockCRC );
+    if (check_crc && s->calculatedBlockCRC != s->storedBlockCRC)
+      return BZ_DATA_ERROR;
+    s->state = BZ_X_BLKHDR_1;
+    return BZ_BLOCK_END;
+  }
+  return BZ_OK;
+}
+
+int BZ_API(BZ2_bzDecodeOutput) ( bz_stream *strm )
+{
+  return decode_output(strm, 1);
+}
+
+/*
+   as BZ2_bzDecodeOutput, but without computing or checking the
+   block crc, for callers that only look at the data
+*/
+int BZ_API(BZ2_bzDecodeOutputUnchecked) ( bz_stream *strm )
+{
+  return decode_output(strm, 0);
+}
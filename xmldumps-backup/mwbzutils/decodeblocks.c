@@ -0,0 +1,183 @@
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "mwbzutils.h"
+
+/*
+  test driver for decode_bz2_block(): decodes every genuine block of
+  a file, with several threads sharing the one descriptor, and writes
+  the output of the blocks to stdout in order, which should be the
+  same as the output of bzip2 -dc.  each block is first decoded into
+  a buffer of the given size, doubled and tried again for as long as
+  it comes back full.
+  not installed; build it with 'make decodeblocks'.
+*/
+
+void usage(char *message) {
+  char * help =
+"Usage: decodeblocks --filename file [--threads num] [--bufsize num] [--help]\n\n"
+"Decode each block of a bz2 file on its own with decode_bz2_block(), several\n"
+"at once, and write their output to stdout in order.\n\n"
+"Options:\n\n"
+"  -f, --filename   name of file to decode\n"
+"  -t, --threads    number of threads to decode blocks with (default: 3)\n"
+"  -b, --bufsize    size of the output buffer to try first (default: 1048576)\n"
+"  -h, --help       Show this help message\n\n";
+  if (message) {
+    fprintf(stderr,"%s\n\n",message);
+  }
+  fprintf(stderr,"%s",help);
+  exit(-1);
+}
+
+typedef struct {
+  int fin;
+  bmap_t *map;
+  int thread;
+  int threads;
+  size_t bufsize;
+  unsigned char **outputs;  /* output of each block, by map entry */
+  size_t *lengths;
+  int result;
+} decode_job_t;
+
+/* decode every threads'th genuine block, starting from the thread'th */
+void *decode_blocks(void *arg) {
+  decode_job_t *job = (decode_job_t *)arg;
+  int64_t i, genuine = 0;
+  size_t cap;
+  int res;
+
+  job->result = 0;
+  for (i = 0; i < job->map->count; i++) {
+    if (!(job->map->entries[i].flags & BMAP_GENUINE))
+      continue;
+    if (genuine++ % job->threads != job->thread)
+      continue;
+    cap = job->bufsize;
+    do {
+      free(job->outputs[i]);
+      job->outputs[i] = (unsigned char *)malloc(cap);
+      if (job->outputs[i] == NULL) {
+	fprintf(stderr,"failed to allocate output for block\n");
+	job->result = -1;
+	return(NULL);
+      }
+      res = decode_bz2_block(job->fin, job->map->entries[i].offset,
+			     job->map->entries[i].bits_shifted,
+			     job->outputs[i], cap, &(job->lengths[i]));
+      cap *= 2;
+    } while (res == 1);
+    if (res == -1) {
+      fprintf(stderr,"failed to decode block at offset %"PRId64"\n", job->map->entries[i].offset);
+      job->result = -1;
+      return(NULL);
+    }
+  }
+  return(NULL);
+}
+
+int main(int argc, char **argv) {
+  int fin;
+  char *filename = NULL;
+  int threads = 3;
+  size_t bufsize = 1048576;
+  int optindex=0;
+  int optc;
+  int i, result = 0;
+  int64_t j;
+  bmap_t *map;
+  decode_job_t *jobs;
+  pthread_t *thread_ids;
+  unsigned char **outputs;
+  size_t *lengths;
+
+  struct option optvalues[] = {
+    {"bufsize", 1, 0, 'b'},
+    {"filename", 1, 0, 'f'},
+    {"help", 0, 0, 'h'},
+    {"threads", 1, 0, 't'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (1) {
+    optc=getopt_long_only(argc,argv,"b:f:ht:", optvalues, &optindex);
+    if (optc=='f') {
+     filename=optarg;
+    }
+    else if (optc=='b') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to bufsize option\n");
+      bufsize=(size_t)atol(optarg);
+    }
+    else if (optc=='t') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to threads option\n");
+      threads=atoi(optarg);
+    }
+    else if (optc=='h')
+      usage(NULL);
+    else if (optc==-1) break;
+    else usage("Unknown option or other error\n");
+  }
+  if (! filename || threads < 1 || bufsize < 1) {
+    usage(NULL);
+  }
+
+  fin = open (filename, O_RDONLY);
+  if (fin < 0) {
+    fprintf(stderr,"Failed to open file %s for read\n", filename);
+    exit(-1);
+  }
+  map = init_block_map();
+  if (map == NULL || scan_bz2_blocks(fin, 1, 1, map) == -1) {
+    fprintf(stderr,"Failed to find blocks of %s\n", filename);
+    exit(-1);
+  }
+
+  outputs = (unsigned char **)calloc(map->count + 1, sizeof(unsigned char *));
+  lengths = (size_t *)calloc(map->count + 1, sizeof(size_t));
+  jobs = (decode_job_t *)malloc(threads * sizeof(decode_job_t));
+  thread_ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  if (outputs == NULL || lengths == NULL || jobs == NULL || thread_ids == NULL) {
+    fprintf(stderr,"failed to allocate decode jobs\n");
+    exit(-1);
+  }
+  for (i = 0; i < threads; i++) {
+    jobs[i].fin = fin;
+    jobs[i].map = map;
+    jobs[i].thread = i;
+    jobs[i].threads = threads;
+    jobs[i].bufsize = bufsize;
+    jobs[i].outputs = outputs;
+    jobs[i].lengths = lengths;
+    if (pthread_create(&(thread_ids[i]), NULL, decode_blocks, &(jobs[i]))) {
+      fprintf(stderr,"failed to start decode thread\n");
+      exit(-1);
+    }
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(thread_ids[i], NULL);
+    if (jobs[i].result == -1)
+      result = -1;
+  }
+  if (result == -1)
+    exit(-1);
+
+  for (j = 0; j < map->count; j++) {
+    if (outputs[j] != NULL && fwrite(outputs[j], 1, lengths[j], stdout) != lengths[j]) {
+      fprintf(stderr,"failed to write output\n");
+      exit(-1);
+    }
+    free(outputs[j]);
+  }
+  free_bz2_decoder_pool();
+  close(fin);
+  exit(0);
+}
@@ -7,30 +7,41 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
-#include <regex.h>
 #include <getopt.h>
+#include <ctype.h>
 #include "mwbzutils.h"
 
+/* compressed data is read this far ahead of the decoder at a time
+   when dumping to the end of the file */
+#define DUMP_READAHEAD 4194304
+
 void usage(char *message) {
   char * help =
 "Usage: dumpbz2filefromoffset [--version|--help]\n"
-"   or: dumpbz2filefromoffset <infile> <offset>\n\n"
+"   or: dumpbz2filefromoffset [--threads num] <infile> <offset> [raw|uncompressed]\n\n"
 "Find the first bz2 block in a file after the specified offset, uncompress\n"
 "and write contents from that point on to stdout, starting with the first\n"
 "<page> tag encountered.\n\n"
 "The starting <mediawiki> tag and the <siteinfo> header from the file will\n"
 "be written out first.\n\n"
-"Note that some bytes from the very last block may be lost if the blocks are\n"
-"not byte-aligned. This is due to the bzip2 crc at the eof being wrong.\n\n"
+"With 'uncompressed', the offset is taken to be a byte offset in the uncompressed\n"
+"data instead, and the raw contents are written from exactly that byte on, to\n"
+"the end of the stream it is in.  This needs a block map of the file made with\n"
+"'makebz2blockmap --uncompressed'.\n\n"
+"With --threads, that many blocks are decompressed at once by separate threads,\n"
+"while the output is still written in order.\n\n"
 "Exits with BZ_OK on success, various BZ_ errors otherwise.\n\n"
 "Options:\n\n"
 "Flags:\n\n"
+"  -t, --threads    number of threads to decompress with (default: 1, no\n"
+"                   extra threads)\n"
 "  -h, --help       Show this help message\n"
 "  -v, --version    Display the version of this program and exit\n\n"
 "Arguments:\n\n"
 "  <infile>         Name of the file to check\n"
 "  <offset>         byte in the file from which to start processing\n\n"
 "  [raw]            Don't add a header or start from <page> but print raw contents\n"
+"  [uncompressed]   Print raw contents starting from <offset> in the uncompressed data\n\n"
 "Report bugs in dumpbz2filefromoffset to <https://phabricator.wikimedia.org/>.\n\n"
 "See also checkforbz2footer(1), dumplastbz2block(1), findpageidinbz2xml(1),\n"
     "recompressxml(1), writeuptopageid(1)\n\n";
@@ -68,97 +79,50 @@ void show_version(char *version_string) {
       0 on success,
       -1 on error
 */
-int dump_mw_header(int fin) {
-  regmatch_t *match_siteinfo;
-  regex_t compiled_siteinfo;
-  int length=5000; /* output buffer size */
+int dump_mw_header(output_t *out, int fin) {
   char *siteinfo = "  </siteinfo>\n";
 
-  buf_info_t *b;
+  ubuf_t *u;
   bz_info_t bfile;
+  unsigned char *data;
+  size_t len, index;
+  int found = 0;
 
-  int firstpage = 1;
-  int done = 0;
   bfile.initialized = 0;
   bfile.marker = NULL;
+  bfile.skip_crc = 0;
+  bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = 0;
+  bfile.ra = NULL;
 
-  regcomp(&compiled_siteinfo, siteinfo, REG_EXTENDED);
-
-  match_siteinfo = (regmatch_t *)malloc(sizeof(regmatch_t)*1);
-
-  b = init_buffer(length);
+  u = init_ubuf(UBUF_HEADER_SIZE);
+  if (u == NULL)
+    return(-1);
   bfile.bytes_read = 0;
   bfile.position = (off_t)0;
 
-  while ((get_buffer_of_uncompressed_data(b, fin, &bfile, FORWARD)>=0) && (! bfile.eof) && (!done)) {
-    /* fixme either we don't check the return code right or we don't notice no bytes read or we don't clear the bytes read */
-    if (bfile.bytes_read) {
-      if (firstpage) {
-	if (bfile.bytes_read >= 11 && !memcmp((char *)b->next_to_read,"<mediawiki ",11)) {
-	  /* good, write it and loop and not firstpage any more */
-	  if (b->bytes_avail) {
-	    if (regexec(&compiled_siteinfo, (char *)b->next_to_read,  2,  match_siteinfo, 0 ) == 0) {
-	      fwrite(b->next_to_read,match_siteinfo[0].rm_eo, 1, stdout);
-	      b->next_to_read = b->end;
-	      b->bytes_avail = 0;
-	      b->next_to_fill = b->buffer; /* empty */
-	      bfile.strm.next_out = (char *)b->next_to_fill;
-	      bfile.strm.avail_out = b->end - b->next_to_fill;
-	      done++;
-	    }
-	    else {
-	      fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-	      b->next_to_read = b->end;
-	      b->bytes_avail = 0;
-	      b->next_to_fill = b->buffer; /* empty */
-	      bfile.strm.next_out = (char *)b->next_to_fill;
-	      bfile.strm.avail_out = b->end - b->next_to_fill;
-	    }
-	  }
-	}
-	else {
-	  fprintf(stderr,"missing mediawiki header from bz2 xml file\n");
-	  return(-1);
-	}
-	firstpage = 0;
-      }
-      else { /* not firstpage */
-	if (regexec(&compiled_siteinfo, (char *)b->next_to_read,  2,  match_siteinfo, 0 ) == 0) {
-	  fwrite(b->next_to_read,match_siteinfo[0].rm_eo, 1, stdout);
-	  b->next_to_read = b->end;
-	  b->bytes_avail = 0;
-	  b->next_to_fill = b->buffer; /* empty */
-	  bfile.strm.next_out = (char *)b->next_to_fill;
-	  bfile.strm.avail_out = b->end - b->next_to_fill;
-	  done++;
-	}
-	else {
-	  /* could have the first part of the siteinfo tag... so copy up enough bytes to cover that case */
-	  if (b->bytes_avail> 12) {
-	    /* write everything that didn't match, but leave 12 bytes, to stdout */
-	    fwrite(b->next_to_read,b->bytes_avail - 12,1,stdout);
-	    move_bytes_to_buffer_start(b, b->next_to_read + b->bytes_avail - 12, 12);
-	    bfile.strm.next_out = (char *)b->next_to_fill;
-	    bfile.strm.avail_out = b->end - b->next_to_fill;
-	  }
-	  else {
-	    if (buffer_is_empty(b)) {
-	      bfile.strm.next_out = (char *)b->buffer;
-	      bfile.strm.avail_out = bfile.bufout_size;
-	      b->next_to_fill = b->buffer; /* empty */
-	    }
-	    else {
-	      /* there were only 12 or less bytes so just save em don't write em to stdout */
-	      move_bytes_to_buffer_start(b, b->next_to_read, b->bytes_avail);
-	      bfile.strm.next_out = (char *)b->next_to_fill;
-	      bfile.strm.avail_out = b->end - b->next_to_fill;
-	    }
-	  }
-	}
-      } /* end notfirstpage */
+  if (fill_ubuf(u, fin, &bfile) >= 0) {
+    data = ubuf_peek(u, &len);
+    if (len < 11 || memcmp(data, "<mediawiki ", 11)) {
+      fprintf(stderr,"missing mediawiki header from bz2 xml file\n");
+      free_ubuf(u);
+      return(-1);
+    }
+    while (1) {
+      /* write everything up to the tag or up to what might be the start of it */
+      index = ubuf_find(u, siteinfo, &found);
+      if (found)
+	index += strlen(siteinfo);
+      data = ubuf_peek(u, &len);
+      output_write(out, data, index);
+      ubuf_consume(u, index);
+      if (found || bfile.eof || fill_ubuf(u, fin, &bfile) <= 0)
+	break;
     }
   }
-  if (!done) {
+  free_ubuf(u);
+  if (!found) {
     fprintf(stderr,"incomplete or no mediawiki header found\n");
     return(-1);
   }
@@ -167,6 +131,30 @@ int dump_mw_header(int fin) {
   }
 }
 
+/*
+   decompress the rest of bfile straight into the output buffers
+   returns:
+      0 on success (or if the data could not be decompressed, as
+        for the rest of the dump),
+      -1 if the output could not be written
+*/
+int dump_rest_of_file(output_t *out, int fin, bz_info_t *bfile) {
+  unsigned char *space;
+  size_t len;
+
+  while (! bfile->eof) {
+    space = output_space(out, &len);
+    if (space == NULL)
+      return(-1);
+    bfile->strm.next_out = (char *)space;
+    bfile->strm.avail_out = len;
+    if (get_and_decompress_data(bfile, fin, space, len, FORWARD) < 0)
+      break;
+    output_commit(out, bfile->bytes_written);
+  }
+  return(0);
+}
+
 /*
    find the first page id after position in file
    decompress and dump to stdout from that point on
@@ -174,84 +162,46 @@ int dump_mw_header(int fin) {
       0 on success,
       -1 on error
 */
-int dump_from_first_page_id_after_offset(int fin, off_t position) {
-  regmatch_t *match_page;
-  regex_t compiled_page;
-  int length=5000; /* output buffer size */
+int dump_from_first_page_id_after_offset(output_t *out, int fin, off_t position) {
   char *page = "  <page>";
 
-  buf_info_t *b;
+  ubuf_t *u;
   bz_info_t bfile;
-
-  int firstpage = 1;
+  unsigned char *data;
+  size_t len;
+  int found = 0;
+  int res = 0;
 
   bfile.initialized = 0;
   bfile.marker = NULL;
+  bfile.skip_crc = 0;
+  bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = DUMP_READAHEAD;
+  bfile.ra = NULL;
 
-  regcomp(&compiled_page, page, REG_EXTENDED);
-
-  match_page = (regmatch_t *)malloc(sizeof(regmatch_t)*1);
-
-  b = init_buffer(length);
+  u = init_ubuf(UBUF_SIZE);
+  if (u == NULL)
+    return(-1);
   bfile.bytes_read = 0;
   bfile.position = position;
 
-  while ((get_buffer_of_uncompressed_data(b, fin, &bfile, FORWARD)>=0) && (! bfile.eof)) {
-    /* fixme either we don't check the return code right or we don't notice no bytes read or we don't clear the bytes read */
-    if (bfile.bytes_read) {
-      if (firstpage) {
-	if (regexec(&compiled_page, (char *)b->next_to_read,  2,  match_page, 0 ) == 0) {
-	  fwrite(b->next_to_read+match_page[0].rm_so,b->next_to_fill - (b->next_to_read+match_page[0].rm_so), 1, stdout);
-	  b->next_to_read = b->end;
-	  b->bytes_avail = 0;
-	  b->next_to_fill = b->buffer; /* empty */
-	  bfile.strm.next_out = (char *)b->next_to_fill;
-	  bfile.strm.avail_out = b->end - b->next_to_fill;
-	  firstpage = 0;
-	}
-	else {
-	  /* could have the first part of the page tag... so copy up enough bytes to cover that case */
-	  if (b->bytes_avail> 7) {
-	    move_bytes_to_buffer_start(b, b->next_to_read + b->bytes_avail - 7, 7);
-	    bfile.strm.next_out = (char *)b->next_to_fill;
-	    bfile.strm.avail_out = b->end - b->next_to_fill;
-	  }
-	  else {
-	    if (buffer_is_empty(b)) {
-	      bfile.strm.next_out = (char *)b->buffer;
-	      bfile.strm.avail_out = bfile.bufout_size;
-	      b->next_to_fill = b->buffer; /* empty */
-	    }
-	    else {
-	      /* there were only 7 or less bytes so just save em don't write em to stdout */
-	      move_bytes_to_buffer_start(b, b->next_to_read, b->bytes_avail);
-	      bfile.strm.next_out = (char *)b->next_to_fill;
-	      bfile.strm.avail_out = b->end - b->next_to_fill;
-	    }
-	  }
-	}
-      }
-      else {
-	if (b->bytes_avail) {
-	  fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-	  b->next_to_read = b->end;
-	  b->bytes_avail = 0;
-	  b->next_to_fill = b->buffer; /* empty */
-	  bfile.strm.next_out = (char *)b->next_to_fill;
-	  bfile.strm.avail_out = b->end - b->next_to_fill;
-	}
-      }
-    }
+  while (fill_ubuf(u, fin, &bfile) >= 0) {
+    /* throw away everything in front of the tag, or of what might be the start of it */
+    ubuf_consume(u, ubuf_find(u, page, &found));
+    if (found || bfile.eof)
+      break;
   }
-  if (b->bytes_avail) {
-    fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-    b->next_to_read = b->end;
-    b->bytes_avail = 0;
-    b->next_to_fill = b->buffer; /* empty */
-    bfile.strm.next_out = (char *)b->next_to_fill;
-    bfile.strm.avail_out = b->end - b->next_to_fill;
+  /* from the first page on, everything goes out as it is */
+  if (found) {
+    data = ubuf_peek(u, &len);
+    res = output_write(out, data, len);
+    if (res == 0)
+      res = dump_rest_of_file(out, fin, &bfile);
   }
-  return(0);
+  free_ubuf(u);
+  stop_bz2_readahead(&bfile);
+  return(res);
 }
 
 /*
@@ -261,66 +211,220 @@ int dump_from_first_page_id_after_offset(int fin, off_t position) {
       0 on success,
       -1 on error
 */
-int dump_from_offset(int fin, off_t position) {
-  int length=5000; /* output buffer size */
-
-  buf_info_t *b;
+int dump_from_offset(output_t *out, int fin, off_t position) {
   bz_info_t bfile;
+  int res;
 
   bfile.initialized = 0;
   bfile.marker = NULL;
+  bfile.skip_crc = 0;
+  bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = DUMP_READAHEAD;
+  bfile.ra = NULL;
+  bfile.eof = 0;
 
-  b = init_buffer(length);
   bfile.bytes_read = 0;
   bfile.position = position;
 
-  while ((get_buffer_of_uncompressed_data(b, fin, &bfile, FORWARD)>=0) && (! bfile.eof)) {
-    /* fixme either we don't check the return code right or we don't notice no bytes read or we don't clear the bytes read */
-    if (bfile.bytes_read) {
-      if (b->bytes_avail) {
-	fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-	b->next_to_read = b->end;
-	b->bytes_avail = 0;
-	b->next_to_fill = b->buffer; /* empty */
-	bfile.strm.next_out = (char *)b->next_to_fill;
-	bfile.strm.avail_out = b->end - b->next_to_fill;
-      }
-    }
+  res = dump_rest_of_file(out, fin, &bfile);
+  stop_bz2_readahead(&bfile);
+  return(res);
+}
+
+/*
+   decompress and dump to stdout from the specified offset
+   in the uncompressed data, found via the block map
+   returns:
+      0 on success,
+      -1 on error
+*/
+int dump_from_uncompressed_offset(output_t *out, int fin, int64_t uoffset) {
+  ubuf_t *u;
+  bz_info_t bfile;
+  unsigned char *data;
+  size_t len;
+  int res = 0;
+
+  bfile.initialized = 0;
+  bfile.marker = NULL;
+  bfile.skip_crc = 0;
+  bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = DUMP_READAHEAD;
+  bfile.ra = NULL;
+
+  u = init_ubuf(UBUF_SIZE);
+  if (u == NULL)
+    return(-1);
+  if (seek_to_uncompressed_offset(u, fin, &bfile, uoffset) == -1) {
+    free_ubuf(u);
+    stop_bz2_readahead(&bfile);
+    return(-1);
   }
-  if (b->bytes_avail) {
-    fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-    b->next_to_read = b->end;
-    b->bytes_avail = 0;
-    b->next_to_fill = b->buffer; /* empty */
-    bfile.strm.next_out = (char *)b->next_to_fill;
-    bfile.strm.avail_out = b->end - b->next_to_fill;
+  data = ubuf_peek(u, &len);
+  if (len) {
+    res = output_write(out, data, len);
+    if (res == 0)
+      res = dump_rest_of_file(out, fin, &bfile);
+  }
+  free_ubuf(u);
+  stop_bz2_readahead(&bfile);
+  return(res);
+}
+
+/* where the output of the threaded dumps is, between blocks */
+typedef struct {
+  int found_page;         /* set once the first <page> tag has been written */
+  unsigned char tail[7];  /* end of the last block, for a tag split across blocks */
+  int tail_len;
+  int64_t skip;           /* bytes still to be thrown away */
+  output_t *out;
+} dump_state_t;
+
+/*
+   find the start of "  <page>" in buf
+   returns:
+      its index, or -1 if not there
+*/
+int find_page_tag(unsigned char *buf, size_t len) {
+  unsigned char *p = buf + 2, *end = buf + len;
+
+  while (end - p >= 6 && (p = memchr(p, '<', end - p - 5)) != NULL) {
+    if (!memcmp(p - 2, "  <page>", 8))
+      return(p - 2 - buf);
+    p++;
+  }
+  return(-1);
+}
+
+int write_raw_output(unsigned char *buf, size_t len, void *data) {
+  dump_state_t *state = (dump_state_t *)data;
+
+  return(output_write(state->out, buf, len));
+}
+
+int write_output_from_page(unsigned char *buf, size_t len, void *data) {
+  dump_state_t *state = (dump_state_t *)data;
+  unsigned char joined[14];
+  int index, head;
+
+  if (state->found_page)
+    return(output_write(state->out, buf, len));
+  /* a tag that starts in the last block and ends in this one */
+  head = len < 7 ? len : 7;
+  memcpy(joined, state->tail, state->tail_len);
+  memcpy(joined + state->tail_len, buf, head);
+  index = find_page_tag(joined, state->tail_len + head);
+  if (index >= 0 && index < state->tail_len) {
+    state->found_page = 1;
+    if (output_write(state->out, joined + index, state->tail_len - index) == -1)
+      return(-1);
+    return(output_write(state->out, buf, len));
+  }
+  index = find_page_tag(buf, len);
+  if (index >= 0) {
+    state->found_page = 1;
+    return(output_write(state->out, buf + index, len - index));
+  }
+  if (len >= 7) {
+    memcpy(state->tail, buf + len - 7, 7);
+    state->tail_len = 7;
+  }
+  else {
+    memcpy(joined, state->tail, state->tail_len);
+    memcpy(joined + state->tail_len, buf, len);
+    head = state->tail_len + len > 7 ? state->tail_len + len - 7 : 0;
+    state->tail_len = state->tail_len + len - head;
+    memcpy(state->tail, joined + head, state->tail_len);
   }
   return(0);
 }
 
+int write_output_after_skip(unsigned char *buf, size_t len, void *data) {
+  dump_state_t *state = (dump_state_t *)data;
+
+  if ((int64_t)len <= state->skip) {
+    state->skip -= len;
+    return(0);
+  }
+  buf += state->skip;
+  len -= state->skip;
+  state->skip = 0;
+  return(output_write(state->out, buf, len));
+}
+
+/*
+   decompress with the given number of threads and dump to stdout,
+   from the first <page> tag after position, from position itself
+   if raw is set (it must be the start of a bz2 block), or from
+   position in the uncompressed data if uncompressed is set
+   returns:
+      0 on success,
+      -1 on error
+*/
+int dump_with_threads(output_t *out, int fin, off_t position, int raw, int uncompressed, int threads) {
+  dump_state_t state;
+  bmap_entry_t *entry;
+
+  state.found_page = 0;
+  state.tail_len = 0;
+  state.skip = 0;
+  state.out = out;
+  if (uncompressed) {
+    if (find_block_for_uncompressed_offset(fin, (int64_t)position, &entry) != 1) {
+      fprintf(stderr,"no block map with uncompressed offsets for this file, run makebz2blockmap --uncompressed\n");
+      return(-1);
+    }
+    state.skip = (int64_t)position - entry->uncompressed_offset;
+    if (decompress_blocks_parallel(fin, entry->offset, threads, write_output_after_skip, &state) == -1)
+      return(-1);
+    if (state.skip) {
+      fprintf(stderr,"uncompressed offset %"PRId64" is past the end of the data\n", (int64_t)position);
+      return(-1);
+    }
+    return(0);
+  }
+  else if (raw) {
+    return(decompress_blocks_parallel(fin, position, threads, write_raw_output, &state));
+  }
+  /* as without threads, pages are written even if the header is not */
+  dump_mw_header(out, fin);
+  return(decompress_blocks_parallel(fin, position, threads, write_output_from_page, &state));
+}
+
 int main(int argc, char **argv) {
   int fin, res;
   off_t position;
+  output_t *out;
   int raw = 0;
+  int uncompressed = 0;
+  int threads = 0;
 
   int optc;
   int optindex=0;
 
   struct option optvalues[] = {
     {"help", 0, 0, 'h'},
+    {"threads", 1, 0, 't'},
     {"version", 0, 0, 'v'},
     {NULL, 0, NULL, 0}
   };
 
-  if (argc < 2 || argc > 4) {
+  if (argc < 2 || argc > 6) {
     usage("Missing or bad options/arguments");
     exit(-1);
   }
 
   while (1) {
-    optc=getopt_long_only(argc,argv,"hv", optvalues, &optindex);
+    optc=getopt_long_only(argc,argv,"ht:v", optvalues, &optindex);
     if (optc=='h')
       usage(NULL);
+    else if (optc=='t') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to threads option\n");
+      threads=atoi(optarg);
+      if (threads < 1) usage("Bad argument to threads option\n");
+    }
     else if (optc=='v')
       show_version(VERSION);
     else if (optc==-1) break;
@@ -336,6 +440,8 @@ int main(int argc, char **argv) {
     fprintf(stderr,"failed to open file %s for read\n", argv[optind]);
     exit(-1);
   }
+  set_io_policy(fin, IO_POLICY_STREAM);
+  load_block_map(argv[optind], fin);
   optind++;
   if (optind >= argc) {
     usage("Missing offset argument.");
@@ -351,14 +457,28 @@ int main(int argc, char **argv) {
     if (! strcmp(argv[optind], "raw")) {
       raw = 1;
     }
+    else if (! strcmp(argv[optind], "uncompressed")) {
+      uncompressed = 1;
+    }
   }
+  out = init_output(fileno(stdout));
+  if (out == NULL)
+    exit(-1);
   /* input file, starting position in file, length of buffer for reading */
-  if (!raw) {
-    res = dump_mw_header(fin);
-    res = dump_from_first_page_id_after_offset(fin, position);
+  if (threads) {
+    res = dump_with_threads(out, fin, position, raw, uncompressed, threads);
+  }
+  else if (uncompressed) {
+    res = dump_from_uncompressed_offset(out, fin, (int64_t) position);
+  }
+  else if (!raw) {
+    res = dump_mw_header(out, fin);
+    res = dump_from_first_page_id_after_offset(out, fin, position);
   }
   else {
-    res = dump_from_offset(fin, position);
+    res = dump_from_offset(out, fin, position);
   }
+  if (free_output(out) == -1)
+    res = -1;
   exit(res);
 }
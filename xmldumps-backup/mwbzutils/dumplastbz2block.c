@@ -63,9 +63,9 @@ int main(int argc, char **argv) {
 
   int fin;
   int result;
-  buf_info_t *b;
-
-  int length = 5000; /* output buffer size */
+  ubuf_t *u;
+  unsigned char *data;
+  size_t len;
 
   int optc;
   int optindex=0;
@@ -100,6 +100,8 @@ int main(int argc, char **argv) {
     fprintf(stderr,"failed to open file %s for read\n", argv[optind]);
     exit(-1);
   }
+  set_io_policy(fin, IO_POLICY_PROBE);
+  load_block_map(argv[optind], fin);
 
   bfile.file_size = get_file_size(fin);
   bfile.footer = init_footer();
@@ -114,37 +116,33 @@ int main(int argc, char **argv) {
   }
   bfile.position -=(off_t)6; /* size of marker */
   bfile.initialized = 0;
-  b = init_buffer(length);
+  bfile.skip_crc = 0;
+  u = init_ubuf(UBUF_SIZE);
+  if (u == NULL)
+    exit(-1);
   bfile.bytes_read = 0;
   bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = 0;
+  bfile.ra = NULL;
 
-  if (find_first_bz2_block_from_offset(&bfile, fin, bfile.position, BACKWARD, (off_t)0, 1) <= (off_t)0) {
+  if (find_first_bz2_block_from_offset(&bfile, fin, bfile.position, BACKWARD, (off_t)0) <= (off_t)0) {
     fprintf(stderr,"failed to find block in bz2file\n");
     exit(-1);
   }
-  while ((get_buffer_of_uncompressed_data(b, fin, &bfile, FORWARD)>=0) && (! bfile.eof) && (! bfile.position == (off_t)0)) {
-    if (bfile.bytes_read) {
-      fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-      b->next_to_read = b->end;
-      b->bytes_avail = 0;
-      b->next_to_fill = b->buffer; /* empty */
-      bfile.strm.next_out = (char *)b->next_to_fill;
-      bfile.strm.avail_out = b->end - b->next_to_fill;
-    }
-    else {
+  while (fill_ubuf(u, fin, &bfile) >= 0) {
+    data = ubuf_peek(u, &len);
+    fwrite(data,len,1,stdout);
+    ubuf_consume(u, len);
+    if (bfile.eof || bfile.position == (off_t)0)
+      break;
+    if (! bfile.bytes_read) {
       /* should never happen */
       fprintf(stderr,"there was a block but now it's gone, giving up\n");
       exit(-1);
     }
   }
-  if (b->bytes_avail) {
-    fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-    b->next_to_read = b->end;
-    b->bytes_avail = 0;
-    b->next_to_fill = b->buffer; /* empty */
-    bfile.strm.next_out = (char *)b->next_to_fill;
-    bfile.strm.avail_out = b->end - b->next_to_fill;
-  }
+  free_ubuf(u);
   close(fin);
   exit(0);
 }
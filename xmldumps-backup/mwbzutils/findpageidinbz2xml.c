@@ -7,8 +7,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
 #include <sys/types.h>
-#include <regex.h>
 #include <inttypes.h>
 #include <zlib.h>
 #include "mwbzutils.h"
@@ -32,6 +32,9 @@ void usage(char *message) {
 "large number of iterations without findind a page tag (some pages have > 500K\n"
 "revisions and a heck of a lot of text).\n"
 "If both 'useapi' and 'stubfile' are specified, the api will be used as it is faster.\n\n"
+"If the file has an up to date block map made by 'makebz2blockmap --ids', the\n"
+"block is looked up in the map and nothing is decompressed; it is then the last\n"
+"block in which a page with the given id or a smaller one starts.\n\n"
 "Exits with 0 in success, -1 on error.\n\n"
 "Options:\n\n"
 "  -f, --filename   name of file to search\n"
@@ -73,75 +76,73 @@ void show_version(char *version_string) {
 extern char * geturl(char *hostname, int port, char *url);
 
 char *get_hostname_from_xml_header(int fin) {
-  regmatch_t *match_base_expr;
-  regex_t compiled_base_expr;
   /*	 <base>http://el.wiktionary.org/wiki/...</base> */
   /*  <base>http://trouble.localdomain/wiki/ */
-  char *base_expr = "<base>http://([^/]+)/";
-  int length=5000; /* output buffer size */
+  char *base_expr = "<base>http://";
 
-  buf_info_t *b;
+  ubuf_t *u;
   bz_info_t bfile;
+  unsigned char *data, *base, *base_end = NULL;
+  size_t len;
 
   int hostname_length = 0;
+  char *result = NULL;
 
-  off_t old_position;
   static char hostname[256];
 
   bfile.initialized = 0;
   bfile.marker = NULL;
+  /* only the first part of the header is decoded, to find the
+     hostname; the block is never read to its end to check its crc */
+  bfile.skip_crc = 1;
+  bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = 0;
+  bfile.ra = NULL;
 
-  regcomp(&compiled_base_expr, base_expr, REG_EXTENDED);
-  match_base_expr = (regmatch_t *)malloc(sizeof(regmatch_t)*2);
-
-  b = init_buffer(length);
+  u = init_ubuf(UBUF_HEADER_SIZE);
+  if (u == NULL)
+    return(NULL);
   bfile.bytes_read = 0;
 
   bfile.position = (off_t)0;
-  old_position = lseek(fin,(off_t)0,SEEK_CUR);
-  lseek(fin,(off_t)0,SEEK_SET);
-
-  while ((get_buffer_of_uncompressed_data(b, fin, &bfile, FORWARD)>=0) && (! bfile.eof)) {
-    /* so someday the header might grow enough that <base> isn't in the first 1000 characters but we'll ignore that for now */
-    if (bfile.bytes_read && b->bytes_avail > 1000) {
-      /* get project name and language name from the file header
-	 format:
-	 <mediawiki xmlns="http://www.mediawiki.org/xml/export-0.5/" xmlns:xsi="http://www.w3.org/2001/XMLSchema-instance" xsi:schemaLocation="http://www.mediawiki.org/xml/export-0.5/ http://www.mediawiki.org/xml/export-0.5.xsd" version="0.5" xml:lang="el">
-	 <siteinfo>
-	 <sitename>Βικιλεξικό</sitename>
-	 <base>http://el.wiktionary.org/wiki/...</base>
-      */
-      if (regexec(&compiled_base_expr, (char *)b->next_to_read,  2,  match_base_expr, 0 ) == 0) {
-	if (match_base_expr[1].rm_so >=0) {
-	  hostname_length = match_base_expr[1].rm_eo - match_base_expr[1].rm_so;
-	  if (hostname_length > sizeof(hostname)) {
-	    fprintf(stderr,"Very long hostname, giving up\n");
-	    break;
-	  }
-	  else {
-	    memcpy(hostname,(char *)b->next_to_read + match_base_expr[1].rm_so, hostname_length);
-	    hostname[hostname_length] = '\0';
-	    b->next_to_read = b->end;
-	    b->bytes_avail = 0;
-	    b->next_to_fill = b->buffer; /* empty */
-	    bfile.strm.next_out = (char *)b->next_to_fill;
-	    bfile.strm.avail_out = b->end - b->next_to_fill;
-	    BZ2_bzDecompressEnd ( &(bfile.strm) );
-	    lseek(fin,old_position,SEEK_SET);
-	    free_buffer(b);
-	    return(hostname);
-	  }
-	}
+
+  /* so someday the header might grow enough that <base> isn't in the first 1000 characters but we'll ignore that for now */
+  do {
+    if (fill_ubuf(u, fin, &bfile) <= 0)
+      break;
+    data = ubuf_peek(u, &len);
+  } while (len <= 1000 && !bfile.eof);
+  data = ubuf_peek(u, &len);
+  if (len > 1000) {
+    /* get project name and language name from the file header
+       format:
+       <mediawiki xmlns="http://www.mediawiki.org/xml/export-0.5/" xmlns:xsi="http://www.w3.org/2001/XMLSchema-instance" xsi:schemaLocation="http://www.mediawiki.org/xml/export-0.5/ http://www.mediawiki.org/xml/export-0.5.xsd" version="0.5" xml:lang="el">
+       <siteinfo>
+       <sitename>Βικιλεξικό</sitename>
+       <base>http://el.wiktionary.org/wiki/...</base>
+    */
+    base = (unsigned char *)strstr((char *)data, base_expr);
+    if (base) {
+      base += strlen(base_expr);
+      base_end = (unsigned char *)strchr((char *)base, '/');
+    }
+    if (base_end && base_end > base) {
+      hostname_length = base_end - base;
+      if (hostname_length >= sizeof(hostname)) {
+	fprintf(stderr,"Very long hostname, giving up\n");
       }
       else {
-	break;
+	memcpy(hostname, base, hostname_length);
+	hostname[hostname_length] = '\0';
+	result = hostname;
       }
     }
   }
   BZ2_bzDecompressEnd ( &(bfile.strm) );
-  lseek(fin,old_position,SEEK_SET);
-  free_buffer(b);
-  return(NULL);
+  free_read_window(bfile.window);
+  free_ubuf(u);
+  return(result);
 }
 
 int has_xml_tag(char *line, char *tag) {
@@ -222,9 +223,8 @@ int get_page_id_from_rev_id_via_api(long int rev_id, int fin) {
   char *buffer;
   long int page_id = -1;
   char *api_call = "/w/api.php?action=query&format=xml&revids=";
-  regmatch_t *match_page_id_expr;
-  regex_t compiled_page_id_expr;
-  char *page_id_expr = "<pages><page pageid=\"([0-9]+)\"";
+  char *page_id_expr = "<pages><page pageid=\"";
+  char *page_id_start;
 
   hostname = get_hostname_from_xml_header(fin);
   if (!hostname) {
@@ -249,18 +249,39 @@ int get_page_id_from_rev_id_via_api(long int rev_id, int fin) {
        format:
        <?xml version="1.0"?><api><query><pages><page pageid="6215" ns="0" title="hystérique" /></pages></query></api>
     */
-    match_page_id_expr = (regmatch_t *)malloc(sizeof(regmatch_t)*3);
-    regcomp(&compiled_page_id_expr, page_id_expr, REG_EXTENDED);
-
-    if (regexec(&compiled_page_id_expr, buffer,  3,  match_page_id_expr, 0 ) == 0) {
-      if (match_page_id_expr[2].rm_so >=0) {
-	page_id = atol(buffer + match_page_id_expr[2].rm_so);
-      }
+    page_id_start = strstr(buffer, page_id_expr);
+    if (page_id_start) {
+      page_id_start += strlen(page_id_expr);
+      if (isdigit(*page_id_start))
+	page_id = atol(page_id_start);
     }
     return(page_id);
   }
 }
 
+/*
+   scan xml for the first page id, noting the first rev id
+   seen on the way in *rev_id if it is not yet set
+   returns:
+      page id, or 0 if none found
+*/
+int64_t scan_for_page_id(id_scan_t *scan, unsigned char *data, size_t len, long int *rev_id) {
+  int64_t id, tag_offset;
+  size_t used;
+  int type;
+
+  while (len) {
+    used = scan_for_ids(scan, data, len, &type, &id, &tag_offset);
+    data += used;
+    len -= used;
+    if (type == ID_SCAN_PAGE)
+      return(id);
+    if (type == ID_SCAN_REV && !*rev_id)
+      *rev_id = id;
+  }
+  return(0);
+}
+
 /*
    get the first page id after position in file
    if a pageid is found, the structure pinfo will be updated accordingly
@@ -274,36 +295,30 @@ int get_page_id_from_rev_id_via_api(long int rev_id, int fin) {
       -1 on error
 */
 int get_first_page_id_after_offset(int fin, off_t position, id_info_t *pinfo, int use_api, int use_stub, char *stubfilename, int verbose) {
-  regmatch_t *match_page, *match_page_id, *match_rev, *match_rev_id;
-  regex_t compiled_page, compiled_page_id, compiled_rev, compiled_rev_id;
-  int length=5000; /* output buffer size */
-  char *page = "<page>";
-  char *page_id = "<page>\n[ ]+<title>[^<]+</title>\n([ ]+<ns>[0-9]+</ns>\n)?[ ]+<id>([0-9]+)</id>\n";
-  char *rev = "<revision>";
-  char *rev_id_expr = "<revision>\n[ ]+<id>([0-9]+)</id>\n";
-
-  buf_info_t *b;
+  ubuf_t *u;
   bz_info_t bfile;
+  id_scan_t scan;
   long int rev_id=0;
   long int page_id_found=0;
+  int64_t id;
 
   int buffer_count = 0;
+  int64_t bytes_decoded = 0;
+  unsigned char *prefix;
+  unsigned char *data;
+  size_t len;
+  int res;
+  int prefix_len;
 
   bfile.initialized = 0;
   bfile.marker = NULL;
+  /* blocks are decoded only until a page id turns up, which is
+     usually well before their end, and nothing is passed on */
+  bfile.skip_crc = 1;
   bfile.header_read = 0;
-
-  regcomp(&compiled_page, page, REG_EXTENDED);
-  regcomp(&compiled_page_id, page_id, REG_EXTENDED);
-  regcomp(&compiled_rev, rev, REG_EXTENDED);
-  regcomp(&compiled_rev_id, rev_id_expr, REG_EXTENDED);
-
-  match_page = (regmatch_t *)malloc(sizeof(regmatch_t)*1);
-  match_page_id = (regmatch_t *)malloc(sizeof(regmatch_t)*3);
-  match_rev = (regmatch_t *)malloc(sizeof(regmatch_t)*1);
-  match_rev_id = (regmatch_t *)malloc(sizeof(regmatch_t)*2);
-
-  b = init_buffer(length);
+  bfile.window = NULL;
+  bfile.readahead = 0;
+  bfile.ra = NULL;
 
   pinfo->bits_shifted = -1;
   pinfo->position = (off_t)-1;
@@ -311,123 +326,92 @@ int get_first_page_id_after_offset(int fin, off_t position, id_info_t *pinfo, in
 
   bfile.bytes_read = 0;
 
-  if (find_first_bz2_block_from_offset(&bfile, fin, position, FORWARD, (off_t)0, 1) <= (off_t)0) {
+  if (find_first_bz2_block_from_offset(&bfile, fin, position, FORWARD, (off_t)0) <= (off_t)0) {
     if (verbose) fprintf(stderr,"failed to find block in bz2file after offset %"PRId64" (1)\n", position);
+    free_read_window(bfile.window);
     return(-1);
   }
 
   if (verbose) fprintf(stderr,"found first block in bz2file after offset %"PRId64"\n", position);
 
-  while (!get_buffer_of_uncompressed_data(b, fin, &bfile, FORWARD) && (! bfile.eof)) {
+  /* the first page usually starts near the beginning of the block, so
+     try the start of the block by itself first */
+  prefix = (unsigned char *)malloc(PROBE_BUDGET);
+  if (prefix == NULL) {
+    fprintf(stderr,"failed to allocate buffer for block prefix\n");
+    free_read_window(bfile.window);
+    return(-1);
+  }
+  prefix_len = get_block_prefix(fin, &bfile, prefix, PROBE_BUDGET);
+  if (prefix_len >= 0) {
+    init_id_scan(&scan);
+    id = scan_for_page_id(&scan, prefix, prefix_len, &rev_id);
+    if (id) {
+      pinfo->id = id;
+      pinfo->position = bfile.block_start;
+      pinfo->bits_shifted = bfile.bits_shifted;
+      free(prefix);
+      free_read_window(bfile.window);
+      return(1);
+    }
+  }
+  free(prefix);
+  if (verbose) fprintf(stderr,"no page id at the start of the block, decoding all of it\n");
+
+  u = init_ubuf(UBUF_SIZE);
+  if (u == NULL) {
+    free_read_window(bfile.window);
+    return(-1);
+  }
+  /* the scan keeps a tag or id split between one window and the
+     next, so each window is used up in full */
+  init_id_scan(&scan);
+  while ((res = fill_ubuf(u, fin, &bfile)) >= 0) {
     buffer_count++;
+    bytes_decoded += res;
     if (verbose >=2) fprintf(stderr,"buffers read: %d\n", buffer_count);
-    if (bfile.bytes_written) {
-      while (regexec(&compiled_page_id, (char *)b->next_to_read,  3,  match_page_id, 0 ) == 0) {
-	if (match_page_id[2].rm_so >=0) {
-	  if (verbose){
-	    fwrite(b->next_to_read+match_page_id[2].rm_so, sizeof(unsigned char), match_page_id[2].rm_eo - match_page_id[2].rm_so, stderr);
-	    fwrite("\n",1,1,stderr);
-	  }
-	  pinfo->id = atoi((char *)(b->next_to_read+match_page_id[2].rm_so));
-	  pinfo->position = bfile.block_start;
-	  pinfo->bits_shifted = bfile.bits_shifted;
-	  return(1);
-	  /* write up to and including page id tag to stdout */
-	  /*
-	    fwrite(b->next_to_read,match_page_id[0].rm_eo,1,stdout);
-	    b->next_to_read = b->next_to_read+match_page_id[0].rm_eo;
-	    b->bytes_avail -= match_page_id[0].rm_eo;
-	  */
-	}
-	else {
-	  /* should never happen */
-	  fprintf(stderr,"regex gone bad...\n");
-	  exit(-1);
-	}
+    data = ubuf_peek(u, &len);
+    if (len) {
+      id = scan_for_page_id(&scan, data, len, &rev_id);
+      ubuf_consume(u, len);
+      if (id) {
+	if (verbose) fprintf(stderr,"%"PRId64"\n", id);
+	pinfo->id = id;
+	pinfo->position = bfile.block_start;
+	pinfo->bits_shifted = bfile.bits_shifted;
+	free_ubuf(u);
+	free_read_window(bfile.window);
+	return(1);
       }
 
-      if (use_api || use_stub) {
-	if (!rev_id) {
-	  if (regexec(&compiled_rev_id, (char *)b->next_to_read,  2,  match_rev_id, 0 ) == 0) {
-	    if (match_rev_id[1].rm_so >=0) {
-	      rev_id = atoi((char *)(b->next_to_read+match_rev_id[1].rm_so));
-	    }
-	  }
-	}
-
-	/* this needs to be called if we don't find a page by X tries, or Y buffers read,
-	   and we need to retrieve a page id from a revision id in the text instead
-	   where does this obscure figure come from? assume we get at least 2-1 compression ratio,
-	   text revs are at most 10mb plus a little, then if we read this many buffers we should have
-	   at least one rev id in there.  20 million / 5000 or whatever it is, is 4000 buffers full of crap
-	   hopefully that doesn't take forever.
-	*/
-	if (buffer_count>(20000000/BUFINSIZE) && rev_id) {
-	  if (verbose) fprintf(stderr, "passed retries cutoff for using api\n");
-	  if (use_api) {
-	    page_id_found = get_page_id_from_rev_id_via_api(rev_id, fin);
-	  }
-	  else { /* use_stub */
-	    page_id_found = get_page_id_from_rev_id_via_stub(rev_id, stubfilename);
-	  }
-	  pinfo->id = page_id_found +1; /* want the page after this offset, not the one we're in */
-	  pinfo->position = bfile.block_start;
-	  pinfo->bits_shifted = bfile.bits_shifted;
-	  return(1);
-	}
-      }
-      /* FIXME this is probably wrong */
-
-      if (regexec(&compiled_page, (char *)b->next_to_read,  1,  match_page, 0 ) == 0) {
-	/* write everything up to but not including the page tag to stdout */
-	/*
-	fwrite(b->next_to_read,match_page[0].rm_eo - 6,1,stdout);
-	*/
-	move_bytes_to_buffer_start(b, b->next_to_read + match_page[0].rm_so, b->bytes_avail - match_page[0].rm_so);
-	bfile.strm.next_out = (char *)b->next_to_fill;
-	bfile.strm.avail_out = b->end - b->next_to_fill;
-      }
-      else if ((use_api || use_stub) && (regexec(&compiled_rev, (char *)b->next_to_read,  1,  match_rev, 0 ) == 0)) {
-	/* write everything up to but not including the rev tag to stdout */
-	/*
-	fwrite(b->next_to_read,match_page[0].rm_eo - 6,1,stdout);
-	*/
-	move_bytes_to_buffer_start(b, b->next_to_read + match_rev[0].rm_so, b->bytes_avail - match_rev[0].rm_so);
-	bfile.strm.next_out = (char *)b->next_to_fill;
-	bfile.strm.avail_out = b->end - b->next_to_fill;
-      }
-      else {
-	/* could have the first part of the page or the rev tag... so copy up enough bytes to cover that case */
-	if (b->bytes_avail> 10) {
-	  /* write everything that didn't match, but leave 10 bytes, to stdout */
-	  /*
-	  fwrite(b->next_to_read,b->bytes_avail - 10,1,stdout);
-	  */
-	  move_bytes_to_buffer_start(b, b->next_to_read + b->bytes_avail - 10, 10);
-	  bfile.strm.next_out = (char *)b->next_to_fill;
-	  bfile.strm.avail_out = b->end - b->next_to_fill;
+      /* this needs to be called if we don't find a page after reading some
+	 amount of text, and we need to retrieve a page id from a revision id
+	 in the text instead.  where does this obscure figure come from? assume
+	 we get at least 2-1 compression ratio, text revs are at most 10mb plus
+	 a little, then if we read this much we should have at least one rev
+	 id in there.
+      */
+      if ((use_api || use_stub) && bytes_decoded > 20000000 && rev_id) {
+	if (verbose) fprintf(stderr, "passed retries cutoff for using api\n");
+	if (use_api) {
+	  page_id_found = get_page_id_from_rev_id_via_api(rev_id, fin);
 	}
-	else {
-	  if (buffer_is_empty(b)) {
-	    bfile.strm.next_out = (char *)b->buffer;
-	    bfile.strm.avail_out = bfile.bufout_size;
-	    b->next_to_fill = b->buffer; /* empty */
-	  }
-	  else {
-	    /* there were only 10 or less bytes so just save em don't write em to stdout */
-	    move_bytes_to_buffer_start(b, b->next_to_read, b->bytes_avail);
-	    bfile.strm.next_out = (char *)b->next_to_fill;
-	    bfile.strm.avail_out = b->end - b->next_to_fill;
-	  }
+	else { /* use_stub */
+	  page_id_found = get_page_id_from_rev_id_via_stub(rev_id, stubfilename);
 	}
+	pinfo->id = page_id_found +1; /* want the page after this offset, not the one we're in */
+	pinfo->position = bfile.block_start;
+	pinfo->bits_shifted = bfile.bits_shifted;
+	free_ubuf(u);
+	free_read_window(bfile.window);
+	return(1);
       }
     }
+    if (bfile.eof)
+      break;
   }
-  /*
-  if (b->bytes_avail) {
-    fwrite(b->next_to_read,b->bytes_avail,1,stdout);
-  }
-  */
+  free_ubuf(u);
+  free_read_window(bfile.window);
   return(0);
 }
 
@@ -520,6 +504,7 @@ int main(int argc, char **argv) {
   int verbose = 0;
   int optc;
   char *stubfile=NULL;
+  bmap_entry_t *entry;
 
   struct option optvalues[] = {
     {"filename", 1, 0, 'f'},
@@ -570,6 +555,20 @@ int main(int argc, char **argv) {
     fprintf(stderr,"Failed to open file %s for read\n", filename);
     exit(1);
   }
+  set_io_policy(fin, IO_POLICY_PROBE);
+  load_block_map(filename, fin);
+
+  /* a block map with page ids answers without any decompression */
+  res = find_block_for_page_id(fin, (int64_t) page_id, &entry);
+  if (res == 0) {
+    fprintf(stderr,"Page requested is less than first page id in file\n");
+    exit(-1);
+  }
+  else if (res > 0) {
+    if (verbose) fprintf(stderr,"found the page id in the block map, no iterations needed.\n");
+    fprintf(stdout,"position:%"PRId64" page_id:%"PRId64"\n",entry->offset, entry->first_page_id);
+    exit(0);
+  }
 
   file_size = get_file_size(fin);
 
@@ -8,17 +8,23 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
-#include <regex.h>
 #include <inttypes.h>
 #include <zlib.h>
 #include "mwbzutils.h"
 
+/* compressed data is read this far ahead of the decoder at a time,
+   about the size of a bz2 block of compressed xml, since only the
+   last block or two are decoded */
+#define GETLASTID_READAHEAD 262144
+
 void usage(char *message) {
   char * help =
 "Usage: getlastidinbz2xml --filename file --type type [--verbose]\n"
 "       [--help] [--version]\n\n"
 "Show the last page or rev id in the specified MediaWiki XML dump file.\n"
 "This assumes that the last bz2 block(s) of the file are intact.\n"
+"If the file has an up to date block map made by 'makebz2blockmap --ids', the\n"
+"id is taken from the map and nothing is decompressed.\n"
 "Exits with 0 in success, -1 on error.\n\n"
 "Options:\n\n"
 "  -f, --filename   name of file to search\n"
@@ -56,55 +62,31 @@ void show_version(char *version_string) {
 }
 
 /*
- if any id of the specified type is found, appropriate updates will be made to id_info
- no updates are made to the buffer about consumed data, the caller
- is responsible
+ if any id of the specified type (ID_SCAN_PAGE or ID_SCAN_REV) is found,
+ appropriate updates will be made to id_info
+ the whole window is consumed; the scan keeps any tag or id split
+ between it and the next one
  */
-void find_last_id_in_buffer(buf_info_t *buffer, id_info_t *id_info,
-			    bz_info_t *bfile, char *type, int verbose) {
-  regmatch_t *match_id;
-  regex_t compiled_id;
-  char *page_id_pattern = "<page>\n[ ]+<title>[^<]+</title>\n([ ]+<ns>[0-9]+</ns>\n)?[ ]+<id>([0-9]+)</id>\n";
-  char *rev_id_pattern = "<revision>\n[ ]+<id>([0-9]+)</id>\n";
-
-  char *match_from ;
-  int index;
-
-  if (buffer_is_empty(buffer)) return;
-
-  match_id = (regmatch_t *)malloc(sizeof(regmatch_t)*3);
-  match_from = (char *)buffer->next_to_read;
-
-  if (! strcmp(type, "rev")) {
-    index = 1;
-    regcomp(&compiled_id, rev_id_pattern, REG_EXTENDED);
-  }
-  else if (! strcmp(type, "page")) {
-    index = 2;
-    regcomp(&compiled_id, page_id_pattern, REG_EXTENDED);
-  }
-  else {
-    fprintf(stderr, "unknown type of tag to find, %s, giving up\n", type);
-    exit(-1);
-  }
-
-  while (regexec(&compiled_id, match_from, 3, match_id, 0) == 0) {
-    /* found one, yay */
-    if (match_id[index].rm_so >=0) {
-        id_info->id = atoi((char *)(match_from +match_id[index].rm_so));
-        id_info->position = bfile->block_start;
-        id_info->bits_shifted = bfile->bits_shifted;
-	/* get ready to search rest of buffer */
-	match_from += match_id[0].rm_eo;
-    }
-    else {
-      /* should never happen */
-      fprintf(stderr,"regex gone bad...\n");
-      exit(-1);
+void find_last_id_in_buffer(ubuf_t *u, id_scan_t *scan, id_info_t *id_info,
+			    bz_info_t *bfile, int wanted, int verbose) {
+  unsigned char *data;
+  size_t len, used;
+  int64_t id, tag_offset;
+  int type;
+
+  data = ubuf_peek(u, &len);
+  ubuf_consume(u, len);
+  while (len) {
+    used = scan_for_ids(scan, data, len, &type, &id, &tag_offset);
+    data += used;
+    len -= used;
+    if (type == wanted) {
+      /* found one, yay */
+      id_info->id = id;
+      id_info->position = bfile->block_start;
+      id_info->bits_shifted = bfile->bits_shifted;
     }
   }
-  free(match_id);
-  regfree(&compiled_id);
   return;
 }
 
@@ -117,7 +99,8 @@ void init_id_info(id_info_t *id_info) {
 }
 
 /*
-   get the last page or rev id after position in file
+   get the last page or rev id (wanted is ID_SCAN_PAGE or ID_SCAN_REV)
+   after position in file
    expect position to be the start of a bz2 block
    if an id tag is found, the structure id_info will be updated accordingly
    returns:
@@ -127,77 +110,36 @@ void init_id_info(id_info_t *id_info) {
 */
 int get_last_id_after_offset(int fin, id_info_t *id_info,
 			     bz_info_t *bfile, off_t upto,
-			     char *type, int verbose) {
-  int length=5000; /* output buffer size */
-
-  buf_info_t *b;
-  const int KEEP = 310;
-
-  b = init_buffer(length);
+			     int wanted, int verbose) {
+  ubuf_t *u;
+  id_scan_t scan;
+  int res;
+
+  u = init_ubuf(UBUF_SIZE);
+  if (u == NULL)
+    return(-1);
   init_id_info(id_info);
-
-    /* try to fill the buffer, unless of course we hit eof */
-    /* could be a case where they read no bytes, more bytes are avail in buffer,
-       we hit eof. what then? */
-    /* while ((res = get_buffer_of_uncompressed_data(b, fin, bfile, FORWARD) >=0) && (! bfile->eof)) { */
-    /* while (!get_buffer_of_uncompressed_data(b, fin, bfile, FORWARD) && (! bfile->eof)) { */
-
-
-    while (get_buffer_of_uncompressed_data(b, fin, bfile, FORWARD) >= 0 && (! bfile -> eof)) {
-      find_last_id_in_buffer(b, id_info, bfile, type, verbose);
-      /* did we hit eof? then th-th-that's all folks */
-      if (bfile->eof)
-	break;
-
-      /*
-	We keep reading more buffers because we want the _last_ page/rev id,
-	not the first one
-      */
-      else if (buffer_is_empty(b)) {
-	/* entire buffer is now available for next read */
-	bfile->strm.next_out = (char *)b->buffer;
-	bfile->strm.avail_out = bfile->bufout_size;
-	b->next_to_fill = b->buffer;
-      }
-      else if (b->bytes_avail> KEEP) {
-	/* dump contents of buffer except last KEEP chars,
-	   move those to front so we can keep reading.
-	   We keep that much in case somewhere near the end was a page/rev
-	   tag or a page/rev id tag that got cut off in the middle.
-	*/
-	move_bytes_to_buffer_start(b, b->end - KEEP, KEEP);
-	bfile->strm.next_out = (char *)b->next_to_fill;
-	bfile->strm.avail_out = b->end - b->next_to_fill;
-      }
-      else {
-	/* move available bytes (don't have KEEP) up to front */
-	move_bytes_to_buffer_start(b, b->next_to_read, b->bytes_avail);
-	bfile->strm.next_out = (char *)b->next_to_fill;
-	bfile->strm.avail_out = b->end - b->next_to_fill;
-      }
-      if (bfile->position > upto) {
-	/* we're done */
-	break;
-      }
-    }
-    if (bfile->eof || bfile->position > upto) {
-    /* see what's left in the buffer after eof. maybe we got something good */
-      find_last_id_in_buffer(b, id_info, bfile, type, verbose);
-      BZ2_bzDecompressEnd(&(bfile->strm));
-      free_buffer(b);
-      free(b);
-      if (id_info->id == -1) return 0; /* not found */
-      else if (id_info->id > 0) return 1; /* found */
-      else return(-1); /* error */
-    }
-    else {
-      /* we have an error from get_buffer_of_uncompressed_data */
-      BZ2_bzDecompressEnd(&(bfile->strm));
-      free_buffer(b);
-      free(b);
-      fprintf(stderr,"freed buffer\n");
-      return(-1); /* error */
-    }
+  init_id_scan(&scan);
+
+  /*
+    We keep reading more because we want the _last_ page/rev id,
+    not the first one
+  */
+  while ((res = fill_ubuf(u, fin, bfile)) >= 0) {
+    find_last_id_in_buffer(u, &scan, id_info, bfile, wanted, verbose);
+    /* did we hit eof? then th-th-that's all folks */
+    if (bfile->eof || bfile->position > upto)
+      break;
+  }
+  BZ2_bzDecompressEnd(&(bfile->strm));
+  free_ubuf(u);
+  if (res < 0) {
+    /* we have an error from fill_ubuf */
+    return(-1);
+  }
+  if (id_info->id == -1) return 0; /* not found */
+  else if (id_info->id > 0) return 1; /* found */
+  else return(-1); /* error */
 }
 
 
@@ -208,7 +150,7 @@ int giveup(int fin) {
 }
 
 int main(int argc, char **argv) {
-  int fin, res, id=0;
+  int fin, res, id=0, wanted = 0;
   off_t block_end, block_start, upto;
   id_info_t id_info;
   char *filename = NULL;
@@ -218,6 +160,7 @@ int main(int argc, char **argv) {
   int verbose = 0;
   int optc;
   int result;
+  int64_t map_id;
 
   struct option optvalues[] = {
     {"help", 0, 0, 'h'},
@@ -246,15 +189,30 @@ int main(int argc, char **argv) {
     else usage("Unknown option or other error\n");
   }
 
-  if (! filename) {
+  if (! filename || ! type) {
     usage(NULL);
   }
+  if (! strcmp(type, "rev"))
+    wanted = ID_SCAN_REV;
+  else if (! strcmp(type, "page"))
+    wanted = ID_SCAN_PAGE;
+  else
+    usage("Bad argument to type option\n");
 
   fin = open (filename, O_RDONLY);
   if (fin < 0) {
     fprintf(stderr,"Failed to open file %s for read\n", filename);
     exit(1);
   }
+  set_io_policy(fin, IO_POLICY_PROBE);
+  load_block_map(filename, fin);
+
+  /* a block map with ids answers without any decompression */
+  if (get_last_id_from_block_map(fin, wanted == ID_SCAN_REV, &map_id) > 0) {
+    fprintf(stdout, "%s_id:%"PRId64"\n", type, map_id);
+    close(fin);
+    exit(0);
+  }
 
   bfile.file_size = get_file_size(fin);
   bfile.footer = init_footer();
@@ -268,8 +226,14 @@ int main(int argc, char **argv) {
   }
   bfile.position -=(off_t)6; /* size of marker */
   bfile.initialized = 0;
+  /* the last blocks are only probed for ids, nothing decoded
+     from them is passed on */
+  bfile.skip_crc = 1;
   bfile.bytes_read = 0;
   bfile.header_read = 0;
+  bfile.window = NULL;
+  bfile.readahead = GETLASTID_READAHEAD;
+  bfile.ra = NULL;
 
   /* start at end of file */
   block_end = bfile.position;
@@ -282,12 +246,12 @@ int main(int argc, char **argv) {
     bfile.initialized = 0;
     init_decompress(&bfile);
 
-    block_start = find_first_bz2_block_from_offset(&bfile, fin, block_end, BACKWARD, bfile.file_size, 1);
+    block_start = find_first_bz2_block_from_offset(&bfile, fin, block_end, BACKWARD, bfile.file_size);
 
     if (block_start <= (off_t) 0) giveup(fin);
     BZ2_bzDecompressEnd (&(bfile.strm));
 
-    res = get_last_id_after_offset(fin, &id_info, &bfile, upto, type, verbose);
+    res = get_last_id_after_offset(fin, &id_info, &bfile, upto, wanted, verbose);
     if (res > 0) {
       id = id_info.id;
     }
@@ -297,6 +261,7 @@ int main(int argc, char **argv) {
       if (block_end <= (off_t) 0) giveup(fin);
     }
     BZ2_bzDecompressEnd (&(bfile.strm));
+    stop_bz2_readahead(&bfile);
   }
   if (!id) giveup(fin);
 
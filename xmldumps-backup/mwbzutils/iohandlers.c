@@ -1,3 +1,6 @@
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -46,6 +49,11 @@ InputHandler *inputhandler_init(char *path) {
   ih->gzstream = NULL;
   ih->gz_bufsize = 65536;
 
+  ih->fd = -1;
+  ih->keep_cache = 0;
+  ih->dropped = 0;
+  ih->unchecked = 0;
+
   if (path == NULL) {
     ih->fin = stdin;
     ih->open = NULL;
@@ -173,6 +181,43 @@ char *bz2gets(BZFILE *fd, bz2buffer_t *buf, char *out, int out_size) {
   else return(out);
 }
 
+/*
+  input files are read once through: say so to the kernel, and
+  arrange for what has been read to be dropped from the page cache
+  as we go, unless MWBZUTILS_KEEPCACHE is set in the environment
+*/
+void input_advise(InputHandler *ih, int fd) {
+  ih->fd = fd;
+  ih->keep_cache = (getenv("MWBZUTILS_KEEPCACHE") != NULL);
+  ih->dropped = 0;
+  ih->unchecked = 0;
+  posix_fadvise(fd, (off_t)0, (off_t)0, POSIX_FADV_SEQUENTIAL);
+}
+
+/*
+  note that len more bytes were handed to the caller; every so often
+  find out how far into the file the reads have got and drop what
+  is behind them
+*/
+void input_drop_behind(InputHandler *ih, int len) {
+  off_t offset;
+
+  if (ih->fd < 0 || ih->keep_cache)
+    return;
+  ih->unchecked += len;
+  if (ih->unchecked < INPUT_DROP_CHECK)
+    return;
+  ih->unchecked = 0;
+  if (ih->gzstream != NULL)
+    offset = (off_t)gzoffset(ih->gzstream);
+  else
+    offset = ftello(ih->fin);
+  if (offset - ih->dropped >= (off_t)INPUT_DROP_STEP) {
+    posix_fadvise(ih->fd, ih->dropped, offset - ih->dropped, POSIX_FADV_DONTNEED);
+    ih->dropped = offset;
+  }
+}
+
 int bz2_open_i(InputHandler *ih) {
   if (ih->path != NULL) {
     ih->fin = fopen(ih->path, "rb");
@@ -180,6 +225,7 @@ int bz2_open_i(InputHandler *ih) {
       fprintf(stderr, "failed to open input file for read\n");
       exit(-1);
     }
+    input_advise(ih, fileno(ih->fin));
   }
   ih->bzstream = BZ2_bzReadOpen(&(ih->bzerror), ih->fin, ih->bz_verbosity, ih->bz_small,
                                 ih->bz_unused, ih->bz_nUnused);
@@ -200,6 +246,8 @@ char *bz2_fgets_i(InputHandler *ih, char *buffer, int bytecount) {
             ih->bzerror, ih->path);
     return(NULL);
   }
+  if (ret != NULL)
+    input_drop_behind(ih, strlen(ret));
   return(ret);
 }
 
@@ -217,9 +265,19 @@ int bz2_eof_i(InputHandler *ih) {
 }
 
 int gz_open_i(InputHandler *ih) {
+  int fd;
+
   if (ih->path != NULL) {
-    ih->gzstream = gzopen(ih->path, "rb");
-    gzbuffer(ih->gzstream, ih->gz_bufsize);
+    fd = open(ih->path, O_RDONLY);
+    if (fd >= 0) {
+      ih->gzstream = gzdopen(fd, "rb");
+      if (ih->gzstream) {
+	gzbuffer(ih->gzstream, ih->gz_bufsize);
+	input_advise(ih, fd);
+      }
+      else
+	close(fd);
+    }
   }
   if (!ih->gzstream) {
     fprintf(stderr, "error trying to open %s for decompression\n",
@@ -230,7 +288,12 @@ int gz_open_i(InputHandler *ih) {
 }
 
 char *gz_fgets_i(InputHandler *ih, char *buffer, int bytecount) {
-  return(gzgets(ih->gzstream, buffer, bytecount));
+  char *ret;
+
+  ret = gzgets(ih->gzstream, buffer, bytecount);
+  if (ret != NULL)
+    input_drop_behind(ih, strlen(ret));
+  return(ret);
 }
 
 int gz_close_i(InputHandler *ih) {
@@ -252,12 +315,18 @@ int txt_open_i(InputHandler *ih) {
       fprintf(stderr, "failed to open %s for decompression\n", ih->path);
       exit(-1);
     }
+    input_advise(ih, fileno(ih->fin));
   }
   return(0);
 }
 
 char *txt_fgets_i(InputHandler *ih, char *buffer, int bytecount) {
-  return(fgets(buffer, bytecount, ih->fin));
+  char *ret;
+
+  ret = fgets(buffer, bytecount, ih->fin);
+  if (ret != NULL)
+    input_drop_behind(ih, strlen(ret));
+  return(ret);
 }
 
 int txt_close_i(InputHandler *ih) {
@@ -11,6 +11,11 @@
 #include <bzlib.h>
 #include <zlib.h>
 
+/* input files are dropped from the page cache behind the reader this often */
+#define INPUT_DROP_STEP 8388608
+/* and the read position is looked up after this many bytes of output */
+#define INPUT_DROP_CHECK 1048576
+
 typedef struct {
   char buf[65536];
   int nextin;      /* pointer to next byte available for reading stuff in from file */
@@ -33,6 +38,12 @@ typedef struct {
   int bz_nUnused;
   bz2buffer_t *bz_buffer;
 
+  /* for dropping what has been read from the page cache */
+  int fd;             /* -1 if not a file we opened */
+  int keep_cache;
+  off_t dropped;
+  int unchecked;
+
   int (*open)();
   char *(*fgets)();
   int (*close)();
@@ -60,6 +71,9 @@ bz2buffer_t *init_bz2buf();
 
 InputHandler *inputhandler_init(char *path);
 
+void input_advise(InputHandler *ih, int fd);
+void input_drop_behind(InputHandler *ih, int len);
+
 int isfull(bz2buffer_t *buf);
 int isempty(bz2buffer_t *buf);
 int fill_buffer(bz2buffer_t *buf, BZFILE *fd);
@@ -0,0 +1,189 @@
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include "mwbzutils.h"
+
+void usage(char *message) {
+  char * help =
+"Usage: makebz2blockmap --filename file [--mapfile file] [--threads num]\n"
+"       [--uncompressed] [--ids] [--verbose] [--help] [--version]\n\n"
+"Find all bz2 block markers in a file and write a map of them, noting for each\n"
+"whether it starts a genuine block (checked from its block header) and if so,\n"
+"the block crc.  The streams in the file are found in the same pass, from their\n"
+"headers and end of stream markers, and listed in the map along with their crcs.\n\n"
+"The file may be scanned by several threads at once, each reading its own part\n"
+"of the file; this can help for large files on storage that handles parallel\n"
+"reads well.\n\n"
+"If asked, the whole file is also decompressed once, to find the offset in the\n"
+"uncompressed data at which the output of each block starts, and the first and\n"
+"last page and rev ids in each block.  These are kept in the map too, so that\n"
+"dumpbz2filefromoffset can start from any offset in the uncompressed data\n"
+"without decompressing everything in front of it, and findpageidinbz2xml and\n"
+"getlastidinbz2xml can answer without decompressing anything.\n\n"
+"The map is written to the name of the bz2 file with '.bmap' appended, unless\n"
+"another name is given.  When a map with the default name is present and up to\n"
+"date with the bz2 file, dumpbz2filefromoffset, dumplastbz2block,\n"
+"findpageidinbz2xml and getlastidinbz2xml use it instead of searching the file\n"
+"for blocks.\n\n"
+"Exits with 0 on success, -1 on error.\n\n"
+"Options:\n\n"
+"  -f, --filename   name of file to map\n"
+"  -m, --mapfile    name of map file to write\n"
+"  -t, --threads    number of threads to scan the file with (default: 1)\n"
+"  -u, --uncompressed  Find the uncompressed offset of each block\n"
+"  -i, --ids        Find the first and last page and rev ids in each block\n"
+"  -v, --verbose    Show each marker and stream found\n"
+"  -h, --help       Show this help message\n"
+"  -V, --version    Display the version of this program and exit\n\n"
+"Report bugs in makebz2blockmap to <https://phabricator.wikimedia.org/>.\n\n"
+"See also dumpbz2filefromoffset(1), dumplastbz2block(1), findpageidinbz2xml(1),\n"
+    "getlastidinbz2xml(1), showcrcs(1)\n\n";
+  if (message) {
+    fprintf(stderr,"%s\n\n",message);
+  }
+  fprintf(stderr,"%s",help);
+  exit(-1);
+}
+
+void show_version(char *version_string) {
+  char * copyright =
+"Copyright (C) 2026 Ariel T. Glenn.  All rights reserved.\n\n"
+"This program is free software: you can redistribute it and/or modify it\n"
+"under the  terms of the GNU General Public License as published by the\n"
+"Free Software Foundation, either version 2 of the License, or (at your\n"
+"option) any later version.\n\n"
+"This  program  is  distributed  in the hope that it will be useful, but\n"
+"WITHOUT ANY WARRANTY; without even the implied warranty of \n"
+"MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General\n"
+"Public License for more details.\n\n"
+"You should have received a copy of the GNU General Public License along\n"
+"with this program.  If not, see <http://www.gnu.org/licenses/>\n\n"
+    "Written by Ariel T. Glenn.\n";
+  fprintf(stderr,"makebz2blockmap %s\n", version_string);
+  fprintf(stderr,"%s",copyright);
+  exit(-1);
+}
+
+/*
+   find every block marker in the file, check each one
+   and add it to the map, along with the uncompressed
+   offset and the page and rev ids of each block if asked
+   returns:
+     0 on success
+     -1 on error
+ */
+int map_blocks(bmap_t *map, int fin, int threads, int contents, int verbose) {
+  int64_t i;
+
+  if (scan_bz2_blocks(fin, threads, 1, map) == -1)
+    return(-1);
+  if (contents && add_block_contents_to_block_map(fin, map, contents) == -1)
+    return(-1);
+  if (verbose) {
+    for (i = 0; i < map->count; i++) {
+      fprintf(stderr, "offset:%"PRId64" bits_shifted:%d %s CRC:0x%08x",
+	      map->entries[i].offset, map->entries[i].bits_shifted,
+	      map->entries[i].flags & BMAP_GENUINE ? "genuine" : "false", map->entries[i].crc);
+      if (contents & BMAP_UNCOMPRESSED_OFFSETS)
+	fprintf(stderr, " uncompressed_offset:%"PRId64, map->entries[i].uncompressed_offset);
+      if (contents & BMAP_IDS)
+	fprintf(stderr, " page_ids:%"PRId64"-%"PRId64" rev_ids:%"PRId64"-%"PRId64,
+		map->entries[i].first_page_id, map->entries[i].last_page_id,
+		map->entries[i].first_rev_id, map->entries[i].last_rev_id);
+      fprintf(stderr, "\n");
+    }
+    for (i = 0; i < map->stream_count; i++)
+      fprintf(stderr, "stream start:%"PRId64" end:%"PRId64" bits_shifted:%d CRC:0x%08x\n",
+	      map->streams[i].start, map->streams[i].end,
+	      map->streams[i].end_bits_shifted, map->streams[i].crc);
+  }
+  return(0);
+}
+
+int main(int argc, char **argv) {
+  int fin;
+  char *filename = NULL;
+  char *mapname = NULL;
+  int verbose = 0;
+  int threads = 1;
+  int contents = 0;
+  int optindex=0;
+  int optc;
+  bmap_t *map;
+
+  struct option optvalues[] = {
+    {"filename", 1, 0, 'f'},
+    {"help", 0, 0, 'h'},
+    {"ids", 0, 0, 'i'},
+    {"mapfile", 1, 0, 'm'},
+    {"threads", 1, 0, 't'},
+    {"uncompressed", 0, 0, 'u'},
+    {"verbose", 0, 0, 'v'},
+    {"version", 0, 0, 'V'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (1) {
+    optc=getopt_long_only(argc,argv,"f:him:t:uvV", optvalues, &optindex);
+    if (optc=='f') {
+     filename=optarg;
+    }
+    else if (optc=='m') {
+     mapname=optarg;
+    }
+    else if (optc=='t') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to threads option\n");
+      threads=atoi(optarg);
+      if (threads < 1) usage("Bad argument to threads option\n");
+    }
+    else if (optc=='u')
+      contents |= BMAP_UNCOMPRESSED_OFFSETS;
+    else if (optc=='i')
+      contents |= BMAP_IDS;
+    else if (optc=='h')
+      usage(NULL);
+    else if (optc=='v')
+      verbose++;
+    else if (optc=='V')
+      show_version(VERSION);
+    else if (optc==-1) break;
+    else usage("Unknown option or other error\n");
+  }
+
+  if (! filename) {
+    usage(NULL);
+  }
+  if (! mapname) {
+    mapname = get_block_map_filename(filename);
+    if (! mapname)
+      exit(-1);
+  }
+
+  fin = open (filename, O_RDONLY);
+  if (fin < 0) {
+    fprintf(stderr,"Failed to open file %s for read\n", filename);
+    exit(-1);
+  }
+  set_io_policy(fin, IO_POLICY_STREAM);
+
+  map = init_block_map();
+  if (map == NULL || set_block_map_file_info(map, fin) == -1)
+    exit(-1);
+
+  if (map_blocks(map, fin, threads, contents, verbose) == -1) {
+    fprintf(stderr,"Failed to map blocks of %s\n", filename);
+    exit(-1);
+  }
+  if (write_block_map(map, mapname) == -1)
+    exit(-1);
+  close(fin);
+  exit(0);
+}
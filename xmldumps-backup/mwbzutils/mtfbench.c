@@ -0,0 +1,159 @@
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <inttypes.h>
+#include "mwbzutils.h"
+
+/*
+  microbenchmark for the MTF stage of the block decoder: decodes
+  the same blocks of a file over and over with each way of keeping
+  up the MTF list, and shows the time each took.  the BWT is set up
+  but not undone and nothing is written out, so the differences
+  between the times are down to the MTF stage.
+  not installed; build it with 'make mtfbench'.
+*/
+
+void usage(char *message) {
+  char * help =
+"Usage: mtfbench --filename file [--blocks num] [--reps num] [--help]\n\n"
+"Decode blocks of a bz2 file repeatedly with each way of keeping up the\n"
+"MTF list (memmove, as libbz2 does in effect, and simd), and show the\n"
+"cpu time taken by each.\n\n"
+"Options:\n\n"
+"  -f, --filename   name of file to decode blocks of\n"
+"  -b, --blocks     number of blocks from the start of the file to use (default: 20)\n"
+"  -r, --reps       number of times to decode each block (default: 5)\n"
+"  -h, --help       Show this help message\n\n";
+  if (message) {
+    fprintf(stderr,"%s\n\n",message);
+  }
+  fprintf(stderr,"%s",help);
+  exit(-1);
+}
+
+double cpu_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+/*
+   decode the given blocks reps times each with the given method
+   returns:
+      cpu seconds taken, or -1 on error
+*/
+double time_blocks(int fin, bmap_t *map, int blocks, int reps, int method, int block_size) {
+  bz_stream strm;
+  bz_bit_reader_t reader;
+  unsigned char *bufin;
+  double start, total = 0;
+  int64_t i;
+  int used, rep, ret;
+
+  strm.bzalloc = NULL;
+  strm.bzfree = NULL;
+  strm.opaque = NULL;
+  bufin = (unsigned char *)malloc(PARALLEL_BUFINSIZE);
+  if (bufin == NULL || BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+    fprintf(stderr,"failed to set up decoder\n");
+    return(-1);
+  }
+  BZ2_setMtfMethod(method);
+  for (i = 0, used = 0; i < map->count && used < blocks; i++) {
+    if (!(map->entries[i].flags & BMAP_GENUINE))
+      continue;
+    used++;
+    for (rep = 0; rep < reps; rep++) {
+      BZ2_bitReaderInit(&reader, fin,
+			map->entries[i].bits_shifted ? map->entries[i].offset :
+			map->entries[i].offset + (off_t)1,
+			map->entries[i].bits_shifted, bufin, PARALLEL_BUFINSIZE);
+      start = cpu_seconds();
+      ret = BZ2_bzDecodeBlock(&strm, &reader, block_size);
+      total += cpu_seconds() - start;
+      if (ret != BZ_OK) {
+	fprintf(stderr,"error from BZ decompress %d at offset %"PRId64"\n", ret, map->entries[i].offset);
+	return(-1);
+      }
+    }
+  }
+  BZ2_bzDecompressEnd(&strm);
+  free(bufin);
+  return(total);
+}
+
+int main(int argc, char **argv) {
+  int fin;
+  char *filename = NULL;
+  int blocks = 20;
+  int reps = 5;
+  int optindex=0;
+  int optc;
+  unsigned char header[4];
+  double memmove_time, simd_time;
+  bmap_t *map;
+
+  struct option optvalues[] = {
+    {"blocks", 1, 0, 'b'},
+    {"filename", 1, 0, 'f'},
+    {"help", 0, 0, 'h'},
+    {"reps", 1, 0, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while (1) {
+    optc=getopt_long_only(argc,argv,"b:f:hr:", optvalues, &optindex);
+    if (optc=='f') {
+     filename=optarg;
+    }
+    else if (optc=='b') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to blocks option\n");
+      blocks=atoi(optarg);
+    }
+    else if (optc=='r') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to reps option\n");
+      reps=atoi(optarg);
+    }
+    else if (optc=='h')
+      usage(NULL);
+    else if (optc==-1) break;
+    else usage("Unknown option or other error\n");
+  }
+  if (! filename || blocks < 1 || reps < 1) {
+    usage(NULL);
+  }
+
+  fin = open (filename, O_RDONLY);
+  if (fin < 0) {
+    fprintf(stderr,"Failed to open file %s for read\n", filename);
+    exit(-1);
+  }
+  if (pread_all(fin, header, 4, (off_t)0) < 4 || header[3] < '1' || header[3] > '9') {
+    fprintf(stderr,"Corrupt bzip2 header\n");
+    exit(-1);
+  }
+  map = init_block_map();
+  if (map == NULL || scan_bz2_blocks(fin, 1, 1, map) == -1) {
+    fprintf(stderr,"Failed to find blocks of %s\n", filename);
+    exit(-1);
+  }
+
+  /* once through first so that both runs find the file in cache */
+  if (time_blocks(fin, map, blocks, 1, MTF_MEMMOVE, header[3] - '0') < 0)
+    exit(-1);
+  memmove_time = time_blocks(fin, map, blocks, reps, MTF_MEMMOVE, header[3] - '0');
+  simd_time = time_blocks(fin, map, blocks, reps, MTF_SIMD, header[3] - '0');
+  if (memmove_time < 0 || simd_time < 0)
+    exit(-1);
+  fprintf(stdout, "memmove: %.3fs\nsimd: %.3fs\n", memmove_time, simd_time);
+  close(fin);
+  exit(0);
+}
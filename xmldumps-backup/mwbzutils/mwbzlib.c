@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,6 +10,11 @@
 #include <sys/types.h>
 #include <regex.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bzlib.h"
 #include "mwbzutils.h"
 
@@ -140,106 +146,483 @@ int check_buffer_for_bz2_block_marker(bz_info_t *bfile) {
   return(-1);
 }
 
-/* return: 1 if found, 0 if not, -1 on error */
-int find_next_bz2_block_marker(int fin, bz_info_t *bfile, int direction) {
-  off_t seekresult;
-  /* int res; */
-  ssize_t bytes_read = 0;
-  ssize_t bytes_avail = 0;
-  ssize_t bytes_used = 0;
-  int firstblockread = 0;
+/*
+  tables for the multi-shift marker scanner, indexed by the number of
+  bits the marker starts into a 7 byte window (1 through 8; 8 is the
+  byte-aligned marker, which by convention is reported from the byte
+  before it with 0 bits shifted).  marker_byte2 and marker_byte3 hold
+  the bytes at offsets 2 and 3 into the window, which are always
+  entirely covered by the marker and so make a cheap prefilter.
+  footer_byte2 and footer_byte3 are the same for the end of stream
+  marker, and marker_byte2_hits has a nonzero entry for any byte that
+  is byte 2 of either marker at some shift.
+*/
+static unsigned char marker_byte2[9];
+static unsigned char marker_byte3[9];
+static unsigned char footer_byte2[9];
+static unsigned char footer_byte3[9];
+static unsigned char marker_byte2_hits[256];
+static pthread_once_t marker_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_marker_tables(void) {
+  uint64_t window;
+  int s;
+
+  for (s = 1; s <= 8; s++) {
+    window = BZ2_BLOCK_MAGIC << (8 - s);
+    marker_byte2[s] = (unsigned char) (window >> 32);
+    marker_byte3[s] = (unsigned char) (window >> 24);
+    marker_byte2_hits[marker_byte2[s]] |= (unsigned char) 1;
+    window = BZ2_STREAM_MAGIC << (8 - s);
+    footer_byte2[s] = (unsigned char) (window >> 32);
+    footer_byte3[s] = (unsigned char) (window >> 24);
+    marker_byte2_hits[footer_byte2[s]] |= (unsigned char) 2;
+  }
+}
 
-  bfile->bits_shifted = -1;
-  bytes_read = read(fin, bfile->marker_buffer, sizeof(bfile->marker_buffer));
-  if (bytes_read == -1) {
-    fprintf(stderr,"read of file failed\n");
-    return(-1);
+/* the scan threads may all get here at once */
+static void init_marker_tables() {
+  pthread_once(&marker_tables_once, build_marker_tables);
+}
+
+/*
+  check the 7 bytes at buf for the given 48 bit magic (block marker or
+  end of stream marker) at all bit offsets, in the same order as
+  check_buffer_for_bz2_block_marker() (byte-aligned first)
+  but comparing all 48 bits of the marker
+
+  returns:
+    number of bits rightshifted on match, -1 otherwise
+*/
+static int check_window_for_bz2_magic(unsigned char *buf, uint64_t magic) {
+  uint64_t window;
+  int s;
+
+  window = ((uint64_t) buf[0] << 48) | ((uint64_t) buf[1] << 40) |
+    ((uint64_t) buf[2] << 32) | ((uint64_t) buf[3] << 24) |
+    ((uint64_t) buf[4] << 16) | ((uint64_t) buf[5] << 8) | (uint64_t) buf[6];
+  if ((window & 0xffffffffffffULL) == magic)
+    return(0);
+  for (s = 1; s < 8; s++) {
+    if (((window >> (8 - s)) & 0xffffffffffffULL) == magic)
+      return(s);
   }
-  if (bytes_read < 7)
-    return(-1);
-  bytes_avail = bytes_read;
-  bytes_used = 0;
-  if (direction == FORWARD)
-    bfile->marker_buffer_ptr = bfile->marker_buffer;
-  else
-    bfile->marker_buffer_ptr = bfile->marker_buffer + bytes_read - 7;
-  /* must be after 4 byte file header, and we add a leftmost byte to the buffer
-     of data read in case some bits have been shifted into it */
-  while (((bfile->position <= bfile->file_size - 6 && direction == FORWARD) ||
-	  (bfile->position >= 0 && direction == BACKWARD))
-	 && bfile->bits_shifted < 0) {
-    bfile->bits_shifted = check_buffer_for_bz2_block_marker(bfile);
-    if (bfile->bits_shifted < 0) {
-      if (direction == FORWARD) {
-	bfile->position++;
-	bytes_used++;
-	bytes_avail--;
-	if (bytes_avail < 7) {
-	  /* copy the leftovers to the front of the buffer, fill in as much of the remainder as we can,
-	   reset the pointer to the beginning of the buffer for new checks */
-	  memmove(bfile->marker_buffer, bfile->marker_buffer + sizeof(bfile->marker_buffer) - bytes_avail, bytes_avail);
-	  bytes_read = read(fin, bfile->marker_buffer + bytes_avail, sizeof(bfile->marker_buffer) - bytes_avail);
-	  bytes_used = 0;
-	  if (bytes_read  < 1)
-	    return(-1);
-	  bytes_avail += bytes_read;
-	  if (bytes_avail < 7)
-	    return(-1);
-	  bfile->marker_buffer_ptr = bfile->marker_buffer;
-	}
-	else {
-	  bfile->marker_buffer_ptr += 1;
+  return(-1);
+}
+
+#define check_window_for_bz2_block_marker(buf) check_window_for_bz2_magic(buf, BZ2_BLOCK_MAGIC)
+
+/*
+  scan a buffer for the bz2 block marker at any bit offset, front to back.
+  every index i with 7 bytes of data after it (i <= len - 7) is checked;
+  a match at i means the same as a match from check_buffer_for_bz2_block_marker()
+  with the marker buffer pointer at buf + i.
+
+  on SSE2 capable hosts, 16 indexes are tested at once against the two
+  prefilter bytes for all shifts; otherwise a lookup on one prefilter byte
+  is done per index.  either way the full 48 bits are checked before
+  reporting a match.
+
+  returns:
+    index of the first match, with *bits_shifted set, or -1 if none
+*/
+int find_bz2_block_marker_in_buffer(unsigned char *buf, int len, int *bits_shifted) {
+  int i = 0;
+  int s, result;
+
+  init_marker_tables();
+
+#ifdef __SSE2__
+  {
+    __m128i want2[8], want3[8];
+    __m128i bytes2, bytes3, hits;
+    int mask, j;
+
+    for (s = 0; s < 8; s++) {
+      want2[s] = _mm_set1_epi8((char) marker_byte2[s + 1]);
+      want3[s] = _mm_set1_epi8((char) marker_byte3[s + 1]);
+    }
+    /* loads cover bytes i+2 through i+18, checks need through i+15+6 */
+    for (; i + 22 <= len; i += 16) {
+      bytes2 = _mm_loadu_si128((__m128i *)(buf + i + 2));
+      bytes3 = _mm_loadu_si128((__m128i *)(buf + i + 3));
+      hits = _mm_setzero_si128();
+      for (s = 0; s < 8; s++) {
+	hits = _mm_or_si128(hits, _mm_and_si128(_mm_cmpeq_epi8(bytes2, want2[s]),
+						_mm_cmpeq_epi8(bytes3, want3[s])));
+      }
+      mask = _mm_movemask_epi8(hits);
+      while (mask) {
+	j = __builtin_ctz(mask);
+	result = check_window_for_bz2_block_marker(buf + i + j);
+	if (result >= 0) {
+	  *bits_shifted = result;
+	  return(i + j);
 	}
+	mask &= mask - 1;
       }
-      else {
-	/* direction is backwards */
-	bfile->position--;
-	bfile->marker_buffer_ptr -= 1;
-	if (bfile->position < 0 && firstblockread) {
-	  fprintf(stderr,"No block found in file\n");
-	  return(-1);
+    }
+  }
+#endif
+
+  for (; i <= len - 7; i++) {
+    if (marker_byte2_hits[buf[i + 2]] & 1) {
+      result = check_window_for_bz2_block_marker(buf + i);
+      if (result >= 0) {
+	*bits_shifted = result;
+	return(i);
+      }
+    }
+  }
+  return(-1);
+}
+
+/*
+  scan a buffer for either the bz2 block marker or the end of stream
+  marker at any bit offset, front to back, checking the same indexes
+  as find_bz2_block_marker_in_buffer()
+
+  returns:
+    index of the first match, with *bits_shifted and *marker_type
+    (BZ2_MARKER_BLOCK or BZ2_MARKER_FOOTER) set, or -1 if none
+*/
+int find_bz2_marker_in_buffer(unsigned char *buf, int len, int *bits_shifted, int *marker_type) {
+  int i = 0;
+  int s, result;
+
+  init_marker_tables();
+
+#ifdef __SSE2__
+  {
+    __m128i want2[16], want3[16];
+    __m128i bytes2, bytes3, hits;
+    int mask, j;
+
+    for (s = 0; s < 8; s++) {
+      want2[s] = _mm_set1_epi8((char) marker_byte2[s + 1]);
+      want3[s] = _mm_set1_epi8((char) marker_byte3[s + 1]);
+      want2[s + 8] = _mm_set1_epi8((char) footer_byte2[s + 1]);
+      want3[s + 8] = _mm_set1_epi8((char) footer_byte3[s + 1]);
+    }
+    for (; i + 22 <= len; i += 16) {
+      bytes2 = _mm_loadu_si128((__m128i *)(buf + i + 2));
+      bytes3 = _mm_loadu_si128((__m128i *)(buf + i + 3));
+      hits = _mm_setzero_si128();
+      for (s = 0; s < 16; s++) {
+	hits = _mm_or_si128(hits, _mm_and_si128(_mm_cmpeq_epi8(bytes2, want2[s]),
+						_mm_cmpeq_epi8(bytes3, want3[s])));
+      }
+      mask = _mm_movemask_epi8(hits);
+      while (mask) {
+	j = __builtin_ctz(mask);
+	result = check_window_for_bz2_block_marker(buf + i + j);
+	if (result >= 0) {
+	  *bits_shifted = result;
+	  *marker_type = BZ2_MARKER_BLOCK;
+	  return(i + j);
 	}
-	if (bfile->marker_buffer_ptr < bfile->marker_buffer) {
-	  /* keep those bytes around in case they have part of the marker */
-	  if (bfile->position < sizeof(bfile->marker_buffer) - 7) {
-	    /* only a few bytes left. we'll just read a buffer full from the beginning of the file and search
-	       back, a little inefficient but clear */
-	    firstblockread++;
-	    bfile->position = 0;
-	    seekresult = lseek(fin, bfile->position, SEEK_SET);
-	    if (seekresult == (off_t)-1) {
-	      fprintf(stderr,"lseek of file to %"PRId64" failed (2)\n",bfile->position);
-	      return(-1);
-	    }
-	    bytes_read = read(fin, bfile->marker_buffer, sizeof(bfile->marker_buffer));
-	  }
-	  else {
-	    memmove(bfile->marker_buffer + sizeof(bfile->marker_buffer) - 7, bfile->marker_buffer, 7);
-	    bfile->position -= sizeof(bfile->marker_buffer) - 7;
-	    seekresult = lseek(fin, bfile->position, SEEK_SET);
-	    if (seekresult == (off_t)-1) {
-	      fprintf(stderr,"lseek of file to %"PRId64" failed (2)\n",bfile->position);
-	      return(-1);
-	    }
-	    bytes_read = read(fin, bfile->marker_buffer, sizeof(bfile->marker_buffer) - 7);
-	    if (bytes_read != sizeof(bfile->marker_buffer) - 7) {
-	      fprintf(stderr,"didn't read enough bytes to fill the buffer. only %ld. giving up\n", bytes_read);
-	      return(-1);
-	    }
-	  }
-	  bfile->marker_buffer_ptr = bfile->marker_buffer + bytes_read;
-	  bfile->position += bytes_read;
+	result = check_window_for_bz2_magic(buf + i + j, BZ2_STREAM_MAGIC);
+	if (result >= 0) {
+	  *bits_shifted = result;
+	  *marker_type = BZ2_MARKER_FOOTER;
+	  return(i + j);
 	}
+	mask &= mask - 1;
       }
     }
-    else {
+  }
+#endif
+
+  for (; i <= len - 7; i++) {
+    if (marker_byte2_hits[buf[i + 2]]) {
+      result = check_window_for_bz2_block_marker(buf + i);
+      if (result >= 0) {
+	*bits_shifted = result;
+	*marker_type = BZ2_MARKER_BLOCK;
+	return(i);
+      }
+      result = check_window_for_bz2_magic(buf + i, BZ2_STREAM_MAGIC);
+      if (result >= 0) {
+	*bits_shifted = result;
+	*marker_type = BZ2_MARKER_FOOTER;
+	return(i);
+      }
+    }
+  }
+  return(-1);
+}
+
+/*
+  scan a buffer for the bz2 block marker at any bit offset, back to front;
+  the same indexes are checked as by find_bz2_block_marker_in_buffer()
+
+  returns:
+    index of the last match, with *bits_shifted set, or -1 if none
+*/
+int find_last_bz2_block_marker_in_buffer(unsigned char *buf, int len, int *bits_shifted) {
+  int i = len - 7;
+  int s, result;
+
+  init_marker_tables();
+
+#ifdef __SSE2__
+  {
+    __m128i want2[8], want3[8];
+    __m128i bytes2, bytes3, hits;
+    int mask, j;
+
+    for (s = 0; s < 8; s++) {
+      want2[s] = _mm_set1_epi8((char) marker_byte2[s + 1]);
+      want3[s] = _mm_set1_epi8((char) marker_byte3[s + 1]);
+    }
+    /* each pass checks indexes i-15 through i */
+    for (; i - 15 >= 0; i -= 16) {
+      bytes2 = _mm_loadu_si128((__m128i *)(buf + i - 15 + 2));
+      bytes3 = _mm_loadu_si128((__m128i *)(buf + i - 15 + 3));
+      hits = _mm_setzero_si128();
+      for (s = 0; s < 8; s++) {
+	hits = _mm_or_si128(hits, _mm_and_si128(_mm_cmpeq_epi8(bytes2, want2[s]),
+						_mm_cmpeq_epi8(bytes3, want3[s])));
+      }
+      mask = _mm_movemask_epi8(hits);
+      while (mask) {
+	j = 31 - __builtin_clz(mask);
+	result = check_window_for_bz2_block_marker(buf + i - 15 + j);
+	if (result >= 0) {
+	  *bits_shifted = result;
+	  return(i - 15 + j);
+	}
+	mask &= ~(1 << j);
+      }
+    }
+  }
+#endif
+
+  for (; i >= 0; i--) {
+    if (marker_byte2_hits[buf[i + 2]] & 1) {
+      result = check_window_for_bz2_block_marker(buf + i);
+      if (result >= 0) {
+	*bits_shifted = result;
+	return(i);
+      }
+    }
+  }
+  return(-1);
+}
+
+/*
+  scan forward from bfile->position for a block marker, reading
+  the file through bfile's read window in pieces that start out
+  at what the window already holds and grow to MARKER_SCAN_MAX
+
+  returns: 1 if found, 0 if not, -1 on error
+*/
+static int find_next_bz2_block_marker_forward(int fin, bz_info_t *bfile) {
+  read_window_t *w;
+  unsigned char *window;
+  size_t want = 7, got;
+  int index, bits_shifted;
+
+  w = get_read_window(fin, bfile);
+  if (w == NULL)
+    return(-1);
+  while (1) {
+    window = read_window_get(w, bfile->position, want, &got);
+    if (window == NULL)
+      return(-1);
+    if (got > MARKER_SCAN_MAX)
+      got = MARKER_SCAN_MAX;
+    index = find_bz2_block_marker_in_buffer(window, (int)got, &bits_shifted);
+    if (index >= 0) {
+      bfile->position += (off_t)index;
+      bfile->bits_shifted = bits_shifted;
+      bfile->block_start = bfile->position;
+      return(1);
+    }
+    if (got < want)
+      return(0);
+    /* the last 6 bytes might hold the start of a marker, start
+       the next piece with them */
+    bfile->position += (off_t)(got - 6);
+    if (want < MARKER_SCAN_MIN)
+      want = MARKER_SCAN_MIN;
+    else if (want < MARKER_SCAN_MAX)
+      want *= 2;
+  }
+}
+
+/*
+  scan backward from bfile->position for the last block marker that
+  starts at or before it, reading the file through bfile's read window
+  in pieces that grow to MARKER_SCAN_MAX
+
+  returns: 1 if found, 0 if not, -1 on error
+*/
+static int find_next_bz2_block_marker_backward(int fin, bz_info_t *bfile) {
+  read_window_t *w;
+  unsigned char *window;
+  int window_size = MARKER_SCAN_MIN;
+  int index, bits_shifted;
+  off_t start, end;
+  size_t got;
+
+  if (bfile->position < (off_t)0)
+    return(0);
+  /* a marker starting at position runs 7 bytes past it */
+  end = bfile->position + (off_t)7;
+  if (end > bfile->file_size)
+    end = bfile->file_size;
+
+  w = get_read_window(fin, bfile);
+  if (w == NULL)
+    return(-1);
+  while (end - (off_t)7 >= (off_t)0) {
+    start = end - (off_t)window_size;
+    if (start < (off_t)0)
+      start = (off_t)0;
+    window = read_window_get(w, start, (size_t)(end - start), &got);
+    if (window == NULL)
+      return(-1);
+    if (got > (size_t)(end - start))
+      got = (size_t)(end - start);
+    index = find_last_bz2_block_marker_in_buffer(window, (int)got, &bits_shifted);
+    if (index >= 0) {
+      bfile->position = start + (off_t)index;
+      bfile->bits_shifted = bits_shifted;
       bfile->block_start = bfile->position;
       return(1);
     }
+    /* the first 6 bytes might hold the end of a marker that
+       starts before the window, read them again next time */
+    end = start + (off_t)6;
+    if (start == (off_t)0)
+      break;
+    if (window_size < MARKER_SCAN_MAX)
+      window_size *= 2;
   }
   return(0);
 }
 
+/*
+  find the next block marker from bfile->position, looking
+  in the block map for the file if there is one
+
+  returns: 1 if found, 0 if not, -1 on error
+*/
+int find_next_bz2_block_marker(int fin, bz_info_t *bfile, int direction) {
+  int res;
+  bmap_entry_t *entry;
+
+  bfile->bits_shifted = -1;
+  res = find_block_in_block_map(fin, bfile->position, direction, 0, &entry);
+  if (res == 1) {
+    bfile->position = entry->offset;
+    bfile->bits_shifted = entry->bits_shifted;
+    bfile->block_start = entry->offset;
+    return(1);
+  }
+  else if (res == 0) {
+    return(0);
+  }
+
+  if (direction == FORWARD)
+    return(find_next_bz2_block_marker_forward(fin, bfile));
+  else
+    return(find_next_bz2_block_marker_backward(fin, bfile));
+}
+
+/* a chunk handed out by pooled_bzalloc(), headed by its size */
+typedef struct bz_chunk {
+  size_t size;
+  struct bz_chunk *next;
+} bz_chunk_t;
+
+/* room for the chunk header, keeping what follows it aligned */
+#define BZ_CHUNK_HEADER 64
+
+static bz_chunk_t *chunk_pool = NULL;
+static int chunk_pool_count = 0;
+static int use_huge_pages = -1;
+static pthread_mutex_t chunk_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  allocator for bz_stream, set up by init_decompress(): the decoder
+  state and the arrays for undoing the BWT are the same few sizes for
+  every block of a file, so freed chunks are kept and handed out again
+  instead of being unmapped and faulted back in for every block we look at.
+  if MWBZUTILS_HUGEPAGES is set in the environment, the large arrays
+  are aligned for and marked as wanting transparent huge pages.
+
+  returns:
+    the memory, or NULL on error
+*/
+void *pooled_bzalloc(void *opaque, int items, int size) {
+  bz_chunk_t *chunk, **prev;
+  size_t want = (size_t)items * (size_t)size;
+  void *mem;
+
+  pthread_mutex_lock(&chunk_pool_lock);
+  for (prev = &chunk_pool; (chunk = *prev) != NULL; prev = &(chunk->next)) {
+    if (chunk->size == want) {
+      *prev = chunk->next;
+      chunk_pool_count--;
+      pthread_mutex_unlock(&chunk_pool_lock);
+      return((unsigned char *)chunk + BZ_CHUNK_HEADER);
+    }
+  }
+  if (use_huge_pages < 0)
+    use_huge_pages = (getenv("MWBZUTILS_HUGEPAGES") != NULL);
+  pthread_mutex_unlock(&chunk_pool_lock);
+
+  if (use_huge_pages && want >= HUGE_PAGE_SIZE) {
+    if (posix_memalign(&mem, HUGE_PAGE_SIZE, want + BZ_CHUNK_HEADER))
+      return(NULL);
+#ifdef MADV_HUGEPAGE
+    madvise(mem, want + BZ_CHUNK_HEADER, MADV_HUGEPAGE);
+#endif
+  }
+  else {
+    mem = malloc(want + BZ_CHUNK_HEADER);
+    if (mem == NULL)
+      return(NULL);
+  }
+  chunk = (bz_chunk_t *)mem;
+  chunk->size = want;
+  return((unsigned char *)chunk + BZ_CHUNK_HEADER);
+}
+
+void pooled_bzfree(void *opaque, void *addr) {
+  bz_chunk_t *chunk;
+
+  if (addr == NULL)
+    return;
+  chunk = (bz_chunk_t *)((unsigned char *)addr - BZ_CHUNK_HEADER);
+  pthread_mutex_lock(&chunk_pool_lock);
+  if (chunk_pool_count < BZ_CHUNK_POOL_MAX) {
+    chunk->next = chunk_pool;
+    chunk_pool = chunk;
+    chunk_pool_count++;
+    chunk = NULL;
+  }
+  pthread_mutex_unlock(&chunk_pool_lock);
+  free(chunk);
+}
+
+/*
+  free the chunks kept by pooled_bzfree()
+*/
+void free_bz2_alloc_pool(void) {
+  bz_chunk_t *chunk;
+
+  pthread_mutex_lock(&chunk_pool_lock);
+  while ((chunk = chunk_pool) != NULL) {
+    chunk_pool = chunk->next;
+    free(chunk);
+  }
+  chunk_pool_count = 0;
+  pthread_mutex_unlock(&chunk_pool_lock);
+}
+
 /*
   initializes the bz2 strm structure,
   calls the BZ2 decompression library initializer
@@ -253,8 +636,8 @@ int init_decompress(bz_info_t *bfile) {
   int bz_small = 0;
   int ret;
 
-  bfile->strm.bzalloc = NULL;
-  bfile->strm.bzfree = NULL;
+  bfile->strm.bzalloc = pooled_bzalloc;
+  bfile->strm.bzfree = pooled_bzfree;
   bfile->strm.opaque = NULL;
 
   ret = BZ2_bzDecompressInit ( &(bfile->strm), bz_verbosity, bz_small );
@@ -265,15 +648,40 @@ int init_decompress(bz_info_t *bfile) {
   return(ret);
 }
 
-/* FIXME do this right. whatever. */
+/*
+  get the size of the file, without moving the file position
+
+  returns:
+    the size, or -1 on error
+*/
 off_t get_file_size(int fin) {
-  off_t seekresult;
+  struct stat statbuf;
 
-  seekresult = lseek(fin, (off_t)0, SEEK_END);
-  if (seekresult == (off_t)-1) {
-    fprintf(stderr,"lseek of file to 0 failed (6)\n");
+  if (fstat(fin, &statbuf) == -1) {
+    fprintf(stderr,"fstat of file failed (6)\n");
+    return((off_t)-1);
   }
-  return(seekresult);
+  return(statbuf.st_size);
+}
+
+/*
+  get the 4 byte bz2 header of the file into bfile->header_buffer,
+  reading it from the file only the first time for bfile
+  (the caller sets bfile->header_read to 0 when setting up bfile)
+
+  returns:
+    0 on success
+    -1 on error
+*/
+int read_bz2_header(int fin, bz_info_t *bfile) {
+  if (!(bfile->header_read)) {
+    if (pread_all(fin, bfile->header_buffer, 4, (off_t)0) < 4) {
+      fprintf(stderr,"failed to read 4 bytes of header\n");
+      return(-1);
+    }
+    bfile->header_read = 1;
+  }
+  return(0);
 }
 
 /*
@@ -289,21 +697,9 @@ off_t get_file_size(int fin) {
 */
 int decompress_header(int fin, bz_info_t *bfile) {
   int res;
-  off_t seekresult;
 
-  if (!(bfile->header_read)) {
-    seekresult = lseek(fin,(off_t)0,SEEK_SET);
-    if (seekresult == (off_t)-1) {
-      fprintf(stderr,"lseek of file to 0 failed (3)\n");
-      return(-1);
-    }
-    bfile->bytes_read = read(fin, bfile->header_buffer, 4);
-    if (bfile->bytes_read < 4) {
-      fprintf(stderr,"failed to read 4 bytes of header\n");
-      return(-1);
-    }
-    bfile->header_read = 1;
-  }
+  if (read_bz2_header(fin, bfile) == -1)
+    return(-1);
   bfile->strm.next_in = (char *)bfile->header_buffer;
   bfile->strm.avail_in = 4;
 
@@ -316,60 +712,20 @@ int decompress_header(int fin, bz_info_t *bfile) {
 }
 
 /*
-  seek to appropriate offset as specified in bfile,
-  read compressed data into buffer indicated by bfile,
-  update the bfile structure accordingly,
-  save the overflow byte (bit-shifted data = suck)
-  this is for the *first* buffer of data in a stream,
-  for subsequent buffers use fill_buffer_to_decompress()
-
-  this will set bfile->eof on eof.  no other indicator
-  will be provided.
-
-  returns:
-    0 on success
-    -1 on error
-*/
-int setup_first_buffer_to_decompress(int fin, bz_info_t *bfile) {
-  off_t seekresult;
-
-  if (bfile->bits_shifted == 0) {
-    seekresult = lseek(fin,bfile->position+(off_t)1,SEEK_SET);
-    if (seekresult == -1) {
-      fprintf(stderr,"lseek of file to %"PRId64" failed (4)\n",bfile->position+(off_t)1);
-      return(-1);
-    }
-  }
-  else {
-    seekresult = lseek(fin,bfile->position,SEEK_SET);
-    if (seekresult == -1) {
-      fprintf(stderr,"lseek of file to %"PRId64" failed (5)\n",bfile->position);
-      return(-1);
-    }
-  }
-  bfile->bytes_read = read(fin, bfile->bufin, bfile->bufin_size);
-  if (bfile->bytes_read > 0) {
-    bfile->overflow = bfile->bufin[bfile->bytes_read-1];
-    shift_bytes_left(bfile->bufin, bfile->bytes_read, bfile->bits_shifted);
-
-    bfile->strm.next_in = (char *)(bfile->bufin);
-    bfile->strm.avail_in = bfile->bytes_read-1;
-  }
-  if (bfile->bytes_read <=0) {
-    bfile->eof++;
-  }
-  return(0);
-}
-
-/*
-   set up the marker, seek to right place, get first
-   buffer of compressed data for processing
+   set up the marker, find the first block at or after (or
+   before, depending on direction) bfile->position, read the
+   bz2 header and get the block decoder ready to read from
+   the block marker
    bfile->position must be set to desired offset first by caller.
+   if bfile->readahead is set, the file is read from the block on by
+   a read-ahead thread (see start_readahead()), stopped by the next
+   call or by stop_bz2_readahead()
    returns:
-   -1 if no marker or other error, position of next read if ok
+   -1 if no marker or other error, 0 if ok
 */
 int init_bz2_file(bz_info_t *bfile, int fin, int direction) {
-  off_t seekresult;
+  off_t start;
+  int window;
 
   bfile->bufin_size = BUFINSIZE;
   if (bfile->marker == NULL)
@@ -377,7 +733,6 @@ int init_bz2_file(bz_info_t *bfile, int fin, int direction) {
   bfile->bytes_read = 0;
   bfile->bytes_written = 0;
   bfile->eof = 0;
-  bfile->header_read = 0;
 
   bfile->initialized++;
 
@@ -386,118 +741,194 @@ int init_bz2_file(bz_info_t *bfile, int fin, int direction) {
     fprintf(stderr,"asked for position past end of file\n");
     return(-1);
   }
-  seekresult = lseek(fin, bfile->position, SEEK_SET);
-  if (seekresult == (off_t)-1) {
-    fprintf(stderr,"lseek of file to %"PRId64" failed (9)\n",bfile->position);
-    return(-1);
-  }
 
   find_next_bz2_block_marker(fin, bfile, direction);
-  if (bfile->bits_shifted >= 0) {
-    init_decompress(bfile);
-    decompress_header(fin, bfile);
-    setup_first_buffer_to_decompress(fin, bfile);
-    return(0);
+  if (bfile->bits_shifted < 0)
+    return(-1);
+
+  if (read_bz2_header(fin, bfile) == -1)
+    return(-1);
+  if (bfile->header_buffer[0] != 'B' || bfile->header_buffer[1] != 'Z' ||
+      bfile->header_buffer[2] != 'h' ||
+      bfile->header_buffer[3] < '1' || bfile->header_buffer[3] > '9') {
+    fprintf(stderr,"Corrupt bzip2 header\n");
+    return(-1);
   }
-  return(-1);
+  bfile->block_size = bfile->header_buffer[3] - '0';
+
+  if (init_decompress(bfile) != BZ_OK)
+    return(-1);
+  /* a marker that is not shifted starts in the byte after its offset */
+  start = bfile->bits_shifted ? bfile->position : bfile->position + (off_t)1;
+  stop_bz2_readahead(bfile);
+  window = get_readahead_window(bfile->readahead);
+  if (window)
+    bfile->ra = start_readahead(fin, start, window);
+  if (bfile->ra)
+    BZ2_bitReaderInitReadahead(&(bfile->reader), bfile->ra, start, bfile->bits_shifted);
+  else
+    BZ2_bitReaderInit(&(bfile->reader), fin, start, bfile->bits_shifted,
+		      bfile->bufin, bfile->bufin_size);
+  return(0);
 }
 
 
 /*
-  read compressed data into buffer indicated by bfile,
-  from current position of file,
-  stuffing the overflow byte in first.
-  update the bfile structure accordingly
-  save the new overflow byte (bit-shifted data = suck)
-  this function is for decompression of buffers *after
-  the first one*.  for the first one use
-  setup_first_buffer_to_decompress()
-
-  this will set bfile->eof on eof.  no other indicator
-  will be provided.
-
-  returns:
-    0 on success
-    hmm, it really does not do anything about errors :-D
+   set up a window of the given size over decompressed data.
+   the data not yet consumed is always contiguous and followed
+   by a '\0', so that it can be searched as a string.
+   returns:
+     new ubuf_t, or NULL on error
 */
-int fill_buffer_to_decompress(int fin, bz_info_t *bfile, int ret) {
-  if (bfile->strm.avail_in == 0) {
-    bfile->strm.next_in = (char *)(bfile->bufin);
-    bfile->bufin[0] = bfile->overflow;
-    bfile->bytes_read = read(fin, bfile->bufin+1, bfile->bufin_size-1);
-    if (bfile->bytes_read > 0) {
-      bfile->position+=bfile->bytes_read;
-      bfile->overflow = bfile->bufin[bfile->bytes_read];
-      shift_bytes_left(bfile->bufin,bfile->bytes_read+1,bfile->bits_shifted);
-      bfile->strm.avail_in = bfile->bytes_read;
-    }
-    else { /* bfile->bytes_read <= 0 */
-      bfile->strm.avail_in = 1; /* the overflow byte */
-      bfile->eof++;
-    }
+ubuf_t *init_ubuf(size_t size) {
+  ubuf_t *u;
+
+  u = (ubuf_t *)malloc(sizeof(ubuf_t));
+  if (u == NULL) {
+    fprintf(stderr,"failed to allocate buffer for decompressed data\n");
+    return(NULL);
   }
-  return(0);
+  u->buffer = (unsigned char *)malloc(size + 1);
+  if (u->buffer == NULL) {
+    fprintf(stderr,"failed to allocate buffer for decompressed data\n");
+    free(u);
+    return(NULL);
+  }
+  u->size = size;
+  u->start = u->end = 0;
+  u->buffer[0] = '\0';
+  return(u);
 }
 
-/* size of buffer is bytes usable. there will be a null byte at the end
-
-   what we do with the buffer:
-   - read from front of buffer to end,
-   - fill from point where prev read did not fill buffer, or from where
-     move of data at end of buffer to beginning left room,
-   - mark a string of bytes (starting from what's available to read) as "read"
+void free_ubuf(ubuf_t *u) {
+  if (u) {
+    free(u->buffer);
+    free(u);
+  }
+}
 
+/*
+   returns:
+     the data not yet consumed, with its length in *len
 */
-buf_info_t *init_buffer(int size) {
-  buf_info_t *b;
+unsigned char *ubuf_peek(ubuf_t *u, size_t *len) {
+  *len = u->end - u->start;
+  return(u->buffer + u->start);
+}
 
-  b = (buf_info_t *)malloc(sizeof(buf_info_t));
-  b->buffer = malloc(sizeof(unsigned char)*(size+1));
-  b->buffer[size]='\0';
-  b->end = b->buffer + size;
-  b->next_to_read = b->end; /* nothing available */
-  b->bytes_avail = 0; /* bytes to read, nothing available */
-  b->next_to_fill = b->buffer; /* empty */
-  b->next_to_fill[0] = '\0';
-  return(b);
+/* drop len bytes from the front of the data */
+void ubuf_consume(ubuf_t *u, size_t len) {
+  u->start += len;
+  if (u->start >= u->end) {
+    u->start = u->end = 0;
+    u->buffer[0] = '\0';
+  }
 }
 
-/* free pieces of buf_info_t */
-void free_buffer(buf_info_t *b) {
-  if (b) {
-    if (b->buffer) {
-      free(b->buffer);
-    }
+/*
+   look for needle in the data not yet consumed.  if it is not
+   there in full, the end of the data may hold the start of it,
+   to be completed by the next fill; so everything in front of
+   the index returned may be consumed either way.
+   returns:
+     index of needle with *found set, or else the index of the
+     longest tail of the data that is a start of needle (the
+     length of the data if there is none) with *found cleared
+*/
+size_t ubuf_find(ubuf_t *u, char *needle, int *found) {
+  unsigned char *data = u->buffer + u->start, *match;
+  size_t len = u->end - u->start, needle_len = strlen(needle), tail;
+
+  match = memmem(data, len, needle, needle_len);
+  if (match != NULL) {
+    *found = 1;
+    return(match - data);
   }
-  return;
+  *found = 0;
+  tail = needle_len - 1 < len ? needle_len - 1 : len;
+  for (; tail > 0; tail--) {
+    if (!memcmp(data + len - tail, needle, tail))
+      break;
+  }
+  return(len - tail);
 }
 
-/* check if buffer (used for decompressed data output) is empty,
-   returns 1 if so and 0 if not */
-int buffer_is_empty(buf_info_t *b) {
-  if (b->bytes_avail == 0) {
-    return(1);
+/*
+   decompress more data from bfile onto the end of the window.  the
+   data not yet consumed is moved to the front of the buffer first if
+   less than a quarter of it is free at the end, so that each byte is
+   moved only a few times however the window is consumed.  bfile->position
+   should be set as for get_and_decompress_data() the first time.
+
+   returns:
+     number of bytes added (0 at the end of the data, or if the window
+       is full of data not yet consumed)
+     -1 on error
+*/
+int fill_ubuf(ubuf_t *u, int fin, bz_info_t *bfile) {
+  if (u->start && u->size - u->end < u->size / 4) {
+    memmove(u->buffer, u->buffer + u->start, u->end - u->start);
+    u->end -= u->start;
+    u->start = 0;
   }
-  else {
+  if (u->end == u->size)
     return(0);
-  }
+  bfile->strm.next_out = (char *)(u->buffer + u->end);
+  bfile->strm.avail_out = u->size - u->end;
+  if (get_and_decompress_data(bfile, fin, u->buffer + u->end, u->size - u->end, FORWARD) < 0)
+    return(-1);
+  u->end += bfile->bytes_written;
+  u->buffer[u->end] = '\0';
+  return(bfile->bytes_written);
 }
 
-/* check if buffer (used for decompressed data output) is full,
+/*
+   decode the next block of the file, setting bfile->position
+   to its offset, or set bfile->eof if there are no more blocks
+   in the stream
+   returns:
+     0 on success
+     -1 on error
+*/
+static int decode_next_block(bz_info_t *bfile) {
+  int ret;
+  int64_t bit_offset;
 
-   returns 1 if so and 0 if not
-   I'm not liking this function so well, fixme */
-int buffer_is_full(buf_info_t *b) {
-  if (b->next_to_fill == b->end) {
-    return(1);
+  bit_offset = BZ2_bitReaderTell(&(bfile->reader));
+  if (bit_offset % 8) {
+    bfile->position = (off_t)(bit_offset / 8);
   }
   else {
-    return(0);
+    bfile->position = (off_t)(bit_offset / 8) - (off_t)1;
+  }
+  ret = BZ2_bzDecodeBlock(&(bfile->strm), &(bfile->reader), bfile->block_size);
+  if (ret == BZ_STREAM_END) {
+    bfile->eof++;
+  }
+  else if (ret == BZ_UNEXPECTED_EOF) {
+    if (bfile->reader.last_read)
+      fprintf(stderr,"file ends in the middle of a block\n");
+    bfile->eof++;
+  }
+  else if (ret != BZ_OK) {
+    fprintf(stderr,"error from BZ decompress %d (1)\n",ret);
+    return(-1);
   }
+  return(0);
 }
 
+/*
+   get the next buffer of uncompressed stuff.  blocks are
+   decoded as their output is needed, except that when a
+   block's output is complete, the next one is decoded
+   right away, so that bfile->eof is set along with the
+   last of the data.  bfile->position is the offset of the
+   block decoded most recently.
 
-/* get the next buffer of uncompressed stuff */
+   returns:
+     0 on success
+     -1 on error
+*/
 int get_and_decompress_data(bz_info_t *bfile, int fin, unsigned char *bufferout, int bufout_size, int direction) {
   int ret;
 
@@ -512,101 +943,61 @@ int get_and_decompress_data(bz_info_t *bfile, int fin, unsigned char *bufferout,
     };
     bfile->strm.next_out = (char *)bfile->bufout;
     bfile->strm.avail_out = bfile->bufout_size;
+    if (decode_next_block(bfile) == -1)
+      return(-1);
   }
-  ret = BZ_OK;
-  while (BZ_OK == ret && bfile->bytes_written == 0) {
-    ret = BZ2_bzDecompress_mine ( &(bfile->strm) );
-    if (BZ_OK == ret || BZ_STREAM_END == ret) {
-      bfile->bytes_written = (unsigned char *)(bfile->strm.next_out) - bfile->bufout;
+  while (bfile->bytes_written == 0 && ! bfile->eof) {
+    if (bfile->skip_crc)
+      ret = BZ2_bzDecodeOutputUnchecked(&(bfile->strm));
+    else
+      ret = BZ2_bzDecodeOutput(&(bfile->strm));
+    if (ret != BZ_OK && ret != BZ_BLOCK_END) {
+      fprintf(stderr,"error from BZ decompress %d (2)\n",ret);
+      return(-1);
     }
-    else {
-      fprintf(stderr,"error from BZ decompress %d (1)\n",ret);
+    bfile->bytes_read = bfile->reader.last_read;
+    bfile->bytes_written = (unsigned char *)(bfile->strm.next_out) - bfile->bufout;
+    if (ret == BZ_BLOCK_END && decode_next_block(bfile) == -1)
       return(-1);
-    }
-    fill_buffer_to_decompress(fin, bfile, ret);
-  }
-  if (ret == BZ_STREAM_END) {
-    bfile->eof++;
   }
   return(0);
 }
 
 /*
-   fill output buffer in b with uncompressed data from bfile
-   if this is the first call to the function for this file,
-   the file header will be read, and the first buffer of
-   uncompressed data will be prepared.  bfile->position
-   should be set to the offset (from the beginning of file) from
-   which to find the first bz2 block.
+   decode the start of the block found by find_first_bz2_block_from_offset()
+   into out, at most budget bytes of it, for a look at its first page or
+   rev id.  only as much of the block is undone as that takes, see
+   BZ2_bzDecodeBlockPrefix().  bfile is left uninitialized, so that
+   fill_ubuf() can be used on it afterwards to decode the block in full.
 
    returns:
-     on success, number of bytes read (may be 0)
+     number of bytes written to out (a short count means the block
+     has no more output)
      -1 on error
 */
-int get_buffer_of_uncompressed_data(buf_info_t *b, int fin, bz_info_t *bfile, int direction) {
-  int res;
-
-  if (buffer_is_full(b)) {
-    return(0);
-  }
+int get_block_prefix(int fin, bz_info_t *bfile, unsigned char *out, int budget) {
+  int ret, out_len = 0;
 
-  if (buffer_is_empty(b)) {
-    b->next_to_fill = b->buffer;
-  }
-  res = get_and_decompress_data(bfile, fin, b->next_to_fill, b->end - b->next_to_fill, direction);
-  if (res <0 ) {
-    return(res);
-  }
-  if (bfile->bytes_written < 0) {
-    fprintf(stderr,"read of file failed\n");
+  if (read_bz2_header(fin, bfile) == -1)
+    return(-1);
+  if (bfile->header_buffer[3] < '1' || bfile->header_buffer[3] > '9') {
+    fprintf(stderr,"Corrupt bzip2 header\n");
     return(-1);
   }
-  else {
-    /* really?? FIXME check this */
-    if (buffer_is_empty(b)) {
-      b->next_to_read = b->next_to_fill; /* where we just read */
-    }
-    b->bytes_avail += bfile->bytes_written;
-    b->next_to_fill += bfile->bytes_written;
-    b->next_to_fill[0] = '\0';
-    return(0);
-  }
-}
-
-void dumpbuf_info_t(buf_info_t *b) {
-  fprintf(stderr, "\n");
-  fprintf(stderr, "b->buffer: %ld\n", (long int) b->buffer);
-  fprintf(stderr, "b->end: %ld\n", (long int) b->end);
-  fprintf(stderr, "b->next_to_read: %ld\n", (long int) b->next_to_read);
-  fprintf(stderr, "b->next_to_fill: %ld\n", (long int) b->next_to_fill);
-  fprintf(stderr, "b->bytes_avail: %ld\n", (long int) b->bytes_avail);
-}
-
-/*
-   copy text from end of buffer to the beginning, that we want to keep
-   around for further processing (i.e. further regex matches)
-   returns number of bytes copied
-*/
-int  move_bytes_to_buffer_start(buf_info_t *b, unsigned char *fromwhere, int maxbytes) {
-  int i, tocopy;
-
-  if (fromwhere >= b->end) {
-    return(0);
-  }
-  else {
-    tocopy = b->end - fromwhere;
-    if (maxbytes && (tocopy > maxbytes)) {
-      tocopy = maxbytes;
-    }
-    for (i = 0; i < tocopy; i++) {
-      b->buffer[i] = fromwhere[i];
-    }
-    b->next_to_fill = b->buffer + tocopy;
-    b->next_to_fill[0] = '\0';
-    b->next_to_read = b->buffer;
-    b->bytes_avail = tocopy;
-    return(tocopy);
+  if (init_decompress(bfile) != BZ_OK)
+    return(-1);
+  BZ2_bitReaderInit(&(bfile->reader), fin,
+		    bfile->bits_shifted ? bfile->block_start : bfile->block_start + (off_t)1,
+		    bfile->bits_shifted, bfile->bufin, BUFINSIZE);
+  ret = BZ2_bzDecodeBlockPrefix(&(bfile->strm), &(bfile->reader), bfile->header_buffer[3] - '0',
+				(char *)out, budget, &out_len);
+  BZ2_bzDecompressEnd(&(bfile->strm));
+  bfile->initialized = 0;
+  if (ret != BZ_OK && ret != BZ_BLOCK_END) {
+    fprintf(stderr,"error from BZ decompress %d (3)\n",ret);
+    return(-1);
   }
+  return(out_len);
 }
 
 unsigned char ** init_footer() {
@@ -632,17 +1023,24 @@ unsigned char ** init_footer() {
   return(footer);
 }
 
+/*
+  read the last 11 bytes of the file into buffer, where
+  the bz2 footer is, with maybe a byte of padding after it
+
+  returns:
+    0 on success
+    -1 on error
+*/
 int read_footer(unsigned char *buffer, int fin) {
-  off_t seekresult;
-  int res;
+  off_t file_size;
 
-  seekresult = lseek(fin, (off_t)-11, SEEK_END);
-  if (seekresult == (off_t)-1) {
-    fprintf(stderr,"lseek of file failed\n");
+  file_size = get_file_size(fin);
+  if (file_size < (off_t)11) {
+    if (file_size != (off_t)-1)
+      fprintf(stderr,"file too short for a bz2 footer\n");
     return(-1);
   }
-  res = read(fin, buffer, 11);
-  if (res == -1) {
+  if (pread_all(fin, buffer, 11, file_size - (off_t)11) < 11) {
     fprintf(stderr,"read of file failed\n");
     return(-1);
   }
@@ -657,7 +1055,8 @@ int check_file_for_footer(int fin, bz_info_t *bfile) {
   unsigned char buffer[11];
   int result, i;
 
-  read_footer(buffer,fin);
+  if (read_footer(buffer,fin) == -1)
+    return(-1);
 
   result = bytes_compare(bfile->footer[0],buffer+1,6,0);
   if (!result) {
@@ -682,12 +1081,721 @@ void clear_buffer(unsigned char *buf, int length) {
   return;
 }
 
+/*
+  read up to count bytes from offset in the file without
+  touching the file position, retrying short reads
+
+  returns:
+    number of bytes read (less than count only at eof), -1 on error
+*/
+ssize_t pread_all(int fin, unsigned char *buf, size_t count, off_t offset) {
+  ssize_t res;
+  size_t done = 0;
+
+  while (done < count) {
+    res = pread(fin, buf + done, count - done, offset + (off_t)done);
+    if (res == -1) {
+      if (errno == EINTR)
+	continue;
+      return(-1);
+    }
+    if (res == 0)
+      break;
+    done += (size_t)res;
+  }
+  return((ssize_t)done);
+}
+
+/*
+  set up a read window for the file, with nothing in it yet
+
+  returns:
+    the window, or NULL on error
+*/
+read_window_t *init_read_window(int fin) {
+  read_window_t *w;
+
+  w = (read_window_t *)malloc(sizeof(read_window_t));
+  if (w == NULL) {
+    fprintf(stderr,"failed to allocate read window\n");
+    return(NULL);
+  }
+  w->buffer = (unsigned char *)malloc(READ_WINDOW_MIN);
+  if (w->buffer == NULL) {
+    fprintf(stderr,"failed to allocate read window\n");
+    free(w);
+    return(NULL);
+  }
+  w->fin = fin;
+  w->size = READ_WINDOW_MIN;
+  w->start = (off_t)0;
+  w->len = 0;
+  w->eof = 0;
+  w->dropped = (off_t)-1;
+  return(w);
+}
+
+void free_read_window(read_window_t *w) {
+  if (w) {
+    free(w->buffer);
+    free(w);
+  }
+}
+
+/*
+  get count bytes of the file starting at offset, from the window
+  if it has them all (or has everything up to the end of the file),
+  otherwise by reading the window afresh from offset, at least
+  READ_WINDOW_MIN bytes of it.  the file position is not used.
+
+  returns:
+    pointer into the window, good until the next call, with the number
+    of bytes there from offset in *got; this is all that the window
+    holds, so it may be more than count, and is less only at eof.
+    NULL on error
+*/
+unsigned char *read_window_get(read_window_t *w, off_t offset, size_t count, size_t *got) {
+  unsigned char *buffer;
+  size_t toread;
+  ssize_t bytes_read;
+
+  if (offset < w->start || offset > w->start + (off_t)w->len ||
+      (offset + (off_t)count > w->start + (off_t)w->len && !w->eof)) {
+    toread = count > READ_WINDOW_MIN ? count : READ_WINDOW_MIN;
+    if (toread > w->size) {
+      buffer = (unsigned char *)realloc(w->buffer, toread);
+      if (buffer == NULL) {
+	fprintf(stderr,"failed to allocate read window\n");
+	return(NULL);
+      }
+      w->buffer = buffer;
+      w->size = toread;
+    }
+    if (w->dropped < (off_t)0)
+      w->dropped = offset;
+    io_drop_behind(w->fin, &(w->dropped), offset);
+    bytes_read = pread_all(w->fin, w->buffer, toread, offset);
+    if (bytes_read == -1) {
+      fprintf(stderr,"read of file failed\n");
+      w->len = 0;
+      return(NULL);
+    }
+    w->start = offset;
+    w->len = (size_t)bytes_read;
+    w->eof = (size_t)bytes_read < toread;
+  }
+  *got = w->len - (size_t)(offset - w->start);
+  return(w->buffer + (offset - w->start));
+}
+
+/*
+  get the read window for searches in the file, setting
+  one up for bfile the first time
+
+  returns:
+    the window, or NULL on error
+*/
+read_window_t *get_read_window(int fin, bz_info_t *bfile) {
+  if (bfile->window == NULL)
+    bfile->window = init_read_window(fin);
+  return(bfile->window);
+}
+
+/*
+  hints to the kernel about how the file is read, so that the page
+  cache is used well on hosts shared with other jobs: tools that make
+  one pass through a file (IO_POLICY_STREAM) drop what they have read
+  from the page cache as they go, unless MWBZUTILS_KEEPCACHE is set
+  in the environment, and tools that search (IO_POLICY_PROBE) turn off
+  the kernel's own read-ahead, which is wasted on reads here and there,
+  and ask for what they are about to decode instead.  the policy is
+  set once by each tool, before any reads.
+*/
+static int io_policy = IO_POLICY_NONE;
+static int io_keep_cache = 0;
+
+void set_io_policy(int fin, int policy) {
+  io_policy = policy;
+  io_keep_cache = (getenv("MWBZUTILS_KEEPCACHE") != NULL);
+  if (policy == IO_POLICY_STREAM)
+    posix_fadvise(fin, (off_t)0, (off_t)0, POSIX_FADV_SEQUENTIAL);
+  else if (policy == IO_POLICY_PROBE)
+    posix_fadvise(fin, (off_t)0, (off_t)0, POSIX_FADV_RANDOM);
+}
+
+/*
+  for streaming reads, which have read the file up to offset: drop
+  what is behind it from the page cache, once DROP_BEHIND_STEP bytes
+  have been read since the last time.  *dropped holds where that was,
+  and should start out as the offset the reads started at.
+*/
+void io_drop_behind(int fin, off_t *dropped, off_t offset) {
+  if (io_policy != IO_POLICY_STREAM || io_keep_cache)
+    return;
+  if (offset - *dropped >= (off_t)DROP_BEHIND_STEP) {
+    posix_fadvise(fin, *dropped, offset - *dropped, POSIX_FADV_DONTNEED);
+    *dropped = offset;
+  }
+}
+
+/* for probes: ask for len bytes from offset to be read in ahead of use */
+void io_will_need(int fin, off_t offset, off_t len) {
+  if (io_policy == IO_POLICY_PROBE)
+    posix_fadvise(fin, offset, len, POSIX_FADV_WILLNEED);
+}
+
+/*
+  read-ahead: a thread of its own reads the file from some offset on
+  into two buffers in turn, while the reader works through the data
+  in the other one, so that decoding and reads of the file overlap
+*/
+struct readahead {
+  int fin;
+  int window;                   /* bytes read into a buffer at a time */
+  unsigned char *buffers[2];
+  ssize_t len[2];               /* bytes of the file in each buffer */
+  off_t offsets[2];             /* file offset of each buffer */
+  int full[2];                  /* set if a buffer has been read and not yet handed out */
+  int next_fill;                /* buffer the thread reads into next */
+  int next_take;                /* buffer handed out to the reader next */
+  int in_use;                   /* buffer the reader has, or -1 */
+  off_t next_offset;            /* file offset of the next read */
+  off_t dropped;                /* file is dropped from the page cache up to here, see io_drop_behind() */
+  int eof;                      /* set when the thread has read to the end of the file */
+  int error;                    /* set if a read failed */
+  int stop;                     /* set to tell the thread to quit */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/*
+  get the number of bytes to read ahead at a time, given the number a
+  tool asks for; MWBZUTILS_READAHEAD in the environment overrides it
+  (0 for none), and it is kept between READAHEAD_MIN and READAHEAD_MAX
+
+  returns:
+    the window, or 0 for no read-ahead
+*/
+int get_readahead_window(int window) {
+  char *value;
+
+  value = getenv("MWBZUTILS_READAHEAD");
+  if (value != NULL)
+    window = atoi(value);
+  if (window <= 0)
+    return(0);
+  if (window < READAHEAD_MIN)
+    window = READAHEAD_MIN;
+  else if (window > READAHEAD_MAX)
+    window = READAHEAD_MAX;
+  return(window);
+}
+
+static void *readahead_thread(void *arg) {
+  readahead_t *ra = (readahead_t *)arg;
+  int slot;
+  off_t offset;
+  ssize_t bytes_read;
+
+  pthread_mutex_lock(&(ra->lock));
+  while (1) {
+    while (!ra->stop && (ra->full[ra->next_fill] || ra->next_fill == ra->in_use))
+      pthread_cond_wait(&(ra->cond), &(ra->lock));
+    if (ra->stop)
+      break;
+    slot = ra->next_fill;
+    offset = ra->next_offset;
+    pthread_mutex_unlock(&(ra->lock));
+
+    /* the data is in the buffers once read, the page cache copy is not needed */
+    io_drop_behind(ra->fin, &(ra->dropped), offset);
+    bytes_read = pread_all(ra->fin, ra->buffers[slot], (size_t)ra->window, offset);
+
+    pthread_mutex_lock(&(ra->lock));
+    if (bytes_read == -1) {
+      ra->error = 1;
+    }
+    else {
+      ra->len[slot] = bytes_read;
+      ra->offsets[slot] = offset;
+      ra->full[slot] = 1;
+      ra->next_offset += (off_t)bytes_read;
+      ra->next_fill = 1 - slot;
+      if (bytes_read < ra->window)
+	ra->eof = 1;
+    }
+    pthread_cond_broadcast(&(ra->cond));
+    if (ra->error || ra->eof)
+      break;
+  }
+  pthread_mutex_unlock(&(ra->lock));
+  return(NULL);
+}
+
+/*
+  start reading the file ahead from offset, window bytes at a time,
+  on a thread of its own
+
+  returns:
+    the read-ahead, to get data from with readahead_next(), or NULL on error
+*/
+readahead_t *start_readahead(int fin, off_t offset, int window) {
+  readahead_t *ra;
+
+  ra = (readahead_t *)malloc(sizeof(readahead_t));
+  if (ra == NULL) {
+    fprintf(stderr,"failed to allocate read-ahead\n");
+    return(NULL);
+  }
+  ra->buffers[0] = (unsigned char *)malloc(window);
+  ra->buffers[1] = (unsigned char *)malloc(window);
+  if (ra->buffers[0] == NULL || ra->buffers[1] == NULL) {
+    fprintf(stderr,"failed to allocate read-ahead buffers\n");
+    free(ra->buffers[0]);
+    free(ra->buffers[1]);
+    free(ra);
+    return(NULL);
+  }
+  ra->fin = fin;
+  ra->window = window;
+  ra->full[0] = ra->full[1] = 0;
+  ra->next_fill = ra->next_take = 0;
+  ra->in_use = -1;
+  ra->next_offset = offset;
+  ra->dropped = offset;
+  ra->eof = ra->error = ra->stop = 0;
+  pthread_mutex_init(&(ra->lock), NULL);
+  pthread_cond_init(&(ra->cond), NULL);
+  if (pthread_create(&(ra->thread), NULL, readahead_thread, ra)) {
+    fprintf(stderr,"failed to start read-ahead thread\n");
+    pthread_mutex_destroy(&(ra->lock));
+    pthread_cond_destroy(&(ra->cond));
+    free(ra->buffers[0]);
+    free(ra->buffers[1]);
+    free(ra);
+    return(NULL);
+  }
+  return(ra);
+}
+
+/*
+  hand the buffer got last time back to the read-ahead thread
+  and get the next one, waiting for it to be read if need be
+
+  returns:
+    number of bytes in the buffer, with the buffer in *buf and its file
+    offset in *offset, 0 at eof, -1 on error
+*/
+ssize_t readahead_next(readahead_t *ra, unsigned char **buf, off_t *offset) {
+  ssize_t len = 0;
+
+  pthread_mutex_lock(&(ra->lock));
+  if (ra->in_use >= 0) {
+    ra->in_use = -1;
+    pthread_cond_broadcast(&(ra->cond));
+  }
+  while (!ra->full[ra->next_take] && !ra->eof && !ra->error)
+    pthread_cond_wait(&(ra->cond), &(ra->lock));
+  if (ra->full[ra->next_take]) {
+    ra->in_use = ra->next_take;
+    ra->full[ra->next_take] = 0;
+    ra->next_take = 1 - ra->next_take;
+    *buf = ra->buffers[ra->in_use];
+    *offset = ra->offsets[ra->in_use];
+    len = ra->len[ra->in_use];
+  }
+  else if (ra->error) {
+    fprintf(stderr,"read of file failed\n");
+    len = -1;
+  }
+  pthread_mutex_unlock(&(ra->lock));
+  return(len);
+}
+
+/* stop the read-ahead thread and free everything */
+void stop_readahead(readahead_t *ra) {
+  if (ra == NULL)
+    return;
+  pthread_mutex_lock(&(ra->lock));
+  ra->stop = 1;
+  pthread_cond_broadcast(&(ra->cond));
+  pthread_mutex_unlock(&(ra->lock));
+  pthread_join(ra->thread, NULL);
+  pthread_mutex_destroy(&(ra->lock));
+  pthread_cond_destroy(&(ra->cond));
+  free(ra->buffers[0]);
+  free(ra->buffers[1]);
+  free(ra);
+}
+
+/*
+  stop any read-ahead for the decoder of bfile; the decoder must not
+  be used afterwards without setting it up again with init_bz2_file()
+*/
+void stop_bz2_readahead(bz_info_t *bfile) {
+  stop_readahead(bfile->ra);
+  bfile->ra = NULL;
+}
+
+/*
+  output of decompressed data to a file descriptor.  data is gathered
+  in a page aligned buffer of OUTPUT_BUFSIZE bytes, which callers may
+  decompress into directly (output_space(), output_commit()) or copy
+  into (output_write()), and is written out with write() whenever the
+  buffer fills.
+
+  returns:
+    new output_t, or NULL on error
+*/
+output_t *init_output(int fd) {
+  output_t *out;
+
+  out = (output_t *)malloc(sizeof(output_t));
+  if (out == NULL) {
+    fprintf(stderr,"failed to allocate output\n");
+    return(NULL);
+  }
+  out->buffer = mmap(NULL, OUTPUT_BUFSIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (out->buffer == MAP_FAILED) {
+    fprintf(stderr,"failed to allocate output buffer\n");
+    free(out);
+    return(NULL);
+  }
+  out->fd = fd;
+  out->fill = 0;
+  out->written = 0;
+  return(out);
+}
+
+/*
+  write the contents of the buffer to the descriptor and empty it
+  returns:
+    0 on success, -1 on error
+*/
+int flush_output(output_t *out) {
+  unsigned char *buf = out->buffer;
+  size_t len = out->fill;
+  ssize_t res;
+
+  while (len) {
+    res = write(out->fd, buf, len);
+    if (res < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf(stderr,"failed to write output: %s\n", strerror(errno));
+      return(-1);
+    }
+    buf += res;
+    len -= res;
+  }
+  out->written += out->fill;
+  out->fill = 0;
+  return(0);
+}
+
+/*
+  find room for more output in the buffer, flushing it
+  first if it is full
+  returns:
+    where the room starts, with its size in *len, or NULL on error
+*/
+unsigned char *output_space(output_t *out, size_t *len) {
+  if (out->fill == OUTPUT_BUFSIZE && flush_output(out) == -1)
+    return(NULL);
+  *len = OUTPUT_BUFSIZE - out->fill;
+  return(out->buffer + out->fill);
+}
+
+/* note that len bytes were put in the room given by output_space() */
+void output_commit(output_t *out, size_t len) {
+  out->fill += len;
+}
+
+/*
+  copy len bytes at buf to the output
+  returns:
+    0 on success, -1 on error
+*/
+int output_write(output_t *out, unsigned char *buf, size_t len) {
+  unsigned char *space;
+  size_t room;
+
+  while (len) {
+    space = output_space(out, &room);
+    if (space == NULL)
+      return(-1);
+    if (room > len)
+      room = len;
+    memcpy(space, buf, room);
+    output_commit(out, room);
+    buf += room;
+    len -= room;
+  }
+  return(0);
+}
+
+/*
+  flush the output and free it
+  returns:
+    0 on success, -1 on error
+*/
+int free_output(output_t *out) {
+  int res;
+
+  res = flush_output(out);
+  munmap(out->buffer, OUTPUT_BUFSIZE);
+  free(out);
+  return(res);
+}
+
+/* reads bits msb first from a buffer of bz2 data, see get_bits() */
+typedef struct {
+  unsigned char *buf;
+  int64_t next_bit;       /* index of next bit to read */
+  int64_t end_bit;        /* index of bit after the last one in the buffer */
+} bit_reader_t;
+
+/*
+  get the next numbits (at most 24) bits from the reader
+  returns:
+    the bits as an int, -1 if there are not enough left
+*/
+static int get_bits(bit_reader_t *bits, int numbits) {
+  int value = 0;
+  int64_t byte;
+  int avail;
+
+  if (bits->next_bit + numbits > bits->end_bit)
+    return(-1);
+  while (numbits) {
+    byte = bits->next_bit >> 3;
+    avail = 8 - (int)(bits->next_bit & 7);
+    if (avail > numbits)
+      avail = numbits;
+    value = (value << avail) |
+      ((bits->buf[byte] >> (8 - (int)(bits->next_bit & 7) - avail)) & ((1 << avail) - 1));
+    bits->next_bit += avail;
+    numbits -= avail;
+  }
+  return(value);
+}
+
+/* the most selectors a block header can claim (a 15 bit count); the
+   decoder reads them all but uses only the first BZ_MAX_SELECTORS */
+#define BLOCK_SELECTORS_MAX 32767
+
+/* the largest possible bz2 block header: marker, crc, randomised bit,
+   origPtr, symbol map, huffman table count, selectors and code lengths */
+#define BLOCK_HEADER_MAX_BYTES ((48 + 32 + 1 + 24 + 16 + 256 + 3 + 15 + \
+				 BLOCK_SELECTORS_MAX * BZ_N_GROUPS + \
+				 BZ_N_GROUPS * (5 + BZ_MAX_ALPHA_SIZE * 2 * BZ_MAX_CODE_LEN)) / 8 + 2)
+
+/*
+  check the block header in the len bytes of buf, which hold the block
+  from its marker on, starting at the given bit of the first byte.
+  header is the 4 byte bz2 file header, for the block size.
+
+  returns:
+    1 if the block header is valid, 2 if buf ends before the block
+    header does, 0 if not
+*/
+static int check_block_header_bytes(unsigned char *buf, size_t len, int bits_shifted, unsigned char *header) {
+  bit_reader_t bits;
+  int block_size_100k, orig_ptr, in_use16, nInUse, alpha_size, nGroups, nSelectors;
+  int i, j, t, value, code_len, result = 0;
+
+  if (header[3] >= '1' && header[3] <= '9')
+    block_size_100k = header[3] - '0';
+  else
+    block_size_100k = 9;
+
+  bits.buf = buf;
+  bits.next_bit = bits_shifted;
+  bits.end_bit = (int64_t)len * 8;
+
+  /* running out of data anywhere below means a truncated file,
+     where the block can't be ruled out */
+  result = 2;
+
+  /* marker and block crc */
+  if (get_bits(&bits, 24) == -1 || get_bits(&bits, 24) == -1 || get_bits(&bits, 16) == -1 ||
+      get_bits(&bits, 16) == -1)
+    goto done;
+  /* randomised blocks are still decompressible, they are just old */
+  if (get_bits(&bits, 1) == -1)
+    goto done;
+  orig_ptr = get_bits(&bits, 24);
+  if (orig_ptr == -1)
+    goto done;
+  if (orig_ptr > 10 + 100000 * block_size_100k) {
+    result = 0;
+    goto done;
+  }
+
+  in_use16 = get_bits(&bits, 16);
+  if (in_use16 == -1)
+    goto done;
+  nInUse = 0;
+  for (i = 0; i < 16; i++) {
+    if (in_use16 & (0x8000 >> i)) {
+      value = get_bits(&bits, 16);
+      if (value == -1)
+	goto done;
+      for (j = 0; j < 16; j++)
+	if (value & (0x8000 >> j))
+	  nInUse++;
+    }
+  }
+  if (nInUse == 0) {
+    result = 0;
+    goto done;
+  }
+  alpha_size = nInUse + 2;
+
+  nGroups = get_bits(&bits, 3);
+  if (nGroups == -1)
+    goto done;
+  if (nGroups < 2 || nGroups > BZ_N_GROUPS) {
+    result = 0;
+    goto done;
+  }
+  nSelectors = get_bits(&bits, 15);
+  if (nSelectors == -1)
+    goto done;
+  /* more than BZ_MAX_SELECTORS is allowed, as by bzip2 1.0.8 and the
+     block decoder: some compressors (lbzip2) round the count up, and
+     the ones past the max are read and thrown away */
+  if (nSelectors < 1) {
+    result = 0;
+    goto done;
+  }
+  /* selectors are mtf values in unary, checked as the decoder does */
+  for (i = 0; i < nSelectors; i++) {
+    j = 0;
+    while (1) {
+      value = get_bits(&bits, 1);
+      if (value == -1)
+	goto done;
+      if (!value)
+	break;
+      j++;
+      if (j >= nGroups) {
+	result = 0;
+	goto done;
+      }
+    }
+  }
+  /* code lengths, delta coded */
+  for (t = 0; t < nGroups; t++) {
+    code_len = get_bits(&bits, 5);
+    if (code_len == -1)
+      goto done;
+    for (i = 0; i < alpha_size; i++) {
+      while (1) {
+	if (code_len < 1 || code_len > 20) {
+	  result = 0;
+	  goto done;
+	}
+	value = get_bits(&bits, 1);
+	if (value == -1)
+	  goto done;
+	if (!value)
+	  break;
+	value = get_bits(&bits, 1);
+	if (value == -1)
+	  goto done;
+	if (value)
+	  code_len--;
+	else
+	  code_len++;
+      }
+    }
+  }
+  result = 1;
+
+ done:
+  return(result);
+}
+
+/*
+  check the block header that follows a block marker found by
+  find_next_bz2_block_marker() to see whether the marker starts a genuine
+  block or is just a chance occurrence of the marker bytes in some
+  compressed data.  header is the 4 byte bz2 file header, for the block size.
+
+  the header fields are checked the same way the decompressor would check
+  them: origPtr must be in range for the block size, some symbols must be
+  in use, there must be 2 to 6 huffman tables, the selectors must refer to
+  existing tables and the code lengths must be between 1 and 20.  nothing is
+  decompressed and only a few kilobytes are read, so this is cheap enough to
+  do for every candidate marker.
+
+  this does not use the file position, nor any shared state, so several
+  threads may call it on the same file at once.
+
+  returns:
+    1 if the block header is valid, 2 if the file ends before the block
+    header does (so the block can't be ruled out), 0 if not, -1 on error
+*/
+int check_bz2_block_header(int fin, off_t block_start, int bits_shifted, unsigned char *header) {
+  unsigned char *buf;
+  ssize_t bytes_read;
+  int result;
+
+  buf = (unsigned char *)malloc(BLOCK_HEADER_MAX_BYTES);
+  if (buf == NULL) {
+    fprintf(stderr,"failed to allocate buffer for block header\n");
+    return(-1);
+  }
+  /* byte-aligned blocks start the byte after block_start */
+  bytes_read = pread_all(fin, buf, BLOCK_HEADER_MAX_BYTES, bits_shifted ? block_start : block_start + (off_t)1);
+  if (bytes_read == -1) {
+    fprintf(stderr,"read of file failed\n");
+    free(buf);
+    return(-1);
+  }
+  result = check_block_header_bytes(buf, (size_t)bytes_read, bits_shifted, header);
+  free(buf);
+  return(result);
+}
+
+/*
+  check the block header after the block marker found by
+  find_next_bz2_block_marker() (bfile->block_start, bfile->bits_shifted)
+  to see whether it starts a genuine block, see check_bz2_block_header()
+
+  returns:
+    1 if the block header is valid, 2 if the file ends before it does,
+    0 if not, -1 on error
+*/
+int check_bz2_block(int fin, bz_info_t *bfile) {
+  read_window_t *w;
+  unsigned char *buf;
+  size_t got;
+
+  if (read_bz2_header(fin, bfile) == -1)
+    return(-1);
+  w = get_read_window(fin, bfile);
+  if (w == NULL)
+    return(-1);
+  /* byte-aligned blocks start the byte after block_start */
+  buf = read_window_get(w, bfile->bits_shifted ? bfile->block_start : bfile->block_start + (off_t)1,
+			BLOCK_HEADER_MAX_BYTES, &got);
+  if (buf == NULL)
+    return(-1);
+  return(check_block_header_bytes(buf, got, bfile->bits_shifted, bfile->header_buffer));
+}
+
 /*
   look for the first bz2 block in the file before/after specified offset
-  it tests that the block is valid by doing partial decompression.
+  it tests that the block is valid by checking its block header,
+  unless there is a block map for the file, in which case the answer
+  comes from the map.
   this function will update the bfile structure:
-  bfile->position will contain the current position of the file and the fle
-    cursor will be set via lseek to the start of the found block, if do_seek is nonzero
+  bfile->position will be set to the start of the found block
+    (the file position itself is never used or moved)
   bfile->bits_shifted will contain the number of bits that the block is rightshifted
   bfile->block_start will contain the offset from start of file to the block
   (this value will always be positive, the value given in the argument "direction"
@@ -699,10 +1807,9 @@ void clear_buffer(unsigned char *buf, int length) {
     -1 on error
 */
 off_t find_first_bz2_block_from_offset(bz_info_t *bfile, int fin, off_t position,
-				       int direction, off_t filesize, int do_seek) {
-  off_t seekresult;
+				       int direction, off_t filesize) {
   int res;
-  unsigned char buffout[5000];
+  bmap_entry_t *entry;
 
   bfile->bufin_size = BUFINSIZE;
   if (bfile->marker == NULL)
@@ -713,57 +1820,35 @@ off_t find_first_bz2_block_from_offset(bz_info_t *bfile, int fin, off_t position
   bfile->bytes_written = 0;
   bfile->eof = 0;
   bfile->bits_shifted = -1;
-  bfile->bufout = buffout;
-  bfile->bufout_size = 5000;
 
   if (filesize)
     bfile->file_size = filesize;
   else
     bfile->file_size = get_file_size(fin);
 
+  res = find_block_in_block_map(fin, position, direction, BMAP_GENUINE, &entry);
+  if (res == 0) {
+    return(0);
+  }
+  else if (res == 1) {
+    bfile->bits_shifted = entry->bits_shifted;
+    bfile->block_start = entry->offset;
+    bfile->position = entry->offset;
+  }
+
   while (bfile->bits_shifted < 0) {
     if (bfile->position > bfile->file_size) {
       return(0);
     }
-    seekresult = lseek(fin, bfile->position, SEEK_SET);
-    if (seekresult == (off_t)-1) {
-      fprintf(stderr,"lseek of file to %"PRId64" failed (7)\n",bfile->position);
-      return(-1);
-    }
     res = find_next_bz2_block_marker(fin, bfile, direction);
     if (res == 1) {
-      init_decompress(bfile);
-      decompress_header(fin, bfile);
-      res = setup_first_buffer_to_decompress(fin, bfile);
+      res = check_bz2_block(fin, bfile);
       if (res == -1) {
-	fprintf(stderr,"couldn't get first buffer of data to uncompress\n");
 	return(-1);
       }
-      bfile->strm.next_out = (char *)bfile->bufout;
-      bfile->strm.avail_out = bfile->bufout_size;
-      res = BZ2_bzDecompress_mine ( &(bfile->strm) );
-      /* this means we (probably) have a genuine marker */
-      if (BZ_OK == res || BZ_STREAM_END == res) {
-	res = BZ2_bzDecompressEnd ( &(bfile->strm) );
-	bfile->bytes_read = 0;
-	bfile->bytes_written = 0;
-	bfile->eof = 0;
-	if (do_seek) {
-	  /* leave the file at the right position */
-	  seekresult = lseek(fin, bfile->block_start, SEEK_SET);
-	  if (seekresult == (off_t)-1) {
-	    fprintf(stderr,"lseek of file to %"PRId64" failed (8)\n",bfile->position);
-	    return(-1);
-	  }
-	  bfile->position = seekresult;
-	  return(bfile->position);
-	}
-	else
-	  return(bfile->block_start);
-      }
       /* right bytes, but there by chance, or we are in a multistream
 	 file, skip and try again */
-      else {
+      else if (!res) {
 	if (direction == FORWARD)
 	  bfile->position+=(off_t)6;
 	else {
@@ -777,6 +1862,1682 @@ off_t find_first_bz2_block_from_offset(bz_info_t *bfile, int fin, off_t position
       return(0);
     }
   }
-  return(-1);
+  bfile->bytes_read = 0;
+  bfile->bytes_written = 0;
+  bfile->eof = 0;
+  /* searches go on to decode at least the start of the block */
+  io_will_need(fin, bfile->block_start, (off_t)PROBE_WILLNEED);
+  return(bfile->block_start);
 }
 
+/*
+  get the block crc which follows the block marker, given
+  the block start and bit shift as found by find_next_bz2_block_marker()
+
+  returns:
+    0 on success, with the crc in *crc
+    -1 on error
+*/
+int read_block_crc(int fin, off_t block_start, int bits_shifted, uint32_t *crc) {
+  unsigned char buffer[5];
+  uint64_t value;
+
+  /* block marker is 6 bytes long, if it's bit-shifted then some bits of the crc
+     will be in the 6th byte, otherwise only (byte-aligned) in the 7th.
+     we need the next 4 bytes for the crc, 5 if we have bit-shifting */
+  if (pread_all(fin, buffer, bits_shifted ? 5 : 4,
+		block_start + (off_t)(bits_shifted ? 6 : 7)) < (bits_shifted ? 5 : 4)) {
+    fprintf(stderr,"read of file failed\n");
+    return(-1);
+  }
+  value = ((uint64_t) buffer[0] << 24) | ((uint64_t) buffer[1] << 16) |
+    ((uint64_t) buffer[2] << 8) | (uint64_t) buffer[3];
+  if (bits_shifted) {
+    value = (value << bits_shifted) | ((uint64_t) buffer[4] >> (8 - bits_shifted));
+  }
+  *crc = (uint32_t) (value & 0xffffffff);
+  return(0);
+}
+
+/*
+  block maps
+
+  a block map is a sidecar file (name of the bz2 file plus ".bmap")
+  listing every bz2 block marker found in the file, in order, whether
+  it turned out to start a genuine block or was a chance occurrence
+  of the marker bytes, and for genuine blocks, the block crc.  it also
+  lists the streams in the file, each with the offset of its "BZh"
+  header and of its end of stream marker, and the stream crc, so that
+  the streams of a multistream file can be read independently.  dump
+  files never change once they are written, so the map can be made
+  once (see makebz2blockmap) and used by every later search instead
+  of scanning and test-decompressing.
+
+  file layout, all integers little-endian:
+    header:  "MWBZBMAP" version(4) entry size(4) file size(8) mtime(8) entry count(8)
+             stream entry size(4) unused(4) stream count(8)
+    entries: offset(8) crc(4) bits shifted(1) flags(1) unused(2) uncompressed offset(8)
+             first page id(8) last page id(8) first rev id(8) last rev id(8)
+    streams: start(8) end(8) crc(4) end bits shifted(1) unused(3)
+
+  the uncompressed offset and the ids are -1 for blocks where they are
+  not known (always, unless the map was made with the whole file
+  decompressed once to find them).  entries and streams may be longer
+  than listed here, in which case the rest is skipped, so that fields
+  can be added at the end of them later.
+
+  the map is only used if the size and mtime of the bz2 file match
+  those stored in the map.
+*/
+
+#define BMAP_MAGIC "MWBZBMAP"
+#define BMAP_VERSION 1
+#define BMAP_HEADER_SIZE 56
+#define BMAP_ENTRY_SIZE 56
+#define BMAP_STREAM_SIZE 24
+
+/* the map in use for searches, set up by load_block_map() */
+static bmap_t *block_map_in_use = NULL;
+
+static void put_le(unsigned char *buf, uint64_t value, int numbytes) {
+  int i;
+
+  for (i = 0; i < numbytes; i++) {
+    buf[i] = (unsigned char) (value & 0xff);
+    value >>= 8;
+  }
+}
+
+static uint64_t get_le(unsigned char *buf, int numbytes) {
+  uint64_t value = 0;
+  int i;
+
+  for (i = numbytes - 1; i >= 0; i--) {
+    value = (value << 8) | buf[i];
+  }
+  return(value);
+}
+
+bmap_t *init_block_map() {
+  bmap_t *map;
+
+  map = (bmap_t *)malloc(sizeof(bmap_t));
+  if (map == NULL) {
+    fprintf(stderr,"failed to allocate block map\n");
+    return(NULL);
+  }
+  map->file_size = (off_t)0;
+  map->mtime = 0;
+  map->count = 0;
+  map->allocated = 0;
+  map->entries = NULL;
+  map->stream_count = 0;
+  map->streams_allocated = 0;
+  map->streams = NULL;
+  map->fd = -1;
+  return(map);
+}
+
+void free_block_map(bmap_t *map) {
+  if (map) {
+    if (block_map_in_use == map)
+      block_map_in_use = NULL;
+    if (map->entries)
+      free(map->entries);
+    if (map->streams)
+      free(map->streams);
+    free(map);
+  }
+  return;
+}
+
+/*
+  append an entry to the map; entries must be added in
+  order of offset
+
+  returns:
+    0 on success, -1 on error
+*/
+int add_block_map_entry(bmap_t *map, off_t offset, int bits_shifted, int flags, uint32_t crc) {
+  bmap_entry_t *entry;
+
+  if (map->count == map->allocated) {
+    map->allocated = map->allocated ? map->allocated * 2 : 1024;
+    map->entries = realloc(map->entries, map->allocated * sizeof(bmap_entry_t));
+    if (map->entries == NULL) {
+      fprintf(stderr,"failed to allocate block map entries\n");
+      return(-1);
+    }
+  }
+  entry = &(map->entries[map->count++]);
+  entry->offset = offset;
+  entry->bits_shifted = bits_shifted;
+  entry->flags = flags;
+  entry->crc = crc;
+  entry->uncompressed_offset = -1;
+  entry->first_page_id = entry->last_page_id = -1;
+  entry->first_rev_id = entry->last_rev_id = -1;
+  return(0);
+}
+
+/*
+  append a stream to the map; streams must be added in order
+
+  returns:
+    0 on success, -1 on error
+*/
+int add_block_map_stream(bmap_t *map, off_t start, off_t end, int end_bits_shifted, uint32_t crc) {
+  bmap_stream_t *stream;
+
+  if (map->stream_count == map->streams_allocated) {
+    map->streams_allocated = map->streams_allocated ? map->streams_allocated * 2 : 64;
+    map->streams = realloc(map->streams, map->streams_allocated * sizeof(bmap_stream_t));
+    if (map->streams == NULL) {
+      fprintf(stderr,"failed to allocate block map streams\n");
+      return(-1);
+    }
+  }
+  stream = &(map->streams[map->stream_count++]);
+  stream->start = start;
+  stream->end = end;
+  stream->end_bits_shifted = end_bits_shifted;
+  stream->crc = crc;
+  return(0);
+}
+
+/*
+  record the size and mtime of the open bz2 file in the map
+
+  returns:
+    0 on success, -1 on error
+*/
+int set_block_map_file_info(bmap_t *map, int fin) {
+  struct stat statbuf;
+
+  if (fstat(fin, &statbuf) == -1) {
+    fprintf(stderr,"failed to stat bz2 file\n");
+    return(-1);
+  }
+  map->file_size = statbuf.st_size;
+  map->mtime = (int64_t) statbuf.st_mtime;
+  return(0);
+}
+
+/*
+  returns a newly allocated string with the name of the map
+  file for the given bz2 file
+*/
+char *get_block_map_filename(char *filename) {
+  char *mapname;
+
+  mapname = malloc(strlen(filename) + strlen(".bmap") + 1);
+  if (mapname == NULL) {
+    fprintf(stderr,"failed to allocate block map filename\n");
+    return(NULL);
+  }
+  strcpy(mapname, filename);
+  strcat(mapname, ".bmap");
+  return(mapname);
+}
+
+/*
+  returns:
+    0 on success, -1 on error
+*/
+int write_block_map(bmap_t *map, char *mapname) {
+  FILE *fout;
+  unsigned char header[BMAP_HEADER_SIZE];
+  unsigned char entry[BMAP_ENTRY_SIZE];
+  unsigned char stream[BMAP_STREAM_SIZE];
+  int64_t i;
+
+  fout = fopen(mapname, "wb");
+  if (fout == NULL) {
+    fprintf(stderr,"failed to open block map %s for write\n", mapname);
+    return(-1);
+  }
+  memcpy(header, BMAP_MAGIC, 8);
+  put_le(header + 8, BMAP_VERSION, 4);
+  put_le(header + 12, BMAP_ENTRY_SIZE, 4);
+  put_le(header + 16, (uint64_t) map->file_size, 8);
+  put_le(header + 24, (uint64_t) map->mtime, 8);
+  put_le(header + 32, (uint64_t) map->count, 8);
+  put_le(header + 40, BMAP_STREAM_SIZE, 4);
+  put_le(header + 44, 0, 4);
+  put_le(header + 48, (uint64_t) map->stream_count, 8);
+  if (fwrite(header, BMAP_HEADER_SIZE, 1, fout) != 1) {
+    fprintf(stderr,"failed to write block map %s\n", mapname);
+    fclose(fout);
+    return(-1);
+  }
+  for (i = 0; i < map->count; i++) {
+    put_le(entry, (uint64_t) map->entries[i].offset, 8);
+    put_le(entry + 8, map->entries[i].crc, 4);
+    entry[12] = (unsigned char) map->entries[i].bits_shifted;
+    entry[13] = (unsigned char) map->entries[i].flags;
+    entry[14] = entry[15] = 0;
+    put_le(entry + 16, (uint64_t) map->entries[i].uncompressed_offset, 8);
+    put_le(entry + 24, (uint64_t) map->entries[i].first_page_id, 8);
+    put_le(entry + 32, (uint64_t) map->entries[i].last_page_id, 8);
+    put_le(entry + 40, (uint64_t) map->entries[i].first_rev_id, 8);
+    put_le(entry + 48, (uint64_t) map->entries[i].last_rev_id, 8);
+    if (fwrite(entry, BMAP_ENTRY_SIZE, 1, fout) != 1) {
+      fprintf(stderr,"failed to write block map %s\n", mapname);
+      fclose(fout);
+      return(-1);
+    }
+  }
+  for (i = 0; i < map->stream_count; i++) {
+    put_le(stream, (uint64_t) map->streams[i].start, 8);
+    put_le(stream + 8, (uint64_t) map->streams[i].end, 8);
+    put_le(stream + 16, map->streams[i].crc, 4);
+    stream[20] = (unsigned char) map->streams[i].end_bits_shifted;
+    stream[21] = stream[22] = stream[23] = 0;
+    if (fwrite(stream, BMAP_STREAM_SIZE, 1, fout) != 1) {
+      fprintf(stderr,"failed to write block map %s\n", mapname);
+      fclose(fout);
+      return(-1);
+    }
+  }
+  if (fclose(fout)) {
+    fprintf(stderr,"failed to write block map %s\n", mapname);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+  returns:
+    the map read from the file, or NULL if there is
+    no such file or it is not a valid map
+*/
+bmap_t *read_block_map(char *mapname) {
+  FILE *fin;
+  unsigned char header[BMAP_HEADER_SIZE];
+  unsigned char entry[BMAP_ENTRY_SIZE];
+  unsigned char stream[BMAP_STREAM_SIZE];
+  int entry_size, stream_size;
+  int64_t count, stream_count, i;
+  bmap_t *map;
+
+  fin = fopen(mapname, "rb");
+  if (fin == NULL) {
+    return(NULL);
+  }
+  if (fread(header, BMAP_HEADER_SIZE, 1, fin) != 1 || memcmp(header, BMAP_MAGIC, 8) ||
+      get_le(header + 8, 4) != BMAP_VERSION) {
+    fprintf(stderr,"bad block map file %s, ignoring\n", mapname);
+    fclose(fin);
+    return(NULL);
+  }
+  entry_size = (int) get_le(header + 12, 4);
+  stream_size = (int) get_le(header + 40, 4);
+  stream_count = (int64_t) get_le(header + 48, 8);
+  if (entry_size < BMAP_ENTRY_SIZE || stream_size < BMAP_STREAM_SIZE) {
+    fprintf(stderr,"bad block map file %s, ignoring\n", mapname);
+    fclose(fin);
+    return(NULL);
+  }
+  map = init_block_map();
+  if (map == NULL) {
+    fclose(fin);
+    return(NULL);
+  }
+  map->file_size = (off_t) get_le(header + 16, 8);
+  map->mtime = (int64_t) get_le(header + 24, 8);
+  count = (int64_t) get_le(header + 32, 8);
+  for (i = 0; i < count; i++) {
+    if (fread(entry, BMAP_ENTRY_SIZE, 1, fin) != 1 ||
+	(entry_size > BMAP_ENTRY_SIZE && fseeko(fin, entry_size - BMAP_ENTRY_SIZE, SEEK_CUR))) {
+      fprintf(stderr,"short block map file %s, ignoring\n", mapname);
+      free_block_map(map);
+      fclose(fin);
+      return(NULL);
+    }
+    if (add_block_map_entry(map, (off_t) get_le(entry, 8), entry[12], entry[13],
+			    (uint32_t) get_le(entry + 8, 4)) == -1) {
+      free_block_map(map);
+      fclose(fin);
+      return(NULL);
+    }
+    map->entries[i].uncompressed_offset = (int64_t) get_le(entry + 16, 8);
+    map->entries[i].first_page_id = (int64_t) get_le(entry + 24, 8);
+    map->entries[i].last_page_id = (int64_t) get_le(entry + 32, 8);
+    map->entries[i].first_rev_id = (int64_t) get_le(entry + 40, 8);
+    map->entries[i].last_rev_id = (int64_t) get_le(entry + 48, 8);
+  }
+  for (i = 0; i < stream_count; i++) {
+    if (fread(stream, BMAP_STREAM_SIZE, 1, fin) != 1 ||
+	(stream_size > BMAP_STREAM_SIZE && fseeko(fin, stream_size - BMAP_STREAM_SIZE, SEEK_CUR))) {
+      fprintf(stderr,"short block map file %s, ignoring\n", mapname);
+      free_block_map(map);
+      fclose(fin);
+      return(NULL);
+    }
+    if (add_block_map_stream(map, (off_t) get_le(stream, 8), (off_t) get_le(stream + 8, 8),
+			     stream[20], (uint32_t) get_le(stream + 16, 4)) == -1) {
+      free_block_map(map);
+      fclose(fin);
+      return(NULL);
+    }
+  }
+  fclose(fin);
+  return(map);
+}
+
+/*
+  read the block map for the bz2 file, if there is one, and if it is
+  up to date with the file, use it for all block searches on fin
+  from now on
+
+  returns:
+    the map, or NULL if there is no usable map
+*/
+bmap_t *load_block_map(char *filename, int fin) {
+  char *mapname;
+  bmap_t *map;
+  struct stat statbuf;
+
+  mapname = get_block_map_filename(filename);
+  if (mapname == NULL) {
+    return(NULL);
+  }
+  map = read_block_map(mapname);
+  free(mapname);
+  if (map == NULL) {
+    return(NULL);
+  }
+  if (fstat(fin, &statbuf) == -1 || statbuf.st_size != map->file_size ||
+      (int64_t) statbuf.st_mtime != map->mtime) {
+    fprintf(stderr,"block map for %s is out of date, ignoring\n", filename);
+    free_block_map(map);
+    return(NULL);
+  }
+  map->fd = fin;
+  block_map_in_use = map;
+  return(map);
+}
+
+/*
+  find the first block marker in the block map of fin at or after
+  position (direction FORWARD) or at or before it (direction BACKWARD),
+  optionally skipping markers which are not genuine blocks
+
+  returns:
+    1 if found, with the entry in *entry
+    0 if the map has no such entry
+    -1 if there is no map in use for fin
+*/
+int find_block_in_block_map(int fin, off_t position, int direction, int genuine_only, bmap_entry_t **entry) {
+  bmap_t *map = block_map_in_use;
+  int64_t low, high, mid;
+
+  if (map == NULL || map->fd != fin) {
+    return(-1);
+  }
+  /* first entry with offset >= position */
+  low = 0;
+  high = map->count;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (map->entries[mid].offset < position)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (direction == FORWARD) {
+    while (low < map->count && genuine_only && !(map->entries[low].flags & BMAP_GENUINE))
+      low++;
+    if (low >= map->count)
+      return(0);
+    *entry = &(map->entries[low]);
+    return(1);
+  }
+  else {
+    if (low >= map->count || map->entries[low].offset > position)
+      low--;
+    while (low >= 0 && genuine_only && !(map->entries[low].flags & BMAP_GENUINE))
+      low--;
+    if (low < 0)
+      return(0);
+    *entry = &(map->entries[low]);
+    return(1);
+  }
+}
+
+/*
+  find the stream in the block map of fin that contains position,
+  that is, the last stream starting at or before position (a
+  stream with no header, at the front of a file, starts at -1)
+
+  returns:
+    1 if found, with the stream in *stream
+    0 if the map has no such stream
+    -1 if there is no map in use for fin
+*/
+int find_stream_in_block_map(int fin, off_t position, bmap_stream_t **stream) {
+  bmap_t *map = block_map_in_use;
+  int64_t low, high, mid;
+
+  if (map == NULL || map->fd != fin) {
+    return(-1);
+  }
+  if (!map->stream_count)
+    return(0);
+  /* first stream which starts after position; a stream with no
+     header can only be the first one in the file */
+  low = 0;
+  high = map->stream_count;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (map->streams[mid].start <= position)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low == 0)
+    return(0);
+  *stream = &(map->streams[low - 1]);
+  return(1);
+}
+
+/* compressed data read and uncompressed data scanned per call
+   while decompressing a whole file to find out about its blocks */
+#define UNCOMPRESSED_SCAN_BUF 1048576
+
+/* states of the id scanner */
+#define ID_SCAN_TEXT 0
+#define ID_SCAN_TAG 1
+#define ID_SCAN_VALUE 2
+
+void init_id_scan(id_scan_t *scan) {
+  scan->state = ID_SCAN_TEXT;
+  scan->tag_len = 0;
+  scan->pending = 0;
+  scan->pending_offset = 0;
+  scan->tag_offset = 0;
+  scan->value = 0;
+  scan->offset = 0;
+}
+
+/*
+  note the tag whose name is in name[0..len), which started at
+  scan->tag_offset
+*/
+static void id_scan_tag(id_scan_t *scan, unsigned char *name, int len) {
+  if (len == 4 && !memcmp(name, "page", 4)) {
+    scan->pending = ID_SCAN_PAGE;
+    scan->pending_offset = scan->tag_offset;
+  }
+  else if (len == 8 && !memcmp(name, "revision", 8)) {
+    scan->pending = ID_SCAN_REV;
+    scan->pending_offset = scan->tag_offset;
+  }
+  else if (len == 2 && name[0] == 'i' && name[1] == 'd' && scan->pending) {
+    scan->state = ID_SCAN_VALUE;
+    scan->value = 0;
+  }
+}
+
+/*
+  look for <page> and <revision> tags in xml, and the id in the <id>
+  tag that follows each one.  the xml may be handed over a buffer at
+  a time; a tag or id split between one buffer and the next is still
+  found.  '<' is looked for with memchr(), and tags wholly in the
+  buffer are checked in place; only a tag at the very end of the
+  buffer is gathered a byte at a time.  the scan stops at the first id.
+
+  returns:
+    number of bytes of buf scanned; if this ends with an id, *type is
+    set to ID_SCAN_PAGE or ID_SCAN_REV, *id to the id and *tag_offset
+    to the offset of the <page> or <revision> tag, counted in bytes
+    scanned since init_id_scan(); otherwise *type is set to 0
+*/
+size_t scan_for_ids(id_scan_t *scan, unsigned char *buf, size_t len,
+		    int *type, int64_t *id, int64_t *tag_offset) {
+  unsigned char *p = buf, *end = buf + len;
+
+  *type = 0;
+  while (p < end) {
+    if (scan->state == ID_SCAN_TEXT) {
+      p = memchr(p, '<', end - p);
+      if (p == NULL) {
+	p = end;
+	break;
+      }
+      scan->tag_offset = scan->offset + (p - buf);
+      p++;
+      /* the longest name of interest, and the '>' after it, are all here */
+      if (end - p > 8) {
+	if (p[0] == 'i' && p[1] == 'd' && p[2] == '>') {
+	  id_scan_tag(scan, p, 2);
+	  p += 3;
+	}
+	else if (p[0] == 'p' && p[4] == '>') {
+	  id_scan_tag(scan, p, 4);
+	  p += 5;
+	}
+	else if (p[0] == 'r' && p[8] == '>') {
+	  id_scan_tag(scan, p, 8);
+	  p += 9;
+	}
+	/* any other tag is passed over along with the text after it */
+      }
+      else {
+	scan->state = ID_SCAN_TAG;
+	scan->tag_len = 0;
+      }
+    }
+    else if (scan->state == ID_SCAN_TAG) {
+      if (*p == '>') {
+	scan->state = ID_SCAN_TEXT;
+	id_scan_tag(scan, (unsigned char *)scan->tag, scan->tag_len);
+      }
+      else if (scan->tag_len < (int)sizeof(scan->tag))
+	scan->tag[scan->tag_len++] = *p;
+      else
+	scan->state = ID_SCAN_TEXT;
+      p++;
+    }
+    else {
+      while (p < end && *p >= '0' && *p <= '9') {
+	scan->value = scan->value * 10 + (*p - '0');
+	p++;
+      }
+      if (p == end)
+	break;
+      scan->state = ID_SCAN_TEXT;
+      if (*p == '<' && scan->value) {
+	*type = scan->pending;
+	*id = scan->value;
+	*tag_offset = scan->pending_offset;
+	scan->pending = 0;
+	break;
+      }
+      scan->pending = 0;
+    }
+  }
+  scan->offset += p - buf;
+  return(p - buf);
+}
+
+static void note_id(int64_t *first, int64_t *last, int64_t id) {
+  if (*first <= 0)
+    *first = id;
+  *last = id;
+}
+
+/*
+  scan a buffer of output for ids and note them for the block their
+  <page> or <revision> tag started in: the one being decompressed,
+  in ids, whose output starts at block_start, or the one before,
+  last_entry, whose output starts at last_start
+*/
+static void record_ids(id_scan_t *scan, unsigned char *buf, size_t len, bmap_entry_t *ids,
+		       int64_t block_start, bmap_entry_t *last_entry, int64_t last_start) {
+  bmap_entry_t *entry;
+  int64_t id, tag_offset;
+  size_t used;
+  int type;
+
+  while (len) {
+    used = scan_for_ids(scan, buf, len, &type, &id, &tag_offset);
+    buf += used;
+    len -= used;
+    if (!type)
+      continue;
+    if (tag_offset >= block_start)
+      entry = ids;
+    else if (tag_offset >= last_start && last_entry)
+      entry = last_entry;
+    else
+      continue;
+    if (type == ID_SCAN_PAGE)
+      note_id(&(entry->first_page_id), &(entry->last_page_id), id);
+    else
+      note_id(&(entry->first_rev_id), &(entry->last_rev_id), id);
+  }
+}
+
+/*
+  find out about each genuine block in the map by decompressing
+  the whole file once: the offset in the uncompressed data at
+  which its output starts (BMAP_UNCOMPRESSED_OFFSETS) and the
+  first and last page and rev ids in it (BMAP_IDS), as selected
+  by contents.
+
+  uncompressed offsets run on from one stream to the next in
+  multistream files, as they do in the output of bzcat.  a page
+  or revision belongs to the block its <page> or <revision> tag
+  starts in.  blocks are matched to map entries by their crcs,
+  so that a false marker which passed the block header checks is
+  skipped.  a truncated last block is left with -1 for everything.
+
+  returns:
+    0 on success, -1 on error
+*/
+int add_block_contents_to_block_map(int fin, bmap_t *map, int contents) {
+  bz_stream strm;
+  unsigned char *bufin = NULL, *bufout = NULL;
+  off_t position = (off_t)0, dropped = (off_t)0;
+  int64_t total = 0, block_start = 0, last_start = 0, next = 0;
+  ssize_t bytes_read;
+  uint32_t crc;
+  int eof = 0, streams = 0, res, result = -1;
+  bmap_entry_t *entry, *last_entry = NULL, ids;
+  id_scan_t scan;
+
+  init_id_scan(&scan);
+  memset(&ids, 0, sizeof(ids));
+  strm.bzalloc = pooled_bzalloc;
+  strm.bzfree = pooled_bzfree;
+  strm.opaque = NULL;
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+    fprintf(stderr,"failed to initialize decompression\n");
+    return(-1);
+  }
+  strm.avail_in = 0;
+  bufin = malloc(UNCOMPRESSED_SCAN_BUF);
+  bufout = malloc(UNCOMPRESSED_SCAN_BUF);
+  if (bufin == NULL || bufout == NULL) {
+    fprintf(stderr,"failed to allocate decompression buffers\n");
+    goto done;
+  }
+  while (1) {
+    if (strm.avail_in == 0 && !eof) {
+      io_drop_behind(fin, &dropped, position);
+      bytes_read = pread_all(fin, bufin, UNCOMPRESSED_SCAN_BUF, position);
+      if (bytes_read < 0) {
+	fprintf(stderr,"failed to read file at %"PRId64"\n", position);
+	goto done;
+      }
+      if (bytes_read == 0)
+	eof++;
+      position += bytes_read;
+      strm.next_in = (char *)bufin;
+      strm.avail_in = (unsigned int) bytes_read;
+    }
+    strm.next_out = (char *)bufout;
+    strm.avail_out = UNCOMPRESSED_SCAN_BUF;
+    res = BZ2_bzDecompress_block(&strm);
+    total += (unsigned char *)strm.next_out - bufout;
+    if (contents & BMAP_IDS)
+      record_ids(&scan, bufout, (unsigned char *)strm.next_out - bufout,
+		 &ids, block_start, last_entry, last_start);
+    if (res == BZ_BLOCK_END) {
+      crc = ((DState *)strm.state)->storedBlockCRC;
+      while (next < map->count &&
+	     (!(map->entries[next].flags & BMAP_GENUINE) || map->entries[next].crc != crc))
+	next++;
+      if (next == map->count) {
+	fprintf(stderr,"block ending at uncompressed offset %"PRId64" is not in the block map\n", total);
+	goto done;
+      }
+      entry = &(map->entries[next++]);
+      if (contents & BMAP_UNCOMPRESSED_OFFSETS)
+	entry->uncompressed_offset = block_start;
+      if (contents & BMAP_IDS) {
+	entry->first_page_id = ids.first_page_id;
+	entry->last_page_id = ids.last_page_id;
+	entry->first_rev_id = ids.first_rev_id;
+	entry->last_rev_id = ids.last_rev_id;
+	memset(&ids, 0, sizeof(ids));
+	last_entry = entry;
+      }
+      last_start = block_start;
+      block_start = total;
+    }
+    else if (res == BZ_STREAM_END) {
+      /* on to the next stream, if any, with whatever input is left over */
+      streams++;
+      BZ2_bzDecompressEnd(&strm);
+      if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+	fprintf(stderr,"failed to initialize decompression\n");
+	goto done;
+      }
+      if (eof && strm.avail_in == 0)
+	break;
+    }
+    else if (res == BZ_DATA_ERROR_MAGIC) {
+      /* no stream header; after the first stream this is just trailing garbage */
+      if (!streams)
+	fprintf(stderr,"no bz2 header at the start of the file, stopping\n");
+      break;
+    }
+    else if (res != BZ_OK) {
+      fprintf(stderr,"error from BZ decompress %d at uncompressed offset %"PRId64", stopping\n",
+	      res, total);
+      break;
+    }
+    else if (eof && strm.avail_in == 0 && strm.avail_out) {
+      if (((DState *)strm.state)->state != BZ_X_MAGIC_1)
+	fprintf(stderr,"file ends in the middle of a block, stopping\n");
+      break;
+    }
+  }
+  result = 0;
+
+ done:
+  BZ2_bzDecompressEnd(&strm);
+  if (bufin)
+    free(bufin);
+  if (bufout)
+    free(bufout);
+  return(result);
+}
+
+/* keys by which block map entries can be looked up */
+#define BMAP_KEY_UNCOMPRESSED_OFFSET 1
+#define BMAP_KEY_PAGE_ID 2
+
+/* returns the key of the entry, or -1 if it has none */
+static int64_t get_block_map_key(bmap_entry_t *entry, int key) {
+  if (key == BMAP_KEY_UNCOMPRESSED_OFFSET)
+    return(entry->uncompressed_offset);
+  else
+    return(entry->first_page_id > 0 ? entry->first_page_id : -1);
+}
+
+/*
+  find the last entry in the map with a key at or below value;
+  entries without the key are skipped over, the rest must be in
+  increasing order
+
+  returns:
+    the index of the entry, or -1 if there is none
+*/
+static int64_t find_last_block_map_key_at_or_below(bmap_t *map, int key, int64_t value) {
+  int64_t low, high, mid, i;
+
+  low = 0;
+  high = map->count;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    for (i = mid; i < high && get_block_map_key(&(map->entries[i]), key) < 0; i++);
+    if (i == high)
+      high = mid;
+    else if (get_block_map_key(&(map->entries[i]), key) <= value)
+      low = i + 1;
+    else
+      high = mid;
+  }
+  for (i = low - 1; i >= 0 && get_block_map_key(&(map->entries[i]), key) < 0; i--);
+  return(i);
+}
+
+/*
+  find the genuine block in the block map of fin whose output
+  contains the given offset in the uncompressed data of the file,
+  that is, the last one starting at or before it
+
+  returns:
+    1 if found, with the entry in *entry
+    0 if the map has no such entry (including when the map has
+      no uncompressed offsets)
+    -1 if there is no map in use for fin
+*/
+int find_block_for_uncompressed_offset(int fin, int64_t uoffset, bmap_entry_t **entry) {
+  bmap_t *map = block_map_in_use;
+  int64_t i;
+
+  if (map == NULL || map->fd != fin) {
+    return(-1);
+  }
+  i = find_last_block_map_key_at_or_below(map, BMAP_KEY_UNCOMPRESSED_OFFSET, uoffset);
+  if (i < 0)
+    return(0);
+  *entry = &(map->entries[i]);
+  return(1);
+}
+
+/*
+  find the block in the block map of fin from which to start
+  decompressing in order to get the given page: the last block
+  in which a page with that id or a smaller one starts.  page
+  ids must increase through the file.
+
+  returns:
+    1 if found, with the entry in *entry
+    0 if the first page in the file comes after the given one
+    -1 if there is no map in use for fin, or it has no page ids
+*/
+int find_block_for_page_id(int fin, int64_t page_id, bmap_entry_t **entry) {
+  bmap_t *map = block_map_in_use;
+  int64_t i;
+
+  if (map == NULL || map->fd != fin) {
+    return(-1);
+  }
+  for (i = 0; i < map->count && map->entries[i].first_page_id < 0; i++);
+  if (i == map->count)
+    return(-1);
+  i = find_last_block_map_key_at_or_below(map, BMAP_KEY_PAGE_ID, page_id);
+  if (i < 0)
+    return(0);
+  *entry = &(map->entries[i]);
+  return(1);
+}
+
+/*
+  get the last page id (or rev id, if rev is set) in the file
+  from the block map of fin
+
+  returns:
+    1 if found, with the id in *id
+    0 if the map can't tell, because it has no ids for some genuine
+      block after the last one with an id of that sort in it
+    -1 if there is no map in use for fin
+*/
+int get_last_id_from_block_map(int fin, int rev, int64_t *id) {
+  bmap_t *map = block_map_in_use;
+  int64_t i, last_id;
+
+  if (map == NULL || map->fd != fin) {
+    return(-1);
+  }
+  for (i = map->count - 1; i >= 0; i--) {
+    if (!(map->entries[i].flags & BMAP_GENUINE))
+      continue;
+    last_id = rev ? map->entries[i].last_rev_id : map->entries[i].last_page_id;
+    if (last_id < 0)
+      return(0);
+    if (last_id > 0) {
+      *id = last_id;
+      return(1);
+    }
+  }
+  return(0);
+}
+
+/*
+  set up bfile to decompress fin from the given offset in the
+  uncompressed data of the file, using the block map: the block
+  containing that offset is found and decompressed into u, and
+  the output in front of the offset is consumed.  on return the
+  data in u starts with the byte at the offset; further data
+  is had by calling fill_ubuf() as usual.
+
+  the caller must set bfile->initialized and bfile->marker up
+  as for fill_ubuf().
+
+  returns:
+    0 on success
+    -1 on error (including no map with uncompressed offsets,
+      and an offset past the end of the data)
+*/
+int seek_to_uncompressed_offset(ubuf_t *u, int fin, bz_info_t *bfile, int64_t uoffset) {
+  bmap_entry_t *entry;
+  int64_t skip;
+  size_t avail;
+
+  if (find_block_for_uncompressed_offset(fin, uoffset, &entry) != 1) {
+    fprintf(stderr,"no block map with uncompressed offsets for this file, run makebz2blockmap --uncompressed\n");
+    return(-1);
+  }
+  skip = uoffset - entry->uncompressed_offset;
+  bfile->position = entry->offset;
+  bfile->bytes_read = 0;
+  ubuf_consume(u, u->end - u->start);
+
+  while (1) {
+    if (fill_ubuf(u, fin, bfile) < 0)
+      return(-1);
+    ubuf_peek(u, &avail);
+    if ((int64_t)avail > skip) {
+      ubuf_consume(u, (size_t)skip);
+      return(0);
+    }
+    skip -= avail;
+    ubuf_consume(u, avail);
+    if (bfile->eof) {
+      fprintf(stderr,"uncompressed offset %"PRId64" is past the end of the data\n", uoffset);
+      return(-1);
+    }
+  }
+}
+
+/* a byte range of a bz2 file to be scanned for block markers by one thread */
+typedef struct {
+  int fin;
+  off_t start;              /* first offset at which a marker may be reported */
+  off_t end;                /* offset after the last one */
+  int validate;             /* whether to check the block header after each marker */
+  off_t file_size;
+  unsigned char *header;    /* bz2 file header, for the block size */
+  bmap_t *found;            /* markers found in the range; its streams hold
+			       each stream header (with no end) and end of
+			       stream marker (with no start) as found */
+  int result;               /* 0 on success, -1 on error */
+} scan_range_t;
+
+/*
+  check whether a byte-aligned block or end of stream marker reported
+  at offset is the first thing in a stream, right after a "BZh" header
+
+  returns:
+    1 if so, 0 if not, -1 on error
+*/
+static int check_for_stream_header(int fin, off_t offset) {
+  unsigned char buffer[4];
+
+  if (offset < (off_t)3)
+    return(0);
+  if (pread_all(fin, buffer, 4, offset - (off_t)3) < 4) {
+    fprintf(stderr,"read of file failed\n");
+    return(-1);
+  }
+  if (buffer[0] == 'B' && buffer[1] == 'Z' && buffer[2] == 'h' &&
+      buffer[3] >= '1' && buffer[3] <= '9')
+    return(1);
+  return(0);
+}
+
+/*
+  check that an end of stream marker found by find_bz2_marker_in_buffer()
+  is genuine: the stream it ends must be followed (after padding to a byte
+  boundary) by the end of the file or by the header of another stream
+
+  returns:
+    1 if so, 2 if the file ends before the stream crc does,
+    0 if not, -1 on error
+*/
+int check_bz2_footer(int fin, off_t offset, int bits_shifted, off_t file_size) {
+  unsigned char buffer[3];
+  off_t next;
+
+  /* marker and stream crc are 80 bits */
+  if (bits_shifted)
+    next = (offset * 8 + bits_shifted + 80 + 7) / 8;
+  else
+    next = offset + (off_t)11;
+  if (next > file_size)
+    return(2);
+  if (next == file_size)
+    return(1);
+  if (pread_all(fin, buffer, 3, next) < 3)
+    return(0);
+  if (buffer[0] == 'B' && buffer[1] == 'Z' && buffer[2] == 'h')
+    return(1);
+  return(0);
+}
+
+static void *scan_range_for_blocks(void *arg) {
+  scan_range_t *range = (scan_range_t *)arg;
+  unsigned char *window;
+  off_t offset = range->start;
+  off_t dropped = range->start;
+  off_t block_start;
+  ssize_t bytes_read;
+  size_t toread;
+  int pos, index, bits_shifted, marker_type, flags, res;
+  uint32_t crc;
+
+  range->result = -1;
+  window = malloc(MARKER_SCAN_MAX);
+  if (window == NULL) {
+    fprintf(stderr,"failed to allocate marker scan buffer\n");
+    return(NULL);
+  }
+  while (offset < range->end) {
+    io_drop_behind(range->fin, &dropped, offset);
+    /* the last window reads past the end of the range, so a marker
+       that starts in this range but ends in the next is seen here */
+    toread = MARKER_SCAN_MAX;
+    if ((off_t)toread > range->end + SCAN_RANGE_OVERLAP - offset)
+      toread = (size_t)(range->end + SCAN_RANGE_OVERLAP - offset);
+    bytes_read = pread_all(range->fin, window, toread, offset);
+    if (bytes_read == -1) {
+      fprintf(stderr,"read of file failed\n");
+      free(window);
+      return(NULL);
+    }
+    pos = 0;
+    while ((index = find_bz2_marker_in_buffer(window + pos, bytes_read - pos,
+					      &bits_shifted, &marker_type)) >= 0) {
+      block_start = offset + (off_t)(pos + index);
+      if (block_start >= range->end)
+	break;
+      pos += index + 1;
+      flags = BMAP_GENUINE;
+      crc = 0;
+      if (range->validate) {
+	if (marker_type == BZ2_MARKER_BLOCK)
+	  res = check_bz2_block_header(range->fin, block_start, bits_shifted, range->header);
+	else
+	  res = check_bz2_footer(range->fin, block_start, bits_shifted, range->file_size);
+	if (res == -1)
+	  goto error;
+	else if (!res)
+	  flags = 0;
+      }
+      /* a marker too close to the end of the file for its crc
+	 is the start of something that was never written */
+      if (block_start + (off_t)11 > range->file_size)
+	flags = 0;
+      if (flags & BMAP_GENUINE) {
+	/* the stream crc follows the end of stream marker
+	   just as the block crc follows the block marker */
+	if (read_block_crc(range->fin, block_start, bits_shifted, &crc) == -1)
+	  goto error;
+	if (!bits_shifted) {
+	  res = check_for_stream_header(range->fin, block_start);
+	  if (res == -1)
+	    goto error;
+	  else if (res && add_block_map_stream(range->found, block_start - (off_t)3,
+					       (off_t)-1, 0, 0) == -1)
+	    goto error;
+	}
+      }
+      if (marker_type == BZ2_MARKER_FOOTER) {
+	if ((flags & BMAP_GENUINE) &&
+	    add_block_map_stream(range->found, (off_t)-1, block_start, bits_shifted, crc) == -1)
+	  goto error;
+      }
+      else if (add_block_map_entry(range->found, block_start, bits_shifted, flags, crc) == -1)
+	goto error;
+    }
+    if ((size_t)bytes_read < toread || bytes_read < 7)
+      break;
+    /* every window position with 7 bytes after it was checked */
+    offset += (off_t)(bytes_read - 6);
+  }
+  free(window);
+  range->result = 0;
+  return(NULL);
+
+ error:
+  free(window);
+  return(NULL);
+}
+
+/*
+  add the stream headers and end of stream markers found by
+  scan_range_for_blocks() to the map, pairing them up into streams
+
+  returns:
+    0 on success, -1 on error
+*/
+static int add_streams_from_range(bmap_t *map, bmap_t *found, off_t *open_stream) {
+  int64_t i;
+
+  for (i = 0; i < found->stream_count; i++) {
+    if (found->streams[i].start != (off_t)-1) {
+      /* a stream that was never ended, say in a truncated file */
+      if (*open_stream != (off_t)-1 &&
+	  add_block_map_stream(map, *open_stream, (off_t)-1, 0, 0) == -1)
+	return(-1);
+      *open_stream = found->streams[i].start;
+    }
+    else {
+      if (add_block_map_stream(map, *open_stream, found->streams[i].end,
+			       found->streams[i].end_bits_shifted, found->streams[i].crc) == -1)
+	return(-1);
+      *open_stream = (off_t)-1;
+    }
+  }
+  return(0);
+}
+
+/*
+  find all block markers in a bz2 file and add them to the map, in order,
+  along with the table of streams in the file, found in the same pass
+  from their headers and end of stream markers.
+  the file is split into byte ranges which are scanned in parallel by
+  the given number of threads, reading with pread() so they may share
+  the descriptor.  if validate is set, each marker is checked by
+  checking its block header and only genuine blocks are flagged BMAP_GENUINE,
+  and end of stream markers are checked by what follows them;
+  otherwise every marker is assumed to be genuine.  the block crc is
+  recorded for each genuine block.
+
+  returns:
+    0 on success, -1 on error
+*/
+int scan_bz2_blocks(int fin, int threads, int validate, bmap_t *map) {
+  scan_range_t *ranges;
+  pthread_t *thread_ids;
+  unsigned char header[4];
+  off_t file_size, range_size;
+  off_t open_stream = (off_t)-1;
+  int i, nranges, started = 0, result = 0;
+  int64_t j;
+
+  file_size = get_file_size(fin);
+  if (file_size == (off_t)-1)
+    return(-1);
+  if (pread_all(fin, header, 4, (off_t)0) < 4) {
+    fprintf(stderr,"failed to read 4 bytes of header\n");
+    return(-1);
+  }
+  if (threads < 1)
+    threads = 1;
+  /* don't bother splitting up small files */
+  nranges = threads;
+  if (file_size / (off_t)nranges < (off_t)MARKER_SCAN_MIN)
+    nranges = (int)(file_size / (off_t)MARKER_SCAN_MIN) + 1;
+  range_size = file_size / (off_t)nranges + 1;
+
+  ranges = (scan_range_t *)malloc(nranges * sizeof(scan_range_t));
+  thread_ids = (pthread_t *)malloc(nranges * sizeof(pthread_t));
+  if (ranges == NULL || thread_ids == NULL) {
+    fprintf(stderr,"failed to allocate block scan ranges\n");
+    free(ranges);
+    free(thread_ids);
+    return(-1);
+  }
+  for (i = 0; i < nranges; i++) {
+    ranges[i].fin = fin;
+    ranges[i].start = range_size * (off_t)i;
+    ranges[i].end = range_size * (off_t)(i + 1);
+    if (ranges[i].end > file_size)
+      ranges[i].end = file_size;
+    ranges[i].validate = validate;
+    ranges[i].file_size = file_size;
+    ranges[i].header = header;
+    ranges[i].found = init_block_map();
+    ranges[i].result = -1;
+    if (ranges[i].found == NULL) {
+      result = -1;
+      break;
+    }
+    if (nranges > 1) {
+      if (pthread_create(&(thread_ids[i]), NULL, scan_range_for_blocks, &(ranges[i]))) {
+	fprintf(stderr,"failed to start block scan thread\n");
+	free_block_map(ranges[i].found);
+	result = -1;
+	break;
+      }
+    }
+    else {
+      scan_range_for_blocks(&(ranges[i]));
+    }
+    started++;
+  }
+  /* even after an error, the threads already started must be waited
+     for, since they use header and ranges */
+  for (i = 0; i < started; i++) {
+    if (nranges > 1)
+      pthread_join(thread_ids[i], NULL);
+    if (ranges[i].result == -1)
+      result = -1;
+    for (j = 0; j < ranges[i].found->count && result != -1; j++) {
+      result = add_block_map_entry(map, ranges[i].found->entries[j].offset,
+				   ranges[i].found->entries[j].bits_shifted,
+				   ranges[i].found->entries[j].flags,
+				   ranges[i].found->entries[j].crc);
+    }
+    if (result != -1)
+      result = add_streams_from_range(map, ranges[i].found, &open_stream);
+    free_block_map(ranges[i].found);
+  }
+  if (result != -1 && open_stream != (off_t)-1)
+    result = add_block_map_stream(map, open_stream, (off_t)-1, 0, 0);
+  free(ranges);
+  free(thread_ids);
+  return(result);
+}
+
+/* a block decoder, kept in a pool for reuse once done with */
+typedef struct bz_decoder {
+  bz_stream strm;
+  bz_bit_reader_t reader;
+  unsigned char *bufin;
+  struct bz_decoder *next;
+} bz_decoder_t;
+
+static bz_decoder_t *decoder_pool = NULL;
+static pthread_mutex_t decoder_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  get a decoder from the pool, or a new one if the pool is empty.
+  a decoder that has been used keeps the arrays for undoing the
+  BWT, so the next block of the same size needs no allocations.
+
+  returns:
+    the decoder, or NULL on error
+*/
+static bz_decoder_t *get_bz2_decoder(void) {
+  bz_decoder_t *decoder;
+
+  pthread_mutex_lock(&decoder_pool_lock);
+  decoder = decoder_pool;
+  if (decoder != NULL)
+    decoder_pool = decoder->next;
+  pthread_mutex_unlock(&decoder_pool_lock);
+  if (decoder != NULL)
+    return(decoder);
+
+  decoder = (bz_decoder_t *)malloc(sizeof(bz_decoder_t));
+  if (decoder != NULL)
+    decoder->bufin = (unsigned char *)malloc(PARALLEL_BUFINSIZE);
+  if (decoder == NULL || decoder->bufin == NULL) {
+    fprintf(stderr,"failed to allocate block decoder\n");
+    free(decoder);
+    return(NULL);
+  }
+  decoder->strm.bzalloc = pooled_bzalloc;
+  decoder->strm.bzfree = pooled_bzfree;
+  decoder->strm.opaque = NULL;
+  if (BZ2_bzDecompressInit(&(decoder->strm), 0, 0) != BZ_OK) {
+    fprintf(stderr,"failed to set up block decoder\n");
+    free(decoder->bufin);
+    free(decoder);
+    return(NULL);
+  }
+  return(decoder);
+}
+
+static void put_bz2_decoder(bz_decoder_t *decoder) {
+  pthread_mutex_lock(&decoder_pool_lock);
+  decoder->next = decoder_pool;
+  decoder_pool = decoder;
+  pthread_mutex_unlock(&decoder_pool_lock);
+}
+
+/*
+  free the decoders kept for reuse by decode_bz2_block()
+  and decompress_blocks_parallel()
+*/
+void free_bz2_decoder_pool(void) {
+  bz_decoder_t *decoder;
+
+  pthread_mutex_lock(&decoder_pool_lock);
+  while ((decoder = decoder_pool) != NULL) {
+    decoder_pool = decoder->next;
+    BZ2_bzDecompressEnd(&(decoder->strm));
+    free(decoder->bufin);
+    free(decoder);
+  }
+  pthread_mutex_unlock(&decoder_pool_lock);
+}
+
+/*
+  decode the bz2 block at block_start and bits_shifted (as found by
+  find_first_bz2_block_from_offset() or kept in a block map) into out,
+  at most out_cap bytes of it.  the file is read with pread() and the
+  decoder comes from a pool, so any number of threads may call this on
+  the same descriptor at once.
+
+  returns:
+    0 if the whole block was decoded, its crc checks out and all of its
+      output fit, with the number of bytes in *out_len
+    1 if out filled up first; *out_len is out_cap and the rest of
+      the block's output is dropped
+    -1 on error (including a block cut off by the end of the file)
+*/
+int decode_bz2_block(int fin, off_t block_start, int bits_shifted,
+		     unsigned char *out, size_t out_cap, size_t *out_len) {
+  bz_decoder_t *decoder;
+  unsigned char header[4];
+  int ret;
+
+  *out_len = 0;
+  if (pread_all(fin, header, 4, (off_t)0) < 4) {
+    fprintf(stderr,"failed to read 4 bytes of header\n");
+    return(-1);
+  }
+  if (header[3] < '1' || header[3] > '9') {
+    fprintf(stderr,"Corrupt bzip2 header\n");
+    return(-1);
+  }
+  decoder = get_bz2_decoder();
+  if (decoder == NULL)
+    return(-1);
+  BZ2_bitReaderInit(&(decoder->reader), fin,
+		    bits_shifted ? block_start : block_start + (off_t)1,
+		    bits_shifted, decoder->bufin, PARALLEL_BUFINSIZE);
+  ret = BZ2_bzDecodeBlock(&(decoder->strm), &(decoder->reader), header[3] - '0');
+  while (ret == BZ_OK && *out_len < out_cap) {
+    decoder->strm.next_out = (char *)(out + *out_len);
+    decoder->strm.avail_out = out_cap - *out_len > (size_t)0x40000000 ?
+      0x40000000 : (unsigned int)(out_cap - *out_len);
+    ret = BZ2_bzDecodeOutput(&(decoder->strm));
+    *out_len = (unsigned char *)decoder->strm.next_out - out;
+  }
+  put_bz2_decoder(decoder);
+  if (ret == BZ_BLOCK_END)
+    return(0);
+  else if (ret == BZ_OK)
+    return(1);
+  fprintf(stderr,"error from BZ decompress %d (5)\n",ret);
+  return(-1);
+}
+
+/* a block handed to the threads of decompress_blocks_parallel() */
+typedef struct {
+  int64_t bit_offset;       /* where its marker starts, in bits from the start of the file */
+  int marker_type;          /* BZ2_MARKER_BLOCK or BZ2_MARKER_FOOTER */
+  int state;                /* PBLOCK_QUEUED, PBLOCK_RUNNING or PBLOCK_DONE */
+  int result;               /* BZ_OK if it decoded, or the error */
+  int64_t end_bit_offset;   /* where it ends, if it decoded */
+  unsigned char *out;       /* its uncompressed data */
+  size_t out_len;
+  size_t out_size;
+} pblock_t;
+
+#define PBLOCK_QUEUED 1
+#define PBLOCK_RUNNING 2
+#define PBLOCK_DONE 3
+
+/* the state shared by decompress_blocks_parallel() and its threads */
+typedef struct {
+  int fin;
+  int block_size;           /* from the stream header, 1 through 9 */
+  pblock_t *slots;          /* block n is kept in slot n % window */
+  int window;
+  int64_t added;            /* number of blocks put in slots so far */
+  int64_t taken;            /* number of them picked up by a thread */
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work;      /* signalled when a block is added, or on stop */
+  pthread_cond_t done;      /* signalled when a block is decoded */
+} pdecomp_t;
+
+/* the marker search of decompress_blocks_parallel(), done a window at a time */
+typedef struct {
+  unsigned char *window;
+  int window_size;
+  ssize_t len;              /* bytes in the window */
+  off_t offset;             /* file offset of the window */
+  int pos;                  /* where in the window to look next */
+  int eof;
+  unsigned char header[4];  /* the stream header, for checking blocks */
+} pscan_t;
+
+/*
+  get the next marker after the last one found by the search,
+  skipping block markers whose block header is no good
+
+  returns:
+    1 if found, with its offset in bits in *bit_offset and
+      its type in *marker_type
+    0 if there are no more
+    -1 on error
+*/
+static int get_next_marker_from_scan(int fin, pscan_t *scan, int64_t *bit_offset, int *marker_type) {
+  int index, bits_shifted, res;
+  off_t block_start;
+  ssize_t bytes_read;
+
+  while (1) {
+    if (scan->len - scan->pos >= 7) {
+      index = find_bz2_marker_in_buffer(scan->window + scan->pos, scan->len - scan->pos,
+					&bits_shifted, marker_type);
+      if (index >= 0) {
+	block_start = scan->offset + (off_t)(scan->pos + index);
+	scan->pos += index + 1;
+	if (*marker_type == BZ2_MARKER_BLOCK) {
+	  res = check_bz2_block_header(fin, block_start, bits_shifted, scan->header);
+	  if (res == -1)
+	    return(-1);
+	  else if (!res)
+	    continue;
+	}
+	*bit_offset = bits_shifted ? (int64_t)block_start * 8 + bits_shifted :
+	  ((int64_t)block_start + 1) * 8;
+	return(1);
+      }
+    }
+    if (scan->eof)
+      return(0);
+    /* the last 6 bytes of the window may hold the start of a marker */
+    if (scan->len >= 7)
+      scan->offset += (off_t)(scan->len - 6);
+    bytes_read = pread_all(fin, scan->window, scan->window_size, scan->offset);
+    if (bytes_read == -1) {
+      fprintf(stderr,"read of file failed\n");
+      return(-1);
+    }
+    if (bytes_read < scan->window_size)
+      scan->eof = 1;
+    scan->len = bytes_read;
+    scan->pos = 0;
+    if (scan->window_size < MARKER_SCAN_MAX)
+      scan->window_size *= 2;
+  }
+}
+
+/*
+  decode one block and all of its output into blk->out, using
+  the given decoder, which belongs to the calling thread
+*/
+static void decode_parallel_block(pdecomp_t *pd, pblock_t *blk, bz_decoder_t *decoder) {
+  bz_stream *strm = &(decoder->strm);
+  bz_bit_reader_t *reader = &(decoder->reader);
+  unsigned char *out;
+  int ret;
+
+  BZ2_bitReaderInit(reader, pd->fin, (off_t)(blk->bit_offset / 8), (int)(blk->bit_offset % 8),
+		    decoder->bufin, PARALLEL_BUFINSIZE);
+  ret = BZ2_bzDecodeBlock(strm, reader, pd->block_size);
+  if (ret != BZ_OK) {
+    blk->result = ret;
+    return;
+  }
+  blk->end_bit_offset = BZ2_bitReaderTell(reader);
+  blk->out_len = 0;
+  do {
+    if (blk->out_len == blk->out_size) {
+      blk->out_size = blk->out_size ? blk->out_size * 2 : (size_t)pd->block_size * 100000;
+      out = (unsigned char *)realloc(blk->out, blk->out_size);
+      if (out == NULL) {
+	fprintf(stderr,"failed to allocate output buffer for block\n");
+	blk->result = BZ_MEM_ERROR;
+	return;
+      }
+      blk->out = out;
+    }
+    strm->next_out = (char *)(blk->out + blk->out_len);
+    strm->avail_out = (unsigned int)(blk->out_size - blk->out_len);
+    ret = BZ2_bzDecodeOutput(strm);
+    blk->out_len = (unsigned char *)strm->next_out - blk->out;
+  } while (ret == BZ_OK);
+  blk->result = (ret == BZ_BLOCK_END) ? BZ_OK : ret;
+}
+
+static void *decompress_blocks_thread(void *arg) {
+  pdecomp_t *pd = (pdecomp_t *)arg;
+  pblock_t *blk;
+  bz_decoder_t *decoder;
+
+  decoder = get_bz2_decoder();
+  pthread_mutex_lock(&(pd->lock));
+  while (1) {
+    while (!pd->stop && pd->taken == pd->added)
+      pthread_cond_wait(&(pd->work), &(pd->lock));
+    if (pd->stop)
+      break;
+    blk = &(pd->slots[pd->taken % pd->window]);
+    pd->taken++;
+    if (blk->state != PBLOCK_QUEUED)
+      continue;
+    blk->state = PBLOCK_RUNNING;
+    pthread_mutex_unlock(&(pd->lock));
+    if (decoder == NULL)
+      blk->result = BZ_MEM_ERROR;
+    else
+      decode_parallel_block(pd, blk, decoder);
+    pthread_mutex_lock(&(pd->lock));
+    blk->state = PBLOCK_DONE;
+    pthread_cond_broadcast(&(pd->done));
+  }
+  pthread_mutex_unlock(&(pd->lock));
+  if (decoder != NULL)
+    put_bz2_decoder(decoder);
+  return(NULL);
+}
+
+/*
+  decompress fin from the first block at or after position to the
+  end of the stream it is in, several blocks at a time, handing the
+  output to the caller in order.
+
+  the main thread looks for block markers ahead of the output and
+  puts each block that checks out in a window of slots; the given
+  number of threads decode them, each into its own buffer.  the
+  output of a block is used only if the block starts right where the
+  one before it ended, so markers that turn up inside the compressed
+  data by chance are thrown away once their turn comes; an end of
+  stream marker in that spot ends the output.  at most PARALLEL_WINDOW
+  blocks per thread are held at once.
+
+  output is called with each block's data in turn, and returns
+  0 to go on, 1 to stop there, or -1 on error.
+
+  returns:
+    0 on success (including when there is no block after position)
+    -1 on error (including a position past the end of the file)
+*/
+int decompress_blocks_parallel(int fin, off_t position, int threads,
+			       block_output_t output, void *data) {
+  bz_info_t bfile;
+  pdecomp_t pd;
+  pscan_t scan;
+  pblock_t *blk;
+  pthread_t *thread_ids;
+  int64_t written = 0, expected, bit_offset;
+  off_t dropped;
+  int i, res, marker_type, started = 0, result = 0, scan_done = 0;
+
+  if (threads < 1)
+    threads = 1;
+  if (pread_all(fin, scan.header, 4, (off_t)0) < 4) {
+    fprintf(stderr,"failed to read 4 bytes of header\n");
+    return(-1);
+  }
+  if (scan.header[3] < '1' || scan.header[3] > '9') {
+    fprintf(stderr,"Corrupt bzip2 header\n");
+    return(-1);
+  }
+  bfile.marker = NULL;
+  bfile.window = NULL;
+  bfile.readahead = 0;
+  bfile.ra = NULL;
+  memcpy(bfile.header_buffer, scan.header, 4);
+  bfile.header_read = 1;
+  res = find_first_bz2_block_from_offset(&bfile, fin, position, FORWARD, 0);
+  free_read_window(bfile.window);
+  if (res <= 0) {
+    if (!res && position > bfile.file_size) {
+      fprintf(stderr,"asked for position past end of file\n");
+      return(-1);
+    }
+    return(res);
+  }
+  expected = bfile.bits_shifted ? (int64_t)bfile.block_start * 8 + bfile.bits_shifted :
+    ((int64_t)bfile.block_start + 1) * 8;
+  dropped = bfile.block_start;
+
+  scan.window_size = MARKER_SCAN_MIN;
+  scan.window = (unsigned char *)malloc(MARKER_SCAN_MAX);
+  scan.len = 0;
+  scan.offset = bfile.block_start;
+  scan.pos = 0;
+  scan.eof = 0;
+
+  pd.fin = fin;
+  pd.block_size = scan.header[3] - '0';
+  pd.window = threads * PARALLEL_WINDOW;
+  pd.slots = (pblock_t *)calloc(pd.window, sizeof(pblock_t));
+  pd.added = pd.taken = 0;
+  pd.stop = 0;
+  thread_ids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  if (scan.window == NULL || pd.slots == NULL || thread_ids == NULL) {
+    fprintf(stderr,"failed to allocate buffers for parallel decompression\n");
+    free(scan.window);
+    free(pd.slots);
+    free(thread_ids);
+    return(-1);
+  }
+  pthread_mutex_init(&(pd.lock), NULL);
+  pthread_cond_init(&(pd.work), NULL);
+  pthread_cond_init(&(pd.done), NULL);
+  for (started = 0; started < threads; started++) {
+    if (pthread_create(&(thread_ids[started]), NULL, decompress_blocks_thread, &pd)) {
+      fprintf(stderr,"failed to start decompression thread\n");
+      result = -1;
+      break;
+    }
+  }
+
+  while (result != -1 && started) {
+    /* keep the slots full */
+    while (!scan_done && pd.added - written < pd.window) {
+      res = get_next_marker_from_scan(fin, &scan, &bit_offset, &marker_type);
+      if (res == -1) {
+	result = -1;
+	break;
+      }
+      else if (!res) {
+	scan_done = 1;
+	break;
+      }
+      pthread_mutex_lock(&(pd.lock));
+      blk = &(pd.slots[pd.added % pd.window]);
+      blk->bit_offset = bit_offset;
+      blk->marker_type = marker_type;
+      blk->result = BZ_OK;
+      blk->out_len = 0;
+      /* there is nothing to decode in an end of stream marker */
+      blk->state = (marker_type == BZ2_MARKER_BLOCK) ? PBLOCK_QUEUED : PBLOCK_DONE;
+      pd.added++;
+      pthread_cond_signal(&(pd.work));
+      pthread_mutex_unlock(&(pd.lock));
+    }
+    if (result == -1 || written == pd.added)
+      break;
+
+    blk = &(pd.slots[written % pd.window]);
+    pthread_mutex_lock(&(pd.lock));
+    while (blk->state != PBLOCK_DONE)
+      pthread_cond_wait(&(pd.done), &(pd.lock));
+    pthread_mutex_unlock(&(pd.lock));
+    written++;
+
+    /* a marker inside the block before it, there by chance */
+    if (blk->bit_offset < expected)
+      continue;
+    if (blk->bit_offset > expected) {
+      fprintf(stderr,"no block or end of stream found where the block before ends, at bit %"PRId64"\n",
+	      expected);
+      result = -1;
+      break;
+    }
+    if (blk->marker_type == BZ2_MARKER_FOOTER)
+      break;
+    if (blk->result == BZ_UNEXPECTED_EOF) {
+      fprintf(stderr,"file ends in the middle of a block\n");
+      break;
+    }
+    else if (blk->result != BZ_OK) {
+      fprintf(stderr,"error from BZ decompress %d (4)\n",blk->result);
+      result = -1;
+      break;
+    }
+    expected = blk->end_bit_offset;
+    /* the blocks still to be decoded all start after this one */
+    io_drop_behind(fin, &dropped, (off_t)(expected / 8));
+    res = output(blk->out, blk->out_len, data);
+    if (res) {
+      if (res == -1)
+	result = -1;
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&(pd.lock));
+  pd.stop = 1;
+  pthread_cond_broadcast(&(pd.work));
+  pthread_mutex_unlock(&(pd.lock));
+  for (i = 0; i < started; i++)
+    pthread_join(thread_ids[i], NULL);
+  for (i = 0; i < pd.window; i++)
+    free(pd.slots[i].out);
+  pthread_mutex_destroy(&(pd.lock));
+  pthread_cond_destroy(&(pd.work));
+  pthread_cond_destroy(&(pd.done));
+  free(pd.slots);
+  free(thread_ids);
+  free(scan.window);
+  return(result);
+}
@@ -1,8 +1,75 @@
 #ifndef _MWBZUTILS_H
 #define _MWBZUTILS_H
 
+#include <sys/types.h>
+#include <inttypes.h>
 #include "bzlib_private.h"
 int BZ_API(BZ2_bzDecompress_mine) ( bz_stream *strm );
+int BZ_API(BZ2_bzDecompress_block) ( bz_stream *strm );
+
+/* returned by BZ2_bzDecompress_block when a block's output is complete */
+#define BZ_BLOCK_END 5
+
+/* reads a file ahead of its reader on a thread of its own, see start_readahead() */
+typedef struct readahead readahead_t;
+
+/*
+  reads compressed data a bit at a time, starting at any bit of
+  a file or of a buffer in memory, with no shifting of the data
+*/
+typedef struct {
+  uint64_t bits;          /* bits read in but not yet used, the next one in the top bit */
+  int live;               /* number of such bits */
+  unsigned char *next;    /* next byte of input to move into bits */
+  unsigned char *end;     /* end of the input in the buffer */
+  unsigned char *buffer;  /* buffer for reads from the file */
+  int buffer_size;
+  int fd;                 /* file to read more input from, or -1 if all input is in memory */
+  off_t offset;           /* file offset of the next read */
+  int last_read;          /* number of bytes got by the last read that got any */
+  int overrun;            /* set if more bits were used than there are */
+  readahead_t *readahead; /* if set, input comes from here rather than from reads of fd */
+} bz_bit_reader_t;
+
+void BZ2_bitReaderInit ( bz_bit_reader_t *br, int fd, off_t offset, int bit,
+			 unsigned char *buffer, int buffer_size );
+
+void BZ2_bitReaderInitMem ( bz_bit_reader_t *br, unsigned char *buffer, int len, int bit );
+
+void BZ2_bitReaderInitReadahead ( bz_bit_reader_t *br, readahead_t *ra, off_t offset, int bit );
+
+int64_t BZ2_bitReaderTell ( bz_bit_reader_t *br );
+
+int BZ_API(BZ2_bzDecodeBlock) ( bz_stream *strm, bz_bit_reader_t *br, int block_size );
+
+int BZ_API(BZ2_bzDecodeOutput) ( bz_stream *strm );
+
+int BZ_API(BZ2_bzDecodeOutputUnchecked) ( bz_stream *strm );
+
+UInt32 BZ2_updateBlockCRC ( UInt32 crc, const UChar *buf, size_t len );
+
+int BZ_API(BZ2_bzDecodeBlockPrefix) ( bz_stream *strm, bz_bit_reader_t *br, int block_size,
+				      char *out, int budget, int *out_len );
+
+/* ways for the block decoder to keep up the MTF list */
+#define MTF_MEMMOVE 0     /* move the list along with memmove, as libbz2 does in effect */
+#define MTF_SIMD 1        /* shift the front of the list in an SSE2 register when it can */
+
+/* indexes from here up are left to memmove by MTF_SIMD; below it
+   are the four 16 byte pieces it shifts in registers */
+#define MTF_SIMD_MAX 64
+
+void BZ2_setMtfMethod ( int method );
+
+int BZ2_getMtfMethod ( void );
+
+/* ways for the block decoder to undo the BWT */
+#define BWT_CHAIN 0       /* follow the chain through tt one byte at a time, as libbz2 does */
+#define BWT_TWO_WAY 1     /* follow it from both ends at once */
+
+void BZ2_setBwtMethod ( int method );
+
+int BZ2_getBwtMethod ( void );
 
 typedef struct {
   int id; /* first id in the block */
@@ -12,6 +79,28 @@ typedef struct {
 
 #define BUFINSIZE 5000
 
+/*
+  a window of a file kept in memory, for reading the file at any
+  offset with pread(), so that nothing depends on the file position.
+  reads that fall inside the window are served from it, so the small
+  reads that searches for blocks make near each other (marker scans,
+  block headers, block crcs) cost one pread() among them.  a window
+  belongs to one thread; threads reading the same file each have
+  their own.
+*/
+typedef struct {
+  int fin;
+  unsigned char *buffer;
+  size_t size;         /* bytes allocated for the buffer */
+  off_t start;         /* file offset of the first byte in the buffer */
+  size_t len;          /* number of bytes of the file in the buffer */
+  int eof;             /* set if the file ends at start + len */
+  off_t dropped;       /* for io_drop_behind(), -1 until the first read */
+} read_window_t;
+
+/* least number of bytes read into a window at a time */
+#define READ_WINDOW_MIN 65536
+
 /*
   keeps all information about a bzipped file
   plus input/output buffers for decompression
@@ -33,9 +122,6 @@ typedef struct {
                                        the offset to the first one) */
   unsigned char block_info[12];     /* block marker and crc bytes, possibly bit-shifted, for the current block */
   bz_stream strm;                   /* stream structure for libbz2 */
-  unsigned char overflow;           /* since decompressed bytes may not be bit aligned, we keep the last byte
-				       read around so we can grab the lower end bits off the end for
-				       sticking in front of the next pile of compressed bytes we read */
 
   int bits_shifted;                  /* number of bits that the compressed data has been right shifted 
 				       in the file (if the number is 0, the block marker and subsequent
@@ -51,25 +137,56 @@ typedef struct {
   int bytes_written;                 /* number of bytes of decompressed data written into output buffer (per decompress) */
   int eof;                          /* nonzero if eof reached */
   off_t file_size;                     /* length of file, so we don't search past it for blocks */
+  bz_bit_reader_t reader;           /* compressed data for the block decoder, read into bufin */
+  int block_size;                   /* from the bz2 header, in units of 100k */
+  int skip_crc;                     /* set to not compute block crcs, when only looking
+				       for something in the data */
+  read_window_t *window;            /* for searches for blocks, allocated on first use if NULL */
+  int readahead;                    /* bytes of compressed data to read ahead of the decoder at a time,
+				       0 to read only as it is needed */
+  readahead_t *ra;                  /* the read-ahead going on, if any */
 } bz_info_t;
 
 #define MASKLEFT 0
 #define MASKRIGHT 1
 
-/* 
-   this output buffer is used to collect decompressed output.  
-   this is not a circular buffer; when it is full the user is 
-   responsible for emptying it completely or partially and moving 
-   to the beginning any unused bytes. 
-   
+/*
+   sliding window over decompressed output, see init_ubuf().
+   data is decompressed onto the end with fill_ubuf(), looked at
+   with ubuf_peek() or ubuf_find() and dropped from the front with
+   ubuf_consume(); what is not consumed is kept for the next look,
+   moved to the front of the buffer only when room runs short.
 */
 typedef struct {
-  unsigned char *buffer;          /* output storage, allocated by the caller */
-  unsigned char *next_to_read;    /* pointer to the next byte in the buffer with data to be read */
-  unsigned char *next_to_fill;    /* pointer to the next byte in the buffer which is empty and can receive data */
-  int bytes_avail;                /* number of bytes available for reading */
-  unsigned char *end;             /* points to byte after end of buffer */
-} buf_info_t;
+  unsigned char *buffer;          /* size + 1 bytes, the data is always followed by a '\0' */
+  size_t size;
+  size_t start;                   /* first byte not yet consumed */
+  size_t end;                     /* byte after the last one decompressed */
+} ubuf_t;
+
+/* window sizes: for scans through whole blocks, and for the file header */
+#define UBUF_SIZE 1048576
+#define UBUF_HEADER_SIZE 65536
+
+/* which id an <id> tag holds, from the tag it follows */
+#define ID_SCAN_PAGE 1
+#define ID_SCAN_REV 2
+
+/*
+   state of a scan of xml for page and rev ids, see scan_for_ids().
+   it carries over from one buffer of xml to the next, so that tags
+   and ids split between buffers are found.
+*/
+typedef struct {
+  int state;
+  char tag[12];             /* name of a tag split between buffers */
+  int tag_len;
+  int pending;              /* ID_SCAN_ type of the next <id>, or 0 */
+  int64_t pending_offset;   /* offset of the <page> or <revision> tag */
+  int64_t tag_offset;       /* offset of the tag being read */
+  int64_t value;
+  int64_t offset;           /* bytes scanned so far */
+} id_scan_t;
 
 /* 
    used for each iteration of narrowing down the location in a bzipped2 file of
@@ -96,26 +213,62 @@ int bytes_compare(unsigned char *buff1, unsigned char *buff2, int numbytes, int
 
 int check_buffer_for_bz2_block_marker(bz_info_t *bfile);
 
+/* the 48 bit bz2 start of block marker (BCD pi) */
+#define BZ2_BLOCK_MAGIC 0x314159265359ULL
+/* the 48 bit bz2 end of stream marker (BCD sqrt(pi)) */
+#define BZ2_STREAM_MAGIC 0x177245385090ULL
+
+#define BZ2_MARKER_BLOCK 1
+#define BZ2_MARKER_FOOTER 2
+
+/* windows read from the file when scanning for block markers start out
+   small, since most searches find a marker within the first block, and
+   grow up to the max for long scans */
+#define MARKER_SCAN_MIN 65536
+#define MARKER_SCAN_MAX 4194304
+
+int find_bz2_block_marker_in_buffer(unsigned char *buf, int len, int *bits_shifted);
+
+int find_last_bz2_block_marker_in_buffer(unsigned char *buf, int len, int *bits_shifted);
+
+int find_bz2_marker_in_buffer(unsigned char *buf, int len, int *bits_shifted, int *marker_type);
+
 #define FORWARD 1
 #define BACKWARD 2
 
 int find_next_bz2_block_marker(int fin, bz_info_t *bfile, int direction);
 
+/* freed decoder chunks kept for reuse by pooled_bzfree(), at most */
+#define BZ_CHUNK_POOL_MAX 16
+/* alignment of large chunks, when huge pages are asked for */
+#define HUGE_PAGE_SIZE 2097152
+
+void *pooled_bzalloc(void *opaque, int items, int size);
+
+void pooled_bzfree(void *opaque, void *addr);
+
+void free_bz2_alloc_pool(void);
+
 int init_decompress(bz_info_t *bfile);
 
+int read_bz2_header(int fin, bz_info_t *bfile);
+
 int decompress_header(int fin, bz_info_t *bfile);
 
-int setup_first_buffer_to_decompress(int fin, bz_info_t *bfile);
+ubuf_t *init_ubuf(size_t size);
+
+void free_ubuf(ubuf_t *u);
 
-int fill_buffer_to_decompress(int fin, bz_info_t *bfile, int ret);
+unsigned char *ubuf_peek(ubuf_t *u, size_t *len);
 
-buf_info_t *init_buffer(int size);
+void ubuf_consume(ubuf_t *u, size_t len);
 
-void free_buffer(buf_info_t *b);
+size_t ubuf_find(ubuf_t *u, char *needle, int *found);
 
-int buffer_is_empty(buf_info_t *b);
+void init_id_scan(id_scan_t *scan);
 
-int buffer_is_full(buf_info_t *b);
+size_t scan_for_ids(id_scan_t *scan, unsigned char *buf, size_t len,
+		    int *type, int64_t *id, int64_t *tag_offset);
 
 off_t get_file_size(int fin);
 
@@ -123,11 +276,14 @@ int init_bz2_file(bz_info_t *bfile, int fin, int direction);
 
 int get_and_decompress_data(bz_info_t *bfile, int fin, unsigned char *bufferout, int bufout_size, int direction);
 
-int get_buffer_of_uncompressed_data(buf_info_t *b, int fin, bz_info_t *bfile, int direction);
+int fill_ubuf(ubuf_t *u, int fin, bz_info_t *bfile);
 
-void dump_buf_info(buf_info_t *b);
+/* how much of a block's output probes that look for the first page
+   or rev id in a block decode, before falling back to decoding all
+   of it */
+#define PROBE_BUDGET 65536
 
-int  move_bytes_to_buffer_start(buf_info_t *b, unsigned char *fromwhere, int maxbytes);
+int get_block_prefix(int fin, bz_info_t *bfile, unsigned char *out, int budget);
 
 unsigned char ** init_footer();
 
@@ -137,7 +293,176 @@ int check_file_for_footer(int fin, bz_info_t *bfile);
 
 void clear_buffer(unsigned char *buf, int length);
 
+ssize_t pread_all(int fin, unsigned char *buf, size_t count, off_t offset);
+
+read_window_t *init_read_window(int fin);
+
+void free_read_window(read_window_t *w);
+
+unsigned char *read_window_get(read_window_t *w, off_t offset, size_t count, size_t *got);
+
+read_window_t *get_read_window(int fin, bz_info_t *bfile);
+
+/* how a tool reads its file, see set_io_policy() */
+#define IO_POLICY_NONE 0      /* no hints to the kernel */
+#define IO_POLICY_PROBE 1     /* small reads here and there, as searches make */
+#define IO_POLICY_STREAM 2    /* one pass through the file */
+
+/* streaming reads drop what is behind them from the page cache this often */
+#define DROP_BEHIND_STEP 8388608
+/* searches ask for this much of a block they find to be read in ahead of use */
+#define PROBE_WILLNEED 262144
+
+void set_io_policy(int fin, int policy);
+
+void io_drop_behind(int fin, off_t *dropped, off_t offset);
+
+void io_will_need(int fin, off_t offset, off_t len);
+
+/* bounds for read-ahead windows */
+#define READAHEAD_MIN 65536
+#define READAHEAD_MAX 16777216
+
+int get_readahead_window(int window);
+
+readahead_t *start_readahead(int fin, off_t offset, int window);
+
+ssize_t readahead_next(readahead_t *ra, unsigned char **buf, off_t *offset);
+
+void stop_readahead(readahead_t *ra);
+
+void stop_bz2_readahead(bz_info_t *bfile);
+
+/* output to a file descriptor, see init_output() */
+#define OUTPUT_BUFSIZE 1048576
+
+typedef struct {
+  int fd;
+  unsigned char *buffer;            /* OUTPUT_BUFSIZE bytes, page aligned */
+  size_t fill;                      /* bytes in it so far */
+  int64_t written;                  /* bytes handed to fd in all */
+} output_t;
+
+output_t *init_output(int fd);
+
+int flush_output(output_t *out);
+
+unsigned char *output_space(output_t *out, size_t *len);
+
+void output_commit(output_t *out, size_t len);
+
+int output_write(output_t *out, unsigned char *buf, size_t len);
+
+int free_output(output_t *out);
+
+int check_bz2_block_header(int fin, off_t block_start, int bits_shifted, unsigned char *header);
+
+int check_bz2_block(int fin, bz_info_t *bfile);
+
+int check_bz2_footer(int fin, off_t offset, int bits_shifted, off_t file_size);
+
 off_t find_first_bz2_block_from_offset(bz_info_t *bfile, int fin, off_t position,
-				       int direction, off_t filesize, int do_seek);
+				       int direction, off_t filesize);
+
+int read_block_crc(int fin, off_t block_start, int bits_shifted, uint32_t *crc);
+
+/* flags for block map entries */
+#define BMAP_GENUINE 1    /* marker starts a block that decompresses */
+
+/* one block marker found in a bz2 file */
+typedef struct {
+  off_t offset;         /* block start, as set by find_next_bz2_block_marker() */
+  int bits_shifted;     /* block is right shifted this many bits */
+  int flags;            /* BMAP_ flags, no flags means a false marker */
+  uint32_t crc;         /* block crc, for genuine blocks */
+  int64_t uncompressed_offset; /* offset in the uncompressed data of the whole
+				  file at which the block's output starts, -1
+				  if not known */
+  int64_t first_page_id; /* first and last page ids and rev ids whose <page> or */
+  int64_t last_page_id;  /* <revision> tags start in the block's output, 0 if */
+  int64_t first_rev_id;  /* there are none, -1 if not known */
+  int64_t last_rev_id;
+} bmap_entry_t;
+
+/* one bz2 stream in a (possibly multistream) bz2 file */
+typedef struct {
+  off_t start;          /* offset of the "BZh" stream header, -1 if the stream has none */
+  off_t end;            /* end of stream marker, with the same convention as block
+			   offsets, -1 if the stream has none */
+  int end_bits_shifted; /* end of stream marker is right shifted this many bits */
+  uint32_t crc;         /* stream crc, from after the end of stream marker */
+} bmap_stream_t;
+
+/* all block markers and streams in a bz2 file, as stored in its .bmap sidecar file */
+typedef struct {
+  off_t file_size;      /* size of the bz2 file when the map was made */
+  int64_t mtime;        /* mtime of the bz2 file when the map was made */
+  int64_t count;        /* number of entries */
+  int64_t allocated;    /* number of entries there is room for */
+  bmap_entry_t *entries;
+  int64_t stream_count; /* number of streams */
+  int64_t streams_allocated;
+  bmap_stream_t *streams;
+  int fd;               /* descriptor of the bz2 file the map is in use for, or -1 */
+} bmap_t;
+
+bmap_t *init_block_map();
+
+void free_block_map(bmap_t *map);
+
+int add_block_map_entry(bmap_t *map, off_t offset, int bits_shifted, int flags, uint32_t crc);
+
+int add_block_map_stream(bmap_t *map, off_t start, off_t end, int end_bits_shifted, uint32_t crc);
+
+int set_block_map_file_info(bmap_t *map, int fin);
+
+char *get_block_map_filename(char *filename);
+
+int write_block_map(bmap_t *map, char *mapname);
+
+bmap_t *read_block_map(char *mapname);
+
+bmap_t *load_block_map(char *filename, int fin);
+
+int find_block_in_block_map(int fin, off_t position, int direction, int genuine_only, bmap_entry_t **entry);
+
+int find_stream_in_block_map(int fin, off_t position, bmap_stream_t **stream);
+
+/* what to record about each block when decompressing the file for the map */
+#define BMAP_UNCOMPRESSED_OFFSETS 1
+#define BMAP_IDS 2
+
+int add_block_contents_to_block_map(int fin, bmap_t *map, int contents);
+
+int find_block_for_uncompressed_offset(int fin, int64_t uoffset, bmap_entry_t **entry);
+
+int find_block_for_page_id(int fin, int64_t page_id, bmap_entry_t **entry);
+
+int get_last_id_from_block_map(int fin, int rev, int64_t *id);
+
+int seek_to_uncompressed_offset(ubuf_t *u, int fin, bz_info_t *bfile, int64_t uoffset);
+
+/* parallel block scans read this many bytes past the end of each
+   range, so that markers straddling two ranges are not lost */
+#define SCAN_RANGE_OVERLAP 7
+
+int scan_bz2_blocks(int fin, int threads, int validate, bmap_t *map);
+
+int decode_bz2_block(int fin, off_t block_start, int bits_shifted,
+		     unsigned char *out, size_t out_cap, size_t *out_len);
+
+void free_bz2_decoder_pool(void);
+
+/* blocks held at once by decompress_blocks_parallel(), per thread */
+#define PARALLEL_WINDOW 3
+/* input buffer of each pooled block decoder */
+#define PARALLEL_BUFINSIZE 65536
+
+/* handed each block's output by decompress_blocks_parallel(), in order;
+   returns 0 to go on, 1 to stop, -1 on error */
+typedef int (*block_output_t)(unsigned char *buf, size_t len, void *data);
+
+int decompress_blocks_parallel(int fin, off_t position, int threads,
+			       block_output_t output, void *data);
 
 #endif
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <regex.h>
 #include <inttypes.h>
@@ -18,14 +19,26 @@
 
 void usage(char *message) {
   char * help =
-"Usage: showcrcs --filename file\n"
+"Usage: showcrcs --filename file [--threads num] [--statefile file]\n"
 "       [--verbose] [--help] [--version]\n\n"
 "Show the offsets of all bz2 blocks in file, in order, along with their crcs.\n"
-"Blocks are detected by checking for start of block markers and doing partial\n"
-"decompression to be sure that the marker is not just part of some compressed\n"
-"data.\n\n"
+"Blocks are detected by checking for start of block markers and checking the\n"
+"block header that follows to be sure that the marker is not just part of some\n"
+"compressed data.\n\n"
+"With more than one thread, the file is split into parts which are scanned\n"
+"for blocks at the same time; the output is the same.\n\n"
+"With a state file, the file may still be being written.  Only the part of the\n"
+"file not seen by the last run with the same state file is scanned.  The offsets\n"
+"and crcs of the blocks completed since then are shown, as are the computed and\n"
+"stored crcs of any streams ended since then, and finally the offset and crc of\n"
+"the newest complete block, if any, in the form\n"
+"  last_complete_block offset:<num> CRC:<crc>\n"
+"A block is complete once the next block or end of stream marker has been\n"
+"written.\n\n"
 "Options:\n\n"
 "  -f, --filename   name of file to search\n"
+"  -t, --threads    number of threads to scan the file with (default: 1)\n"
+"  -s, --statefile  name of file in which to keep the scan position between runs\n"
 "  -v, --verbose    Show processing messages\n"
 "  -h, --help       Show this help message\n"
 "  -V, --version    Display the version of this program and exit\n\n"
@@ -74,29 +87,37 @@ void init_bz2_info(bz_info_t *bfile, int fin) {
   bfile->eof = 0;
   bfile->file_size = get_file_size(fin);
   bfile->header_read = 0;
+  bfile->window = NULL;
+  bfile->readahead = 0;
+  bfile->ra = NULL;
 
   bfile->initialized++;
 }
 
-void show_crc(unsigned char *otherbuffer, int fin, off_t block_start, int bits_shifted, uint64_t *block_crc, int verbose) {
+/*
+   show the crc of the block at block_start, reading it through the
+   read window w if given (after a search for the block, the window
+   already holds it), or else straight from the file
+ */
+void show_crc(read_window_t *w, int fin, off_t block_start, int bits_shifted, uint64_t *block_crc, int verbose) {
   uint64_t crc = (uint64_t)0;
   unsigned char buffer[5];
-  off_t seekres;
-  int res = 0;
+  unsigned char *bytes;
+  off_t offset;
+  size_t got;
 
   /* block marker is 6 bytes long, if it's bit-shifted then some bits of the crc
-   will be in the 6th byte, otherwise only (byte-aligned) in the 7th*/
-  if (bits_shifted)
-    seekres = lseek(fin, block_start + (off_t)6, SEEK_SET);
-  else
-    seekres = lseek(fin, block_start + (off_t)7, SEEK_SET);
-  if (seekres == (off_t)-1) {
-    fprintf(stderr,"lseek of file failed\n");
-    exit(1);
+   will be in the 6th byte, otherwise only (byte-aligned) in the 7th.
+   we need the next 4 bytes for the crc, 5 if we have bit-shifting so just get 5 */
+  offset = block_start + (off_t)(bits_shifted ? 6 : 7);
+  memset(buffer, 0, 5);
+  if (w) {
+    bytes = read_window_get(w, offset, 5, &got);
+    if (bytes == NULL)
+      exit(-1);
+    memcpy(buffer, bytes, got < 5 ? got : 5);
   }
-  /* we need the next 4 bytes for the crc, 5 if we have bit-shifting so just get 5 */
-  res = read(fin, buffer, 5);
-  if (res == -1) {
+  else if (pread_all(fin, buffer, 5, offset) == -1) {
     fprintf(stderr,"read of file failed\n");
     exit(-1);
   }
@@ -128,18 +149,35 @@ void show_crc(unsigned char *otherbuffer, int fin, off_t block_start, int bits_s
   *block_crc = crc;
 }
 
+/*
+   fold the crc of the next block into the cumulative stream crc
+   returns:
+     the new cumulative crc
+ */
+uint64_t add_block_crc(uint64_t computed_cumul_crc, uint64_t block_crc, int verbose) {
+  if (verbose) {
+    fprintf(stdout, "1's complement of block crc: 0x%lx\n", block_crc ^ 0xffffffff);
+    fprintf(stderr, "current cumul crc: 0x%lx, ", computed_cumul_crc);
+  }
+  computed_cumul_crc = combine_crc(computed_cumul_crc, (block_crc ^ 0xffffffff));
+  computed_cumul_crc &= 0xffffffff;
+  if (verbose)
+    fprintf(stderr, " NEW cumul crc: 0x%lx\n", computed_cumul_crc);
+  return(computed_cumul_crc);
+}
+
 /*
    from current point in the file, find the next bz2 block and display
    crc/offset information
  */
 off_t do_next_block(bz_info_t *bfile, int fin, off_t offset, uint64_t *block_crc, off_t filesize, int verbose) {
-  offset = find_first_bz2_block_from_offset(bfile, fin, offset, FORWARD, filesize, 0);
+  offset = find_first_bz2_block_from_offset(bfile, fin, offset, FORWARD, filesize);
   if (!offset) {
     return(0);
   }
   else if (offset > (off_t)0) {
     fprintf(stdout, "offset:%"PRId64" ", offset);
-    show_crc(bfile->block_info, fin, bfile->block_start, bfile->bits_shifted, block_crc, verbose);
+    show_crc(bfile->window, fin, bfile->block_start, bfile->bits_shifted, block_crc, verbose);
     return(offset);
   }
   else {
@@ -148,6 +186,237 @@ off_t do_next_block(bz_info_t *bfile, int fin, off_t offset, uint64_t *block_crc
   }
 }
 
+/*
+   find all bz2 blocks in the file by scanning parts of it in
+   parallel, and display crc/offset information for each,
+   combining the block crcs into the cumulative crc
+   returns:
+     the cumulative crc
+ */
+uint64_t do_all_blocks_threaded(int fin, int threads, int verbose) {
+  bmap_t *map;
+  int64_t i;
+  uint64_t block_crc = 0u;
+  uint64_t computed_cumul_crc = 0u;
+  read_window_t *w;
+
+  map = init_block_map();
+  if (map == NULL || scan_bz2_blocks(fin, threads, 1, map) == -1) {
+    fprintf(stderr,"Failed to find the block markers due to some error\n");
+    exit(-1);
+  }
+  w = init_read_window(fin);
+  if (w == NULL)
+    exit(-1);
+  for (i = 0; i < map->count; i++) {
+    if (!(map->entries[i].flags & BMAP_GENUINE))
+      continue;
+    fprintf(stdout, "offset:%"PRId64" ", map->entries[i].offset);
+    show_crc(w, fin, map->entries[i].offset, map->entries[i].bits_shifted, &block_crc, verbose);
+    computed_cumul_crc = add_block_crc(computed_cumul_crc, block_crc, verbose);
+  }
+  free_read_window(w);
+  free_block_map(map);
+  return(computed_cumul_crc);
+}
+
+/*
+  what an incremental scan (see scan_new_blocks()) remembers between runs
+*/
+typedef struct {
+  off_t scanned;           /* offset up to which the file has been scanned for markers */
+  off_t last_offset;       /* newest block found, which may not be complete yet, or -1 */
+  int last_bits_shifted;
+  off_t complete_offset;   /* newest complete block, or -1 */
+  uint64_t complete_crc;
+  uint64_t cumul_crc;      /* combined crc of the complete blocks in the current stream */
+} scan_state_t;
+
+/*
+  read the scan state from the state file; if there is none,
+  the state is that of a scan that has not started
+
+  returns:
+    0 on success, -1 on error
+*/
+int read_scan_state(char *statefile, scan_state_t *state) {
+  FILE *fstate;
+  int64_t scanned, last_offset, complete_offset;
+
+  state->scanned = (off_t)0;
+  state->last_offset = (off_t)-1;
+  state->last_bits_shifted = 0;
+  state->complete_offset = (off_t)-1;
+  state->complete_crc = 0u;
+  state->cumul_crc = 0u;
+
+  fstate = fopen(statefile, "r");
+  if (fstate == NULL) {
+    if (errno == ENOENT)
+      return(0);
+    fprintf(stderr,"failed to open state file %s for read\n", statefile);
+    return(-1);
+  }
+  if (fscanf(fstate, "scanned:%"SCNd64" last_offset:%"SCNd64" last_bits_shifted:%d "
+	     "complete_offset:%"SCNd64" complete_CRC:0x%"SCNx64" cumul_CRC:0x%"SCNx64,
+	     &scanned, &last_offset, &(state->last_bits_shifted),
+	     &complete_offset, &(state->complete_crc), &(state->cumul_crc)) != 6) {
+    fprintf(stderr,"bad state file %s\n", statefile);
+    fclose(fstate);
+    return(-1);
+  }
+  fclose(fstate);
+  state->scanned = (off_t)scanned;
+  state->last_offset = (off_t)last_offset;
+  state->complete_offset = (off_t)complete_offset;
+  return(0);
+}
+
+/*
+  write the scan state to the state file, replacing it
+  all at once so that a reader never sees it half written
+
+  returns:
+    0 on success, -1 on error
+*/
+int write_scan_state(char *statefile, scan_state_t *state) {
+  FILE *fstate;
+  char *tempname;
+
+  tempname = malloc(strlen(statefile) + strlen(".tmp") + 1);
+  if (tempname == NULL) {
+    fprintf(stderr,"failed to allocate state file name\n");
+    return(-1);
+  }
+  strcpy(tempname, statefile);
+  strcat(tempname, ".tmp");
+  fstate = fopen(tempname, "w");
+  if (fstate == NULL) {
+    fprintf(stderr,"failed to open state file %s for write\n", tempname);
+    free(tempname);
+    return(-1);
+  }
+  fprintf(fstate, "scanned:%"PRId64" last_offset:%"PRId64" last_bits_shifted:%d "
+	  "complete_offset:%"PRId64" complete_CRC:0x%08"PRIx64" cumul_CRC:0x%08"PRIx64"\n",
+	  (int64_t)state->scanned, (int64_t)state->last_offset, state->last_bits_shifted,
+	  (int64_t)state->complete_offset, state->complete_crc, state->cumul_crc);
+  if (fclose(fstate) || rename(tempname, statefile)) {
+    fprintf(stderr,"failed to write state file %s\n", statefile);
+    free(tempname);
+    return(-1);
+  }
+  free(tempname);
+  return(0);
+}
+
+/*
+  the newest block found by the incremental scan is complete; show its
+  crc and fold it into the crc for the stream
+ */
+void complete_last_block(int fin, scan_state_t *state, int verbose) {
+  uint64_t block_crc = 0u;
+
+  fprintf(stdout, "offset:%"PRId64" ", (int64_t)state->last_offset);
+  show_crc(NULL, fin, state->last_offset, state->last_bits_shifted, &block_crc, verbose);
+  state->cumul_crc = add_block_crc(state->cumul_crc, block_crc, verbose);
+  state->complete_offset = state->last_offset;
+  state->complete_crc = block_crc;
+  state->last_offset = (off_t)-1;
+}
+
+/*
+  scan the part of a file that may still be growing which is past
+  the point the last scan reached, showing blocks as they are
+  completed by the next marker and streams as they are ended.
+  the scan stops short of any marker which does not yet have all
+  of its block header or stream crc written, so that it is
+  checked again next time.
+
+  returns:
+    0 on success, -1 on error
+ */
+int scan_new_blocks(int fin, scan_state_t *state, int verbose) {
+  unsigned char *window;
+  unsigned char header[4];
+  off_t file_size, offset, marker_start;
+  ssize_t bytes_read;
+  int pos, index, bits_shifted, marker_type, res;
+  uint32_t stream_crc;
+
+  file_size = get_file_size(fin);
+  if (file_size < state->scanned) {
+    fprintf(stderr,"file is shorter than when it was last scanned, starting over\n");
+    state->scanned = (off_t)0;
+    state->last_offset = (off_t)-1;
+    state->complete_offset = (off_t)-1;
+    state->cumul_crc = 0u;
+  }
+  if (pread_all(fin, header, 4, (off_t)0) < 4) {
+    /* nothing written yet */
+    return(0);
+  }
+  window = malloc(MARKER_SCAN_MAX);
+  if (window == NULL) {
+    fprintf(stderr,"failed to allocate marker scan buffer\n");
+    return(-1);
+  }
+  offset = state->scanned;
+  while (1) {
+    bytes_read = pread_all(fin, window, MARKER_SCAN_MAX, offset);
+    if (bytes_read == -1) {
+      fprintf(stderr,"read of file failed\n");
+      free(window);
+      return(-1);
+    }
+    if (bytes_read < 7)
+      break;
+    pos = 0;
+    while ((index = find_bz2_marker_in_buffer(window + pos, bytes_read - pos,
+					      &bits_shifted, &marker_type)) >= 0) {
+      marker_start = offset + (off_t)(pos + index);
+      pos += index + 1;
+      if (marker_type == BZ2_MARKER_BLOCK)
+	res = check_bz2_block_header(fin, marker_start, bits_shifted, header);
+      else
+	res = check_bz2_footer(fin, marker_start, bits_shifted, file_size);
+      if (res == -1) {
+	free(window);
+	return(-1);
+      }
+      if (res == 2 || marker_start + (off_t)11 > file_size) {
+	/* not all written yet, look at it again next time */
+	state->scanned = marker_start;
+	free(window);
+	return(0);
+      }
+      if (!res)
+	continue;
+      if (state->last_offset >= (off_t)0)
+	complete_last_block(fin, state, verbose);
+      if (marker_type == BZ2_MARKER_BLOCK) {
+	state->last_offset = marker_start;
+	state->last_bits_shifted = bits_shifted;
+      }
+      else {
+	if (read_block_crc(fin, marker_start, bits_shifted, &stream_crc) == -1) {
+	  free(window);
+	  return(-1);
+	}
+	fprintf(stdout, "computed_stream_CRC:0x%lx\n", state->cumul_crc);
+	fprintf(stdout, "extracted_stream_CRC:0x%lx\n", (uint64_t)stream_crc);
+	state->cumul_crc = 0u;
+      }
+    }
+    /* every window position with 7 bytes after it was checked */
+    offset += (off_t)(bytes_read - 6);
+    if (bytes_read < MARKER_SCAN_MAX)
+      break;
+  }
+  state->scanned = offset;
+  free(window);
+  return(0);
+}
+
 void show_stream_crc(bz_info_t *bfile, int fin, int verbose) {
   /*
     find the stream crc from the bzip2 footer at the
@@ -193,6 +462,9 @@ int main(int argc, char **argv) {
   int fin;
   char *filename = NULL;
   int verbose = 0;
+  int threads = 1;
+  char *statefile = NULL;
+  scan_state_t state;
   int optindex=0;
   int optc;
   bz_info_t bfile;
@@ -204,16 +476,26 @@ int main(int argc, char **argv) {
   struct option optvalues[] = {
     {"filename", 1, 0, 'f'},
     {"help", 0, 0, 'h'},
+    {"statefile", 1, 0, 's'},
+    {"threads", 1, 0, 't'},
     {"verbose", 0, 0, 'v'},
     {"version", 0, 0, 'V'},
     {NULL, 0, NULL, 0}
   };
 
   while (1) {
-    optc=getopt_long_only(argc,argv,"f:hvV", optvalues, &optindex);
+    optc=getopt_long_only(argc,argv,"f:hs:t:vV", optvalues, &optindex);
     if (optc=='f') {
      filename=optarg;
     }
+    else if (optc=='s') {
+      statefile=optarg;
+    }
+    else if (optc=='t') {
+      if (!(isdigit(optarg[0]))) usage("Bad argument to threads option\n");
+      threads=atoi(optarg);
+      if (threads < 1) usage("Bad argument to threads option\n");
+    }
     else if (optc=='h')
       usage(NULL);
     else if (optc=='v')
@@ -233,6 +515,18 @@ int main(int argc, char **argv) {
     fprintf(stderr,"Failed to open file %s for read\n", filename);
     exit(1);
   }
+  set_io_policy(fin, IO_POLICY_STREAM);
+
+  if (statefile) {
+    if (read_scan_state(statefile, &state) == -1 ||
+	scan_new_blocks(fin, &state, verbose) == -1 ||
+	write_scan_state(statefile, &state) == -1)
+      exit(-1);
+    if (state.complete_offset >= (off_t)0)
+      fprintf(stdout, "last_complete_block offset:%"PRId64" CRC:0x%08lx\n",
+	      (int64_t)state.complete_offset, state.complete_crc);
+    exit(0);
+  }
 
   bfile.initialized = 0;
   bfile.marker = NULL;
@@ -240,19 +534,17 @@ int main(int argc, char **argv) {
   init_bz2_info(&bfile, fin);
   filesize = get_file_size(fin);
 
-  while (1) {
-    offset = do_next_block(&bfile, fin, offset, &block_crc, filesize, verbose);
-    if (!offset)
-      break;
-    offset += (off_t)1;
-    if (verbose) {
-      fprintf(stdout, "1's complement of block crc: 0x%lx\n", block_crc ^ 0xffffffff);
-      fprintf(stderr, "current cumul crc: 0x%lx, ", computed_cumul_crc);
+  if (threads > 1) {
+    computed_cumul_crc = do_all_blocks_threaded(fin, threads, verbose);
+  }
+  else {
+    while (1) {
+      offset = do_next_block(&bfile, fin, offset, &block_crc, filesize, verbose);
+      if (!offset)
+	break;
+      offset += (off_t)1;
+      computed_cumul_crc = add_block_crc(computed_cumul_crc, block_crc, verbose);
     }
-    computed_cumul_crc = combine_crc(computed_cumul_crc, (block_crc ^ 0xffffffff));
-    computed_cumul_crc &= 0xffffffff;
-    if (verbose)
-      fprintf(stderr, " NEW cumul crc: 0x%lx\n", computed_cumul_crc);
   }
   computed_cumul_crc &= 0xffffffff;
   fprintf(stdout, "computed_stream_CRC:0x%lx\n", computed_cumul_crc);
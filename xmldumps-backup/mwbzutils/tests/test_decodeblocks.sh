@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# test decode_bz2_block(), decoding each block on its own with several
+# threads sharing the descriptor, against the output of bzip2
+
+test_setup() {
+    rm -rf tests/output
+    mkdir -p tests/output/temp
+}
+
+if [ ! -e dumpbz2filefromoffset ]; then
+    echo "Run this script from the dumps repo directory containing the dumpbz2filefromoffset binary."
+    exit 1
+fi
+
+do_tests() {
+    inputfile_one="$1"
+    inputfile_multi="$2"
+    make -s decodeblocks > /dev/null
+    bzip2 -dc "${inputfile_one}" > tests/output/temp/one-expected.txt
+    bzip2 -dc "${inputfile_multi}" > tests/output/temp/multi-expected.txt
+    ./decodeblocks -f "${inputfile_one}" > tests/output/temp/one.txt
+    ./decodeblocks -f "${inputfile_one}" -t 1 > tests/output/temp/one-single.txt
+    # buffers too small for any block, so each comes back full and is tried again
+    ./decodeblocks -f "${inputfile_one}" -b 100 > tests/output/temp/one-small.txt
+    ./decodeblocks -f "${inputfile_multi}" -t 4 > tests/output/temp/multi.txt
+}
+
+check_tests() {
+    errors=0
+    for outfile in one.txt one-single.txt one-small.txt multi.txt; do
+	expected="one-expected.txt"
+	if [ "${outfile}" == "multi.txt" ]; then
+	    expected="multi-expected.txt"
+	fi
+	cmp -s "tests/output/temp/${outfile}" "tests/output/temp/${expected}"
+	if [ $? != 0 ]; then
+	    echo "TEST FAILED, decoded blocks in tests/output/temp/${outfile} differ from bzip2 output"
+	    errors=$(( ${errors} + 1 ))
+	fi
+    done
+    if [ $errors != "0" ]; then
+	echo "TEST FAILURES in $errors tests"
+    else
+	echo "SUCCESS"
+    fi
+}
+
+test_setup
+do_tests tests/input/sample-pages-articles.xml.bz2 tests/output_expected/recompressxml/pages-articles-p2566p2583.multistream.xml.bz2
+check_tests
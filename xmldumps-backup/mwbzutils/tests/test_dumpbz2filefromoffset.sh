@@ -17,6 +17,11 @@ do_tests() {
     ./dumpbz2filefromoffset "$inputfile" 1486591  | bzip2 > tests/output/from-offset-1486591-page.bz2
     ./dumpbz2filefromoffset "$inputfile" 1486591 raw  | bzip2 > tests/output/from-offset-1486591-raw.bz2
     ./dumpbz2filefromoffset "$inputfile" 1663000 raw 2>&1 | bzip2 > tests/output/from-offset-1663000-raw.bz2
+    ./dumpbz2filefromoffset --threads 2 "$inputfile" 1486591  | bzip2 > tests/output/threads-from-offset-1486591-page.bz2
+    ./dumpbz2filefromoffset --threads 2 "$inputfile" 1486591 raw  | bzip2 > tests/output/threads-from-offset-1486591-raw.bz2
+    MWBZUTILS_BWT=twoway ./dumpbz2filefromoffset "$inputfile" 0 raw > tests/output/temp/twoway.txt
+    ./dumpbz2filefromoffset "$inputfile" 0 raw | cat > tests/output/temp/piped.txt
+    bzcat "$inputfile" > tests/output/temp/bzcat.txt
 }
 
 check_tests() {
@@ -31,6 +36,26 @@ check_tests() {
 	    errors=$(( ${errors} + 1 ))
 	fi
     done
+    for outfile in from-offset-1486591-page.bz2 from-offset-1486591-raw.bz2; do
+	bzcat "tests/output/threads-${outfile}" > "tests/output/temp/got.txt"
+	bzcat "tests/output_expected/dumpbz2filefromoffset/${outfile}" > "tests/output/temp/expected.txt"
+	cmp -s "tests/output/temp/got.txt" "tests/output/temp/expected.txt"
+	if [ $? != 0 ]; then
+	    echo "TEST FAILED, diff between tests/output/threads-${outfile} and tests/output_expected/dumpbz2filefromoffset/${outfile}:"
+	    /usr/bin/diff "tests/output/temp/got.txt" "tests/output/temp/expected.txt"
+	    errors=$(( ${errors} + 1 ))
+	fi
+    done
+    cmp -s "tests/output/temp/twoway.txt" "tests/output/temp/bzcat.txt"
+    if [ $? != 0 ]; then
+	echo "TEST FAILED, dump with MWBZUTILS_BWT=twoway differs from bzcat output"
+	errors=$(( ${errors} + 1 ))
+    fi
+    cmp -s "tests/output/temp/piped.txt" "tests/output/temp/bzcat.txt"
+    if [ $? != 0 ]; then
+	echo "TEST FAILED, dump to a pipe differs from bzcat output"
+	errors=$(( ${errors} + 1 ))
+    fi
     if [ $errors != "0" ]; then
 	echo "TEST FAILURES in $errors tests"
     else
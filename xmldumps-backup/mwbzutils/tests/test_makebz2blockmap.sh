@@ -0,0 +1,102 @@
+#!/bin/bash
+
+# test makebz2blockmap, and the utilities that use block maps
+
+test_setup() {
+    rm -rf tests/output
+    mkdir -p tests/output/temp
+}
+
+if [ ! -e makebz2blockmap ]; then
+    echo "Run this script from the dumps repo directory containing the makebz2blockmap binary."
+    exit 1
+fi
+
+do_tests() {
+    inputfile_one="$1"
+    inputfile_two="$2"
+    inputfile_multi="$3"
+    # the maps go next to the bz2 files, so work on copies
+    cp "${inputfile_one}" tests/output/temp/one.xml.bz2
+    cp "${inputfile_two}" tests/output/temp/two.xml.bz2
+    ./makebz2blockmap -f tests/output/temp/one.xml.bz2
+    ./makebz2blockmap -f tests/output/temp/two.xml.bz2
+    # a threaded scan must find the same blocks
+    ./makebz2blockmap -f tests/output/temp/one.xml.bz2 -t 5 -m tests/output/temp/one-threaded.bmap
+    cp "${inputfile_multi}" tests/output/temp/multi.xml.bz2
+    ./makebz2blockmap -f tests/output/temp/multi.xml.bz2 -v 2>&1 | grep '^stream' > tests/output/multistream-streams.txt
+    ./findpageidinbz2xml -f tests/output/temp/two.xml.bz2 -p 2850 > tests/output/page-2580.txt
+    ./findpageidinbz2xml -f tests/output/temp/one.xml.bz2 -p 2681 > tests/output/page-2681.txt
+    ./getlastidinbz2xml -f tests/output/temp/one.xml.bz2 -t page > tests/output/page-big.txt
+    ./getlastidinbz2xml -f tests/output/temp/one.xml.bz2 -t rev > tests/output/rev-big.txt
+    ./dumplastbz2block tests/output/temp/one.xml.bz2 | bzip2 > tests/output/pages-articles-last-block.bz2
+    ./dumpbz2filefromoffset tests/output/temp/one.xml.bz2 1486591 | bzip2 > tests/output/from-offset-1486591-page.bz2
+    # dumps from an offset in the uncompressed data need the uncompressed block offsets
+    cp "${inputfile_one}" tests/output/temp/uncompressed.xml.bz2
+    ./makebz2blockmap -f tests/output/temp/uncompressed.xml.bz2 -u
+    ./dumpbz2filefromoffset tests/output/temp/uncompressed.xml.bz2 3000000 uncompressed > tests/output/from-uncompressed-3000000.txt
+    # with page and rev ids in the map, no decompression is needed for these
+    cp "${inputfile_one}" tests/output/temp/ids.xml.bz2
+    ./makebz2blockmap -f tests/output/temp/ids.xml.bz2 -i
+    ./findpageidinbz2xml -f tests/output/temp/ids.xml.bz2 -p 2681 > tests/output/ids-page-2681.txt
+    ./getlastidinbz2xml -f tests/output/temp/ids.xml.bz2 -t page > tests/output/ids-page-big.txt
+    ./getlastidinbz2xml -f tests/output/temp/ids.xml.bz2 -t rev > tests/output/ids-rev-big.txt
+}
+
+check_tests() {
+    errors=0
+    for outfile in findpageidinbz2xml/page-2580.txt findpageidinbz2xml/page-2681.txt \
+		   getlastidinbz2xml/page-big.txt getlastidinbz2xml/rev-big.txt \
+		   makebz2blockmap/multistream-streams.txt; do
+	got="tests/output/$( basename ${outfile} )"
+	cmp -s "${got}" "tests/output_expected/${outfile}"
+	if [ $? != 0 ]; then
+	    echo "TEST FAILED, diff between ${got} and tests/output_expected/${outfile}:"
+	    /usr/bin/diff "${got}" "tests/output_expected/${outfile}"
+	    errors=$(( ${errors} + 1 ))
+	fi
+    done
+    for outfile in findpageidinbz2xml/page-2681.txt getlastidinbz2xml/page-big.txt \
+		   getlastidinbz2xml/rev-big.txt; do
+	got="tests/output/ids-$( basename ${outfile} )"
+	cmp -s "${got}" "tests/output_expected/${outfile}"
+	if [ $? != 0 ]; then
+	    echo "TEST FAILED, diff between ${got} and tests/output_expected/${outfile}:"
+	    /usr/bin/diff "${got}" "tests/output_expected/${outfile}"
+	    errors=$(( ${errors} + 1 ))
+	fi
+    done
+    cmp -s tests/output/temp/one.xml.bz2.bmap tests/output/temp/one-threaded.bmap
+    if [ $? != 0 ]; then
+	echo "TEST FAILED, block maps from one and from several threads differ"
+	errors=$(( ${errors} + 1 ))
+    fi
+    bzcat tests/output/temp/one.xml.bz2 | tail -c +3000001 > tests/output/temp/expected.txt
+    cmp -s tests/output/from-uncompressed-3000000.txt tests/output/temp/expected.txt
+    if [ $? != 0 ]; then
+	echo "TEST FAILED, dump from uncompressed offset 3000000 differs from bzcat output"
+	errors=$(( ${errors} + 1 ))
+    fi
+    for outfile in dumplastbz2block/pages-articles-last-block.bz2 \
+		   dumpbz2filefromoffset/from-offset-1486591-page.bz2; do
+	got="tests/output/$( basename ${outfile} )"
+	bzcat "${got}" > "tests/output/temp/got.txt"
+	bzcat "tests/output_expected/${outfile}" > "tests/output/temp/expected.txt"
+	cmp -s "tests/output/temp/got.txt" "tests/output/temp/expected.txt"
+	if [ $? != 0 ]; then
+	    echo "TEST FAILED, diff between ${got} and tests/output_expected/${outfile}:"
+	    /usr/bin/diff "tests/output/temp/got.txt" "tests/output/temp/expected.txt" | head -10
+	    errors=$(( ${errors} + 1 ))
+	fi
+    done
+    if [ $errors != "0" ]; then
+	echo "TEST FAILURES in $errors tests"
+    else
+	echo "SUCCESS"
+    fi
+}
+
+test_setup
+do_tests tests/input/sample-pages-articles.xml.bz2 tests/input/pages-articles-p2566p2583.xml.bz2 \
+	 tests/output_expected/recompressxml/pages-articles-p2566p2583.multistream.xml.bz2
+check_tests
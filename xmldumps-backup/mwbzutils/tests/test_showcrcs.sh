@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# test showcrcs, including scanning a file while it grows, with a state file,
+# and a block with more selectors than bzip2 uses (BZ_MAX_SELECTORS), which
+# bzip2 1.0.8 accepts
+
+test_setup() {
+    rm -rf tests/output
+    mkdir -p tests/output/temp
+}
+
+if [ ! -e showcrcs ]; then
+    echo "Run this script from the dumps repo directory containing the showcrcs binary."
+    exit 1
+fi
+
+do_tests() {
+    inputfile_one="$1"
+    inputfile_two="$2"
+    inputfile_three="$3"
+    ./showcrcs -f "${inputfile_one}" > tests/output/sample-crcs.txt
+    ./showcrcs -f "${inputfile_one}" -t 4 > tests/output/sample-crcs-threaded.txt
+    ./showcrcs -f "${inputfile_three}" > tests/output/many-selectors-crcs.txt
+    # write the multistream file out a piece at a time, scanning after each piece
+    size=$( stat -c %s "${inputfile_two}" )
+    rm -f tests/output/temp/growing.state
+    for length in 700 2000 4730 4800 9000 15000 15410 15420 ${size} ${size}; do
+	head -c ${length} "${inputfile_two}" > tests/output/temp/growing.bz2
+	echo "length ${length}" >> tests/output/multistream-incremental.txt
+	./showcrcs -f tests/output/temp/growing.bz2 -s tests/output/temp/growing.state >> tests/output/multistream-incremental.txt
+    done
+}
+
+check_tests() {
+    errors=0
+    for outfile in sample-crcs.txt sample-crcs-threaded.txt multistream-incremental.txt many-selectors-crcs.txt; do
+	expected="${outfile}"
+	if [ "${outfile}" == "sample-crcs-threaded.txt" ]; then
+	    expected="sample-crcs.txt"
+	fi
+	cmp -s "tests/output/${outfile}" "tests/output_expected/showcrcs/${expected}"
+	if [ $? != 0 ]; then
+	    echo "TEST FAILED, diff between tests/output/${outfile} and tests/output_expected/showcrcs/${expected}:"
+	    /usr/bin/diff "tests/output/${outfile}" "tests/output_expected/showcrcs/${expected}"
+	    errors=$(( ${errors} + 1 ))
+	fi
+    done
+    if [ $errors != "0" ]; then
+	echo "TEST FAILURES in $errors tests"
+    else
+	echo "SUCCESS"
+    fi
+}
+
+test_setup
+do_tests tests/input/sample-pages-articles.xml.bz2 tests/output_expected/recompressxml/pages-articles-p2566p2583.multistream.xml.bz2 tests/input/many-selectors.xml.bz2
+check_tests